@@ -0,0 +1,130 @@
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "../config.h"
+#include "stats.h"
+
+/*
+ * Times the authorization lookup (config_has_entry) on its own, for
+ * configurations from 1 to 1M lines of different shapes:
+ *
+ * entries  - regular entries, with the one we look for at the end.
+ * comments - comment lines, with the entry at the end.
+ * prefix   - entries sharing all but the last character with the one
+ *            we look for, so every comparison runs to the end.
+ * long     - lines longer than the lookup buffer, which go through the
+ *            loop that drains them piece by piece.
+ * missing  - regular entries without the one we look for, which is
+ *            what every denied launch pays for.
+ *
+ * usage: config_scaling [-m max_lines]
+ */
+
+#define TARGET_USER "builder"
+#define TARGET_BASE "/bldroot/images/base"
+#define LONG_LINE 256
+
+static void write_config(FILE* f, const char* kind, int lines) {
+  int i;
+  int fillers = strcmp(kind, "missing") == 0 ? lines : lines - 1;
+  for (i = 0; i < fillers; i++) {
+    if (strcmp(kind, "comments") == 0) {
+      fprintf(f, "# %d: images for team %d, do not remove\n", i, i);
+    } else if (strcmp(kind, "prefix") == 0) {
+      fprintf(f, "%s:%s%c\n", TARGET_USER, TARGET_BASE, 'a' + i % 26);
+    } else if (strcmp(kind, "long") == 0) {
+      char path[LONG_LINE];
+      memset(path, 'd', sizeof(path) - 1);
+      path[sizeof(path) - 1] = 0;
+      fprintf(f, "user%d:/%s\n", i, path);
+    } else {
+      fprintf(f, "user%d:/bldroot/images/team%d\n", i, i);
+    }
+  }
+  if (fillers < lines) {
+    fprintf(f, "%s:%s\n", TARGET_USER, TARGET_BASE);
+  }
+}
+
+static void measure(const char* kind, int lines) {
+  char path[] = "/tmp/userchroot-config-XXXXXX";
+  char label[64];
+  char line[] = TARGET_USER ":" TARGET_BASE "\n";
+  int linelen = sizeof(line);
+  int i;
+  int fd = mkstemp(path);
+  FILE* f = fd < 0 ? NULL : fdopen(fd, "w+");
+  if (f == NULL) {
+    perror("config_scaling");
+    exit(1);
+  }
+  unlink(path);
+  write_config(f, kind, lines);
+  fflush(f);
+
+  int repeats = 1000000 / lines;
+  if (repeats > 1000) {
+    repeats = 1000;
+  }
+  if (repeats < 5) {
+    repeats = 5;
+  }
+  double* samples = malloc(repeats * sizeof(double));
+  if (samples == NULL) {
+    perror("config_scaling");
+    exit(1);
+  }
+  for (i = 0; i < repeats; i++) {
+    double start = stats_now_us();
+    int found = config_has_entry(f, line, linelen, NULL);
+    samples[i] = stats_now_us() - start;
+    if (found != (strcmp(kind, "missing") != 0)) {
+      fprintf(stderr, "config_scaling: wrong lookup result for %s\n", kind);
+      exit(1);
+    }
+  }
+  snprintf(label, sizeof(label), "%-8s %8d lines", kind, lines);
+  stats_print(stdout, label, samples, repeats);
+  free(samples);
+  fclose(f);
+}
+
+int main(int argc, char* argv[]) {
+  const char* kinds[] = { "entries", "comments", "prefix", "long", "missing" };
+  int max_lines = 1000000;
+  int opt;
+  unsigned int k;
+  int lines;
+  while ((opt = getopt(argc, argv, "m:")) != -1) {
+    if (opt == 'm') {
+      max_lines = atoi(optarg);
+    } else {
+      fprintf(stderr, "usage: config_scaling [-m max_lines]\n");
+      return 1;
+    }
+  }
+  for (k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+    for (lines = 1; lines <= max_lines; lines *= 10) {
+      measure(kinds[k], lines);
+    }
+  }
+  return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
@@ -0,0 +1,73 @@
+#!/bin/bash -e
+#
+# Builds a throw-away root filesystem on a tmpfs and runs a benchmark
+# or harness script inside it. This must run as root in a private user
+# and mount namespace (see nsrun.c), so that the whole tree, including
+# the configuration file and the setuid userchroot binary, is owned by
+# the fake root of the namespace. Nothing here touches the host.
+#
+# usage: nsrun fakeroot.sh BUILD_DIR SCRIPT [args...]
+#
+# BUILD_DIR is where "make" left bench/userchroot and the benchmark
+# programs. SCRIPT is one of the scripts in this directory.
+
+BUILD=$1
+SCRIPT=$2
+shift 2
+SOURCE=$(cd "$(dirname "$0")" && pwd)
+. "$SOURCE/lib.sh"
+
+ROOT=$(mktemp -d)
+mount -t tmpfs -o mode=755 userchroot-bench "$ROOT"
+mkdir -p "$ROOT"/etc "$ROOT"/dev "$ROOT"/proc "$ROOT"/tmp "$ROOT"/run \
+         "$ROOT"/bench "$ROOT"/opt/userchroot/bin
+chmod 1777 "$ROOT"/tmp
+share_host_tree "$ROOT"
+mount --rbind /dev "$ROOT"/dev
+mount --rbind /proc "$ROOT"/proc
+# page-cache.sh needs a cgroup v2 directory of the host to work in.
+if [ -n "$BENCH_CGROUP" ]; then
+  mkdir -p "$ROOT"/host-cgroup
+  mount --bind "$BENCH_CGROUP" "$ROOT"/host-cgroup
+fi
+
+echo "root:x:0:0:root:/:/bin/sh" > "$ROOT"/etc/passwd
+echo "$BENCH_USER:x:$BENCH_UID:$BENCH_UID:bench:/tmp:/bin/sh" >> "$ROOT"/etc/passwd
+echo "root:x:0:" > "$ROOT"/etc/group
+echo "$BENCH_USER:x:$BENCH_UID:" >> "$ROOT"/etc/group
+: > "$ROOT"/etc/userchroot.conf
+chmod 644 "$ROOT"/etc/userchroot.conf
+
+cp "$BUILD"/bench/userchroot "$ROOT"/opt/userchroot/bin/userchroot
+chmod 4755 "$ROOT"/opt/userchroot/bin/userchroot
+for f in "$BUILD"/bench/*; do
+  if [ -f "$f" ] && [ -x "$f" ]; then
+    cp "$f" "$ROOT"/bench/
+  fi
+done
+cp "$SOURCE"/*.sh "$ROOT"/bench/
+cp "$SOURCE"/../userchroot-jobserver.sh "$ROOT"/bench/
+
+# pivot_root rather than chroot: a chrooted process can't create user
+# namespaces, which golden images need.
+cd "$ROOT"
+mkdir .oldroot
+pivot_root . .oldroot
+exec /bin/bash -c 'umount -l /.oldroot && rmdir /.oldroot &&
+  exec /bin/bash -e /bench/"$0" "$@"' "$SCRIPT" "$@"
+
+# ----------------------------------------------------------------------------
+# Copyright 2015 Bloomberg Finance L.P.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+# ----------------------------- END-OF-FILE ----------------------------------
@@ -0,0 +1,683 @@
+#!/bin/bash -e
+#
+# Runs the whole launch and provisioning flow, including what must be
+# refused, against the harness build of userchroot, and reports every
+# check. It exits with a non-zero status if any of them failed.
+#
+# With arguments, it instead sets up the same image and runs them as
+# the bench user, e.g. "make harness HARNESS_COMMAND=bash" for a shell
+# from which to try things by hand.
+
+. /bench/lib.sh
+
+BASE=/images/base
+IMAGE=$BASE/img
+make_base $BASE
+make_image $BASE img
+
+if [ $# -gt 0 ]; then
+  echo "userchroot is $UC, the image is $IMAGE."
+  exec setpriv --reuid=$BENCH_UID --regid=$BENCH_UID --clear-groups \
+    --inh-caps=-all "$@"
+fi
+
+passed=0
+failed=0
+
+check() {
+  if [ "$1" = 0 ]; then
+    echo "ok    $2"
+    passed=$((passed + 1))
+  else
+    echo "FAIL  $2"
+    cat /tmp/harness.out | sed 's/^/        /'
+    failed=$((failed + 1))
+  fi
+}
+
+# expect_ok DESCRIPTION COMMAND... runs COMMAND as the bench user.
+expect_ok() {
+  local what=$1
+  shift
+  local rc=0
+  as_user "$@" > /tmp/harness.out 2>&1 || rc=$?
+  check $rc "$what"
+}
+
+# expect_refused DESCRIPTION MESSAGE COMMAND... expects COMMAND to fail
+# with the error code of userchroot and MESSAGE on stderr.
+expect_refused() {
+  local what=$1
+  local message=$2
+  shift 2
+  local rc=0
+  as_user "$@" > /tmp/harness.out 2>&1 || rc=$?
+  if [ $rc = 125 ] && grep -q -- "$message" /tmp/harness.out; then
+    rc=0
+  else
+    rc=1
+  fi
+  check $rc "$what"
+}
+
+expect_ok "install devices" $UC $IMAGE --install-devices
+for d in null zero random urandom; do
+  rc=0
+  [ -c $IMAGE/dev/$d ] || rc=1
+  check $rc "/dev/$d is a character device"
+done
+rc=0
+mountpoint -q $IMAGE/dev/shm || rc=1
+check $rc "/dev/shm is mounted"
+rc=0
+[ "$(stat -c %a:%u $IMAGE/dev/shm)" = 1777:0 ] || rc=1
+check $rc "/dev/shm is root's and world-writable, sticky"
+rc=0
+[ "$(grep -c " $IMAGE/dev/shm " /proc/self/mountinfo)" = 1 ] || rc=1
+check $rc "/dev/shm is mounted only once"
+
+expect_ok "run a command" $UC $IMAGE /bin/true
+expect_ok "command sees the image as its root" \
+  $UC $IMAGE /bin/sh -c 'test ! -e /images && test -e /dev/null'
+expect_ok "command runs as the calling user" \
+  $UC $IMAGE /bin/sh -c "test \$(id -u) = $BENCH_UID"
+expect_ok "command writes to /dev/null" \
+  $UC $IMAGE /bin/sh -c 'echo x > /dev/null'
+expect_ok "command reads /dev/zero" \
+  $UC $IMAGE /bin/sh -c 'head -c 1 /dev/zero | od | grep -q 000000'
+rc=0
+as_user $UC $IMAGE /bin/sh -c 'exit 3' > /tmp/harness.out 2>&1 || rc=$?
+[ $rc = 3 ] && rc=0 || rc=1
+check $rc "exit status of the command is kept"
+rc=0
+as_user env FOO=bar $UC $IMAGE /usr/bin/env > /tmp/harness.out 2>&1 || rc=$?
+grep -q '^FOO=bar$' /tmp/harness.out || rc=1
+check $rc "environment is passed on"
+expect_ok "supervised run reports resources" \
+  /bin/sh -c "$UC --supervise $IMAGE /bin/true 2>&1 | grep -q 'max rss'"
+expect_ok "trace file is written" /bin/sh -c \
+  "$UC --trace-file=/tmp/trace.json $IMAGE /bin/true && grep -q chroot /tmp/trace.json"
+expect_ok "launch is recorded" /bin/sh -c \
+  "$UC --record=/tmp/record $IMAGE /bin/true && grep -q ' /bin/true ' /tmp/record"
+expect_ok "worker relays json requests" /bin/sh -c \
+  "printf '{\"a\":1}\n{}\n' | $UC --worker=json $IMAGE /bin/cat | grep -c . | grep -q 2"
+expect_ok "worker relays size-prefixed requests" /bin/sh -c \
+  "printf '\\003abc\\000' | $UC --worker --recycle-after=1 $IMAGE /bin/cat | grep -q abc"
+expect_refused "worker recycled after garbage" "usage:" \
+  $UC --worker --recycle-after=2x $IMAGE /bin/cat
+expect_refused "worker recycled after a negative count" "usage:" \
+  $UC --worker --recycle-after=-1 $IMAGE /bin/cat
+expect_refused "worker with supervision" "usage:" \
+  $UC --worker --supervise $IMAGE /bin/cat
+rc=0
+out=$(as_user $UC --pipeline $IMAGE /usr/bin/printf 'b\na\n' '|' /usr/bin/sort '|' \
+  /usr/bin/head -n 1 2> /tmp/harness.out) || rc=$?
+[ "$out" = a ] || rc=1
+check $rc "pipeline connects the stages"
+rc=0
+as_user $UC --pipeline=:: $IMAGE /bin/false :: /bin/true > /tmp/harness.out 2>&1 || rc=$?
+check $rc "pipeline takes the last status"
+rc=0
+as_user $UC --pipeline --pipefail $IMAGE /bin/sh -c 'exit 4' '|' /bin/true \
+  > /tmp/harness.out 2>&1 || rc=$?
+[ $rc = 4 ] && rc=0 || rc=1
+check $rc "pipefail takes the last failure"
+expect_refused "empty pipeline stage" "Empty stage" \
+  $UC --pipeline $IMAGE /bin/true '|' '|' /bin/true
+mkdir $IMAGE/out
+chown $BENCH_UID:$BENCH_UID $IMAGE/out
+expect_ok "job writes to an output tmpfs" $UC --output-tmpfs=/out:64m \
+  --keep=res --keep=deep/dir $IMAGE /bin/sh -c \
+  'mkdir -p /out/res/sub /out/deep/dir /out/junk && echo a > /out/res/f &&
+   ln -s f /out/res/l && head -c 3000000 /dev/zero > /out/res/sub/big &&
+   echo b > /out/deep/dir/g && echo c > /out/junk/j'
+rc=0
+[ "$(cat $IMAGE/out/res/f $IMAGE/out/deep/dir/g)" = "a
+b" ] || rc=1
+[ "$(readlink $IMAGE/out/res/l)" = f ] || rc=1
+[ "$(stat -c %s $IMAGE/out/res/sub/big)" = 3000000 ] || rc=1
+[ ! -e $IMAGE/out/junk ] || rc=1
+check $rc "only the kept paths are written back"
+rc=0
+as_user $UC --output-tmpfs=/out --keep=res $IMAGE /bin/sh -c \
+  'echo z > /out/res/f; exit 1' > /tmp/harness.out 2>&1 || rc=$?
+[ $rc = 1 ] && [ "$(cat $IMAGE/out/res/f)" = a ] && rc=0 || rc=1
+check $rc "nothing is written back after a failure"
+expect_refused "missing result" "Failed to write back" \
+  $UC --output-tmpfs=/out --keep=missing $IMAGE /bin/true
+expect_refused "result outside the output directory" "Invalid path" \
+  $UC --output-tmpfs=/out --keep=../etc $IMAGE /bin/true
+make_base /images/isolated
+sed -i 's|^\(.*:/images/isolated\)$|\1:net,ipc,uts|' $CONFIG
+make_image /images/isolated img
+rc=0
+out=$(as_user $UC /images/isolated/img /usr/sbin/ip -o link 2> /tmp/harness.out) || rc=$?
+[ "$(echo "$out" | wc -l)" = 1 ] && echo "$out" | grep -q "lo:.*UP" || rc=1
+check $rc "net option leaves only the loopback, up"
+queues=$(ipcs -q | grep -c 0x || true)
+expect_ok "ipc option isolates SysV IPC" \
+  $UC /images/isolated/img /usr/bin/ipcmk -Q
+rc=0
+[ "$(ipcs -q | grep -c 0x || true)" = "$queues" ] || rc=1
+check $rc "queue created in the image is not visible outside"
+rc=0
+out=$(as_user $UC /images/isolated/img /bin/uname -n 2> /tmp/harness.out) || rc=$?
+echo "$out" | grep -qx "userchroot-[0-9]*" || rc=1
+check $rc "uts option gives the job a hostname of its own"
+sed -i 's|^\(.*:/images/isolated\):.*$|\1:net,nosuchoption|' $CONFIG
+expect_refused "unknown configuration option" "Unknown option" \
+  $UC /images/isolated/img /bin/true
+rc=0
+[ "$(as_user $UC --match-cpus $IMAGE /usr/bin/nproc 2> /tmp/harness.out)" = \
+  "$(as_user /usr/bin/nproc)" ] || rc=1
+check $rc "match-cpus keeps the CPUs the job can use"
+make_image $BASE pub
+make_image $BASE pub-next
+echo 1 > $BASE/pub/version
+echo 2 > $BASE/pub-next/version
+expect_ok "install devices in the live image" $UC $BASE/pub --install-devices
+as_user $UC $BASE/pub /bin/sh -c 'cat /version > /dev/null; sleep 2' &
+sleep 0.5
+expect_ok "publish a new version" $UC $BASE/pub --publish $BASE/pub-next
+rc=0
+[ "$(as_user $UC $BASE/pub /bin/cat /version 2> /tmp/harness.out)" = 2 ] || rc=1
+[ ! -e $BASE/pub-next ] || rc=1
+check $rc "new launches get the new version"
+rc=0
+ls -d $BASE/pub@old.* > /tmp/harness.out 2>&1 || rc=1
+check $rc "running job keeps the old version"
+wait
+expect_ok "collect old generations" $UC $BASE/pub --collect-generations
+rc=0
+! ls -d $BASE/pub@old.* > /tmp/harness.out 2>&1 || rc=1
+check $rc "unused old generation is deleted"
+rc=0
+grep -q "pub@old" /proc/self/mountinfo && rc=1
+check $rc "mounts of the old generation are gone"
+expect_refused "launching an old generation" "non-whitelisted" \
+  $UC $BASE/pub@old.1 /bin/true
+expect_refused "publish from outside the base" "should be a directory in" \
+  $UC $BASE/pub --publish /images/elsewhere/img
+as_user flock -x $BASE/pub sleep 3 &
+sleep 0.5
+rc=0
+as_user timeout 2 $UC $BASE/pub /bin/true > /tmp/harness.out 2>&1 || rc=1
+check $rc "a lock on the image directory doesn't hold up launches"
+wait
+rc=0
+[ "$(stat -c %a:%u /run/userchroot)" = 700:0 ] || rc=1
+check $rc "generation locks are only accessible by root"
+mkdir $BASE/pub-root
+expect_refused "publish someone else's directory" "must have the same owner" \
+  $UC $BASE/pub --publish $BASE/pub-root
+mkdir -p /tmp/passed /tmp/private $IMAGE/proc
+chown $BENCH_UID:$BENCH_UID /tmp/passed
+chmod 700 /tmp/private
+mount --rbind /proc $IMAGE/proc
+expect_ok "passed directory is writable through its descriptor" \
+  $UC --pass-dir=/tmp/passed:5 --pass-dir=/tmp/passed:9 $IMAGE \
+  /bin/sh -c 'echo a > /proc/self/fd/5/x && echo b > /proc/self/fd/9/y'
+rc=0
+[ "$(cat /tmp/passed/x /tmp/passed/y)" = "a
+b" ] || rc=1
+check $rc "files show up in the host directory"
+expect_ok "supervised command gets the descriptor too" \
+  $UC --supervise --pass-dir=/tmp/passed:3 $IMAGE /bin/sh -c 'test -d /proc/self/fd/3'
+expect_refused "directory the caller can't open" "Failed to open /tmp/private" \
+  $UC --pass-dir=/tmp/private:5 $IMAGE /bin/true
+expect_refused "standard descriptor as target" "Invalid directory" \
+  $UC --pass-dir=/tmp/passed:1 $IMAGE /bin/true
+umount -l $IMAGE/proc
+# the harness build reads pressure from /etc/pressure, not /proc.
+mkdir /etc/pressure
+echo "some avg10=50.00 avg60=0.00 avg300=0.00 total=0" > /etc/pressure/memory
+echo "some avg10=1.00 avg60=0.00 avg300=0.00 total=0" > /etc/pressure/io
+rc=0
+as_user $UC --max-pressure=memory:10 $IMAGE /bin/true > /tmp/harness.out 2>&1 || rc=$?
+[ $rc = 75 ] && grep -q deferred /tmp/harness.out && rc=0 || rc=1
+check $rc "launch under memory pressure is deferred"
+expect_ok "launch under the io threshold goes ahead" \
+  $UC --max-pressure=io:10 $IMAGE /bin/true
+(sleep 0.5; echo "some avg10=5.00" > /etc/pressure/memory) &
+expect_ok "launch waits for the pressure to drop" /bin/sh -c \
+  "$UC --supervise --max-pressure=memory:10 --pressure-wait=5 $IMAGE /bin/true 2>&1 |
+   grep -q 'pressure wait'"
+wait
+expect_refused "pressure wait of garbage" "usage:" \
+  $UC --max-pressure=memory:10 --pressure-wait=5s $IMAGE /bin/true
+expect_refused "negative pressure wait" "usage:" \
+  $UC --max-pressure=memory:10 --pressure-wait=-1 $IMAGE /bin/true
+expect_refused "pressure wait of NaN" "usage:" \
+  $UC --max-pressure=memory:10 --pressure-wait=nan $IMAGE /bin/true
+rm -r /etc/pressure
+
+mkdir -p /golden/tc
+for f in /bin/sh /bin/cat /bin/touch $(ldd /bin/sh /bin/cat /bin/touch |
+    grep -o '/[^ ]*\.so[^ ]*' | sort -u); do
+  cp --parents -L $f /golden/tc
+done
+echo golden > /golden/tc/version
+mkdir /golden/tc/dev
+make_base /images/team
+sed -i 's|^\(.*:/images/team\)$|\1:golden=/golden|' $CONFIG
+mkdir /images/team/tc
+chown $BENCH_UID:$BENCH_UID /images/team/tc
+expect_ok "install a golden image" $UC /images/team/tc --install-golden
+rc=0
+[ "$(as_user $UC /images/team/tc /bin/cat /version 2> /tmp/harness.out)" = \
+  golden ] || rc=1
+check $rc "golden image launches"
+rc=0
+[ "$(stat -c %u /images/team/tc/version)" = $BENCH_UID ] || rc=1
+[ "$(stat -c %i /images/team/tc/version)" = \
+  "$(stat -c %i /golden/tc/version)" ] || rc=1
+check $rc "golden image is the owner's, sharing the same files"
+rc=0
+as_user $UC /images/team/tc /bin/touch /new 2> /tmp/harness.out && rc=1
+grep -q "Read-only" /tmp/harness.out || rc=1
+check $rc "golden image is read-only"
+expect_ok "install devices in a golden image" \
+  $UC /images/team/tc --install-devices
+expect_ok "golden image has a working /dev/null" $UC /images/team/tc \
+  /bin/sh -c 'echo a > /dev/null && /bin/cat /dev/null'
+expect_ok "uninstall devices in a golden image" \
+  $UC /images/team/tc --uninstall-devices
+expect_refused "golden image installed twice" "already has something mounted" \
+  $UC /images/team/tc --install-golden
+expect_ok "uninstall a golden image" $UC /images/team/tc --uninstall-golden
+mkdir /golden/tc2 /images/team/tc2
+chown $BENCH_UID:$BENCH_UID /images/team/tc2
+mount -t tmpfs -o uid=$BENCH_UID,gid=$BENCH_UID,mode=755 admin \
+  /images/team/tc2
+expect_refused "uninstall an administrator's mount" "not a golden image" \
+  $UC /images/team/tc2 --uninstall-golden
+rc=0
+mountpoint -q /images/team/tc2 || rc=1
+check $rc "the administrator's mount stays"
+umount /images/team/tc2
+rc=0
+[ -z "$(ls /images/team/tc)" ] || rc=1
+check $rc "the owner's directory is empty again"
+expect_refused "uninstall what is not a golden image" "not a golden image" \
+  $UC /images/team/tc --uninstall-golden
+expect_refused "golden image from a base without any" "No golden images" \
+  $UC $IMAGE --install-golden
+mkdir /images/team/other
+chown $BENCH_UID:$BENCH_UID /images/team/other
+mkdir /golden/other
+chown $BENCH_UID /golden/other
+expect_refused "golden image not owned by root" "should be owned by root" \
+  $UC /images/team/other --install-golden
+make_base /images/scratch
+sed -i 's|^\(.*:/images/scratch\)$|\1:ephemeral|' $CONFIG
+make_image /images/scratch img
+mkdir /images/scratch/img/out
+chown $BENCH_UID:$BENCH_UID /images/scratch/img/out
+expect_ok "install devices in an ephemeral image" \
+  $UC /images/scratch/img --install-devices
+expect_ok "ephemeral job writes and syncs" $UC /images/scratch/img \
+  /bin/sh -c 'echo a > /tmp/f && sync /tmp/f && echo b > /dev/null &&
+    [ "$(stat -f -c %T /)" = overlayfs ]'
+as_user $UC /images/scratch/img /bin/sleep 2 &
+sleep 0.5
+rc=0
+job=$(pgrep -n -f '^/bin/sleep 2$')
+grep " / / .*[ ,]nosuid,nodev[ ,].* overlay " /proc/$job/mountinfo \
+  > /tmp/harness.out 2>&1 || rc=1
+wait $! || rc=1
+check $rc "the ephemeral overlay is nosuid and nodev"
+rc=0
+[ ! -e /images/scratch/img/tmp/f ] || rc=1
+[ -z "$(grep ephemeral /proc/self/mountinfo)" ] || rc=1
+check $rc "ephemeral writes are thrown away"
+expect_ok "ephemeral job with an output tmpfs" \
+  $UC --output-tmpfs=/out --keep=res /images/scratch/img /bin/sh -c \
+  'mkdir /out/res && echo c > /out/res/f'
+rc=0
+[ "$(cat /images/scratch/img/out/res/f)" = c ] || rc=1
+check $rc "ephemeral results are still written back"
+sed -i 's|^\(.*:/images/scratch\):ephemeral$|\1:ephemeral=1M|' $CONFIG
+rc=0
+as_user $UC /images/scratch/img /bin/sh -c \
+  'yes | head -c 2000000 > /tmp/f' > /tmp/harness.out 2>&1 && rc=1
+grep -q "No space" /tmp/harness.out || rc=1
+check $rc "ephemeral writes are limited to the configured size"
+sed -i 's|^\(.*:/images/scratch\):ephemeral=1M$|\1:ephemeral|' $CONFIG
+expect_ok "uninstall devices in an ephemeral image" \
+  $UC /images/scratch/img --uninstall-devices
+make_image /images/scratch pub
+make_image /images/scratch pub-next
+as_user $UC /images/scratch/pub /bin/sh -c 'sleep 2; ls / > /dev/null' &
+sleep 0.5
+expect_ok "publish under a running ephemeral job" \
+  $UC /images/scratch/pub --publish /images/scratch/pub-next
+expect_ok "collect under a running ephemeral job" \
+  $UC /images/scratch/pub --collect-generations
+rc=0
+ls -d /images/scratch/pub@old.* > /tmp/harness.out 2>&1 || rc=1
+check $rc "running ephemeral job keeps the old version"
+rc=0
+wait $! || rc=1
+check $rc "ephemeral job on the old version completes"
+expect_ok "collect after the ephemeral job" \
+  $UC /images/scratch/pub --collect-generations
+rc=0
+! ls -d /images/scratch/pub@old.* > /tmp/harness.out 2>&1 || rc=1
+check $rc "old generation is deleted once the ephemeral job is done"
+mkdir -p /run
+expect_refused "jobserver not running" "Failed to open the jobserver" \
+  $UC --jobserver $IMAGE /bin/true
+JOBSERVER_TOPUP_INTERVAL=1 \
+  /bench/userchroot-jobserver.sh /run/userchroot-jobserver 3 &
+jobserver_pid=$!
+while [ ! -p /run/userchroot-jobserver ]; do sleep 0.1; done
+sleep 0.2
+rc=0
+out=$(MAKEFLAGS="k -j8" as_user $UC --jobserver $IMAGE /bin/sh -c \
+  'echo "$MAKEFLAGS"' 2> /tmp/harness.out) || rc=1
+echo "$out" | grep -qx "k --jobserver-auth=[0-9]*,[0-9]*" || rc=1
+check $rc "MAKEFLAGS announces the jobserver instead of -j"
+rc=0
+out=$(as_user $UC --jobserver $IMAGE /bin/sh -c \
+  'fd=${MAKEFLAGS##*,}; dd bs=64 count=1 <&$fd 2> /dev/null | wc -c;
+   printf +++ >&$fd' 2> /tmp/harness.out) || rc=1
+[ "$out" = 3 ] || rc=1
+check $rc "the job sees the host's tokens"
+printf 'all: a b c\na b c:\n\t@echo $@\n' > $IMAGE/tmp/Makefile
+rc=0
+as_user $UC --jobserver $IMAGE /usr/bin/make -s -C /tmp \
+  > /tmp/harness.out 2>&1 || rc=1
+grep -q warning /tmp/harness.out && rc=1
+check $rc "make runs as a jobserver client"
+expect_ok "a job exits holding a token" $UC --jobserver $IMAGE /bin/sh -c \
+  'fd=${MAKEFLAGS##*,}; dd bs=1 count=1 <&$fd 2> /dev/null'
+sleep 2.5
+rc=0
+out=$(as_user $UC --jobserver $IMAGE /bin/sh -c \
+  'fd=${MAKEFLAGS##*,}; dd bs=64 count=1 <&$fd 2> /dev/null | wc -c;
+   printf +++ >&$fd' 2> /tmp/harness.out) || rc=1
+[ "$out" = 3 ] || rc=1
+check $rc "lost tokens are put back once the jobserver is idle"
+kill $jobserver_pid
+make_base /images/hot
+sed -i 's|^\(.*:/images/hot\)$|\1:protect=64M|' $CONFIG
+make_image /images/hot img
+make_base /images/bulk
+sed -i 's|^\(.*:/images/bulk\)$|\1:bulk|' $CONFIG
+make_image /images/bulk img
+expect_ok "protected image launches without cgroup v2" \
+  $UC /images/hot/img /bin/true
+# a stand-in for the cgroup v2 hierarchy: just the files written to.
+mkdir -p /etc/cgroup
+echo "cpu memory pids" > /etc/cgroup/cgroup.subtree_control
+expect_ok "protected image launches without the administrator's cgroups" \
+  $UC /images/hot/img /bin/true
+rc=0
+[ -z "$(ls /etc/cgroup | grep userchroot)" ] || rc=1
+check $rc "no cgroup is created outside of the administrator's"
+mkdir -p /etc/cgroup/userchroot-hot/images@hot \
+  /etc/cgroup/userchroot-bulk/images@bulk
+for f in userchroot-hot/cgroup.subtree_control \
+    userchroot-bulk/cgroup.subtree_control \
+    userchroot-hot/images@hot/memory.low userchroot-hot/images@hot/cgroup.procs \
+    userchroot-bulk/images@bulk/memory.high \
+    userchroot-bulk/images@bulk/cgroup.procs; do
+  : > /etc/cgroup/$f
+done
+chown $BENCH_UID /etc/cgroup/userchroot-hot
+expect_ok "protected image launches in a cgroup it doesn't trust" \
+  $UC /images/hot/img /bin/true
+rc=0
+[ -z "$(cat /etc/cgroup/userchroot-hot/images@hot/cgroup.procs)" ] || rc=1
+check $rc "a cgroup not owned by root is left alone"
+chown 0 /etc/cgroup/userchroot-hot
+rc=0
+expect_ok "protected image launches without the memory controller" \
+  $UC /images/hot/img /bin/true
+[ -z "$(cat /etc/cgroup/userchroot-hot/images@hot/cgroup.procs)" ] || rc=1
+check $rc "a cgroup without the memory controller is left alone"
+echo "memory pids" > /etc/cgroup/userchroot-hot/cgroup.subtree_control
+echo "memory pids" > /etc/cgroup/userchroot-bulk/cgroup.subtree_control
+expect_ok "protected image launches" $UC /images/hot/img /bin/true
+rc=0
+[ "$(cat /etc/cgroup/userchroot-hot/images@hot/memory.low)" = 67108864 ] ||
+  rc=1
+[ -n "$(cat /etc/cgroup/userchroot-hot/images@hot/cgroup.procs)" ] || rc=1
+check $rc "protected image runs in its protected cgroup"
+expect_ok "bulk image launches" $UC /images/bulk/img /bin/true
+rc=0
+[ -n "$(cat /etc/cgroup/userchroot-bulk/images@bulk/cgroup.procs)" ] || rc=1
+[ -z "$(cat /etc/cgroup/userchroot-bulk/images@bulk/memory.high)" ] || rc=1
+check $rc "bulk image runs in the bulk cgroup"
+sed -i 's|^\(.*:/images/bulk\):.*$|\1:bulk=32M|' $CONFIG
+expect_ok "bounded bulk image launches" $UC /images/bulk/img /bin/true
+rc=0
+[ "$(cat /etc/cgroup/userchroot-bulk/images@bulk/memory.high)" = 33554432 ] ||
+  rc=1
+check $rc "bulk image is bounded by memory.high"
+sed -i 's|^\(.*:/images/bulk\):.*$|\1:bulk,protect=1G|' $CONFIG
+expect_refused "protect and bulk together" "can't be combined" \
+  $UC /images/bulk/img /bin/true
+sed -i 's|^\(.*:/images/bulk\):.*$|\1:protect=lots|' $CONFIG
+expect_refused "invalid protection size" "Invalid size" \
+  $UC /images/bulk/img /bin/true
+rm -rf /etc/cgroup
+make_base /images/ci
+sed -i 's|^\(.*:/images/ci\)$|\1:workspaces=/var/workspaces,workspace-budget=100K|' \
+  $CONFIG
+make_image /images/ci img
+mkdir /images/ci/img/ws
+chown $BENCH_UID:$BENCH_UID /images/ci/img/ws
+mkdir -p /var/workspaces
+WS=/var/workspaces/$BENCH_UID@images@ci@img
+expect_ok "job builds in a new workspace" $UC --workspace=build:/ws \
+  /images/ci/img /bin/sh -c '[ -z "$(ls /ws)" ] &&
+    yes | head -c 65536 > /ws/obj'
+rc=0
+[ -f $WS@build/snapshot/obj ] && [ -f $WS@build/saved ] || rc=1
+[ "$(stat -c %U $WS@build)" = $BENCH_USER ] || rc=1
+[ ! -e /images/ci/img/ws/obj ] || rc=1
+check $rc "a successful job is saved outside the image"
+rc=0
+as_user $UC --workspace=build:/ws /images/ci/img /bin/sh -c \
+  '[ -f /ws/obj ] && echo half > /ws/broken && exit 3' \
+  > /tmp/harness.out 2>&1 || rc=$?
+[ $rc = 3 ] && rc=0 || rc=1
+check $rc "the next job starts from it"
+expect_ok "a job after a failed one starts from the last good state" \
+  $UC --workspace=build:/ws /images/ci/img /bin/sh -c \
+  '[ -f /ws/obj ] && [ ! -e /ws/broken ]'
+as_user $UC --workspace=build:/ws /images/ci/img /bin/sleep 2 &
+sleeper=$!
+sleep 0.5
+expect_refused "workspace already in use" "in use by another job" \
+  $UC --workspace=build:/ws /images/ci/img /bin/true
+wait $sleeper
+expect_ok "another workspace of the same image" $UC --workspace=other:/ws \
+  /images/ci/img /bin/sh -c 'yes | head -c 65536 > /ws/obj'
+expect_ok "a third workspace" $UC --workspace=third:/ws \
+  /images/ci/img /bin/true
+rc=0
+[ ! -e $WS@build ] && [ -d $WS@other ] && [ -d $WS@third ] || rc=1
+check $rc "the least recently used workspace is evicted over the budget"
+rc=0
+[ "$(stat -c %u:%a /var/workspaces/.meta)" = 0:700 ] || rc=1
+[ -f /var/workspaces/.meta/$BENCH_UID@images@ci@img@third ] || rc=1
+check $rc "workspace sizes and uses are kept by root"
+expect_ok "a workspace is measured when used" $UC --workspace=other:/ws \
+  /images/ci/img /bin/true
+as_user touch -d 2099-01-01 $WS@other
+as_user /bin/sh -c "echo 0 > $WS@other/size"
+expect_ok "the third workspace again" $UC --workspace=third:/ws \
+  /images/ci/img /bin/true
+rc=0
+[ ! -e $WS@other ] && [ -d $WS@third ] || rc=1
+[ ! -e /var/workspaces/.meta/$BENCH_UID@images@ci@img@other ] || rc=1
+check $rc "eviction ignores times and sizes the user can change"
+expect_ok "a workspace to hold" $UC --workspace=held:/ws /images/ci/img \
+  /bin/sh -c 'yes | head -c 65536 > /ws/obj'
+as_user flock $WS@held sleep 3 &
+holder=$!
+sleep 0.5
+expect_ok "a large workspace" $UC --workspace=big:/ws /images/ci/img \
+  /bin/sh -c 'yes | head -c 65536 > /ws/obj'
+expect_ok "the large workspace again" $UC --workspace=big:/ws \
+  /images/ci/img /bin/true
+rc=0
+[ ! -e $WS@held ] && [ -d $WS@big ] || rc=1
+check $rc "a lock on the workspace directory doesn't keep it from eviction"
+wait $holder
+expect_ok "a workspace its owner locks down" $UC --workspace=locked:/ws \
+  /images/ci/img /bin/sh -c 'mkdir /ws/d && yes | head -c 65536 > /ws/d/obj'
+expect_ok "the workspace to lock down again" $UC --workspace=locked:/ws \
+  /images/ci/img /bin/true
+as_user chmod 500 $WS@locked/work/d $WS@locked/snapshot/d
+expect_ok "the large workspace once more" $UC --workspace=big:/ws \
+  /images/ci/img /bin/true
+rc=0
+[ ! -e $WS@locked ] && [ -d $WS@big ] || rc=1
+check $rc "taking away permissions doesn't keep a workspace from eviction"
+expect_ok "a workspace to nest" $UC --workspace=deep:/ws /images/ci/img \
+  /bin/true
+as_user /bin/sh -c "cd $WS@deep/work && for i in \$(seq 200); do
+  mkdir d && cd d; done"
+as_user $UC --workspace=deep:/ws /images/ci/img /bin/sh -c \
+  '[ -z "$(ls /ws)" ]' > /tmp/harness.out 2>&1
+rc=$?
+grep -q "can't be measured" /tmp/harness.out || rc=1
+! ls -d $WS@deep/@removing.* > /dev/null 2>&1 || rc=1
+check $rc "a workspace too deep to measure is started over"
+expect_refused "invalid workspace name" "Invalid workspace name" \
+  $UC --workspace=..:/ws /images/ci/img /bin/true
+expect_refused "workspace outside the image" "Invalid workspace directory" \
+  $UC --workspace=build:/../ws /images/ci/img /bin/true
+mkdir $IMAGE/ws
+chown $BENCH_UID:$BENCH_UID $IMAGE/ws
+expect_refused "workspaces not configured" "No workspaces are configured" \
+  $UC --workspace=build:/ws $IMAGE /bin/true
+make_base /images/shm
+make_image /images/shm img
+shm_size() {
+  echo $(( $(stat -f -c '%b * %S' /images/shm/img/dev/shm) / 1048576 ))
+}
+expect_ok "install devices without a /dev/shm history" \
+  $UC /images/shm/img --install-devices
+rc=0
+[ "$(shm_size)" = 128 ] || rc=1
+check $rc "/dev/shm keeps its default size"
+expect_ok "uninstall devices without a /dev/shm history" \
+  $UC /images/shm/img --uninstall-devices
+mkdir -p /var/lib/userchroot/shm
+HISTORY=/var/lib/userchroot/shm/images@shm@img
+as_user $UC /images/shm/img --install-devices > /tmp/harness.out 2>&1
+expect_ok "job uses 10M of /dev/shm" $UC /images/shm/img /bin/sh -c \
+  'yes | head -c 10485760 > /dev/shm/f'
+expect_ok "uninstall devices records the usage" \
+  $UC /images/shm/img --uninstall-devices
+rc=0
+[ "$(wc -l < $HISTORY)" = 1 ] && [ "$(cat $HISTORY)" -ge 10485760 ] || rc=1
+[ "$(stat -c %u $HISTORY)" = 0 ] || rc=1
+check $rc "the peak is in the image's history"
+expect_ok "install devices with a history" \
+  $UC /images/shm/img --install-devices
+rc=0
+[ "$(shm_size)" = 16 ] || rc=1
+check $rc "/dev/shm is sized from the history"
+expect_ok "job fills most of /dev/shm" $UC /images/shm/img /bin/sh -c \
+  'yes | head -c 13631488 > /dev/shm/f'
+expect_ok "the next job sees a larger /dev/shm" $UC /images/shm/img \
+  /bin/sh -c 'yes | head -c 15728640 > /dev/shm/g'
+rc=0
+[ "$(shm_size)" = 32 ] || rc=1
+[ "$(wc -l < $HISTORY)" = 2 ] || rc=1
+check $rc "/dev/shm grows at launch when nearly full"
+# what an interrupted --uninstall-devices leaves: /dev/shm alone.
+rm /images/shm/img/dev/shm/f /images/shm/img/dev/shm/g
+for d in null zero random urandom; do
+  umount /images/shm/img/dev/$d
+  rm /images/shm/img/dev/$d
+done
+expect_ok "install devices over a mounted /dev/shm" \
+  $UC /images/shm/img --install-devices
+rc=0
+[ "$(shm_size)" = 20 ] || rc=1
+[ "$(grep -c " /images/shm/img/dev/shm " /proc/self/mountinfo)" = 1 ] || rc=1
+check $rc "a mounted /dev/shm is resized from the history"
+expect_ok "uninstall a grown /dev/shm" $UC /images/shm/img --uninstall-devices
+LONG=$(printf 'l%.0s' $(seq 250))
+make_image /images/shm $LONG
+expect_ok "install devices in an image with a long path" \
+  $UC /images/shm/$LONG --install-devices
+as_user $UC /images/shm/$LONG --uninstall-devices > /tmp/harness.out 2>&1
+rc=$?
+grep -q "failed to record" /tmp/harness.out && rc=1
+[ "$(ls /var/lib/userchroot/shm | grep -c "^images@shm@l*#[0-9a-f]*$")" = 1 ] ||
+  rc=1
+check $rc "the history of a long path gets a name of its own"
+expect_refused "unknown option" "usage:" $UC --no-such-option $IMAGE /bin/true
+expect_refused "missing command" "Failed to exec" $UC $IMAGE /no/such/command
+expect_refused "relative image" "should be absolute" $UC images/base/img /bin/true
+expect_refused "missing image" "Failed to stat" $UC $BASE/missing /bin/true
+expect_refused "top-level directory" "not a possible target" $UC /images /bin/true
+expect_refused "trailing slash" "Trailing slashes" $UC $IMAGE/ /bin/true
+expect_refused "dot dot in the path" "should be owned by root" \
+  $UC $BASE/img/../img /bin/true
+expect_refused "non-whitelisted characters" "non-whitelisted" \
+  $UC '/images/base/im g' /bin/true
+
+mkdir -p /images/elsewhere/img
+chown $BENCH_UID:$BENCH_UID /images/elsewhere /images/elsewhere/img
+expect_refused "base not in the configuration" "Permission Denied" \
+  $UC /images/elsewhere/img /bin/true
+
+mkdir $BASE/other
+expect_refused "image owned by someone else" "must have the same owner" \
+  $UC $BASE/other /bin/true
+
+mkdir -p $BASE/open
+chown $BENCH_UID:$BENCH_UID $BASE/open
+chmod 777 $BASE/open
+expect_refused "world-writable image" "non-restrictive permissions" \
+  $UC $BASE/open /bin/true
+
+ln -s img $BASE/link
+expect_refused "symbolic link to an image" "Permission Denied\|not a directory\|not a possible target" \
+  $UC $BASE/link /bin/true
+
+rc=0
+$UC $IMAGE /bin/true > /tmp/harness.out 2>&1 || rc=$?
+[ $rc = 125 ] && grep -q "root" /tmp/harness.out && rc=0 || rc=1
+check $rc "refuses to run as root"
+
+chmod 666 $CONFIG
+expect_refused "writable configuration" "non-restrictive permissions" \
+  $UC $IMAGE /bin/true
+chmod 644 $CONFIG
+
+expect_ok "uninstall devices" $UC $IMAGE --uninstall-devices
+rc=0
+if [ -e $IMAGE/dev/null ] || mountpoint -q $IMAGE/dev/shm; then
+  rc=1
+fi
+check $rc "devices are gone"
+expect_ok "devices can be installed again" $UC $IMAGE --install-devices
+expect_ok "and uninstalled again" $UC $IMAGE --uninstall-devices
+
+echo "$passed passed, $failed failed"
+[ $failed = 0 ]
+
+# ----------------------------------------------------------------------------
+# Copyright 2015 Bloomberg Finance L.P.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+# ----------------------------- END-OF-FILE ----------------------------------
@@ -0,0 +1,111 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * A synthetic build job for the load generator, run inside an image.
+ * The first thing it does is print the CLOCK_MONOTONIC time at which
+ * it started, in microseconds, so the load generator can tell launch
+ * latency apart from the job itself.
+ *
+ * usage: job <compile|link|test|sleep> milliseconds
+ *
+ * compile - burns CPU and writes a small object file to /tmp.
+ * link    - burns CPU while touching 64MiB of memory.
+ * test    - burns CPU while filling 16MiB of shared memory in /dev/shm.
+ * sleep   - does nothing, standing in for a recorded command.
+ */
+
+static double now_us() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+static void burn(double until) {
+  volatile unsigned long x = 0;
+  while (now_us() < until) {
+    int i;
+    for (i = 0; i < 10000; i++) {
+      x += i;
+    }
+  }
+}
+
+int main(int argc, char* argv[]) {
+  double start = now_us();
+  printf("%.0f\n", start);
+  fflush(stdout);
+  if (argc < 3) {
+    return 2;
+  }
+  double until = start + atoi(argv[2]) * 1000.0;
+
+  if (strcmp(argv[1], "compile") == 0) {
+    char path[64];
+    char obj[64 * 1024];
+    memset(obj, 0x90, sizeof(obj));
+    burn(until);
+    snprintf(path, sizeof(path), "/tmp/job-%d.o", (int)getpid());
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, obj, sizeof(obj)) != sizeof(obj)) {
+      return 1;
+    }
+    close(fd);
+    unlink(path);
+  } else if (strcmp(argv[1], "link") == 0) {
+    size_t size = 64 << 20;
+    char* mem = malloc(size);
+    if (mem == NULL) {
+      return 1;
+    }
+    memset(mem, 1, size);
+    burn(until);
+    free(mem);
+  } else if (strcmp(argv[1], "test") == 0) {
+    char name[64];
+    size_t size = 16 << 20;
+    snprintf(name, sizeof(name), "/job-%d", (int)getpid());
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 || ftruncate(fd, size) != 0) {
+      return 1;
+    }
+    char* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+      return 1;
+    }
+    memset(mem, 1, size);
+    burn(until);
+    munmap(mem, size);
+    close(fd);
+    shm_unlink(name);
+  } else if (strcmp(argv[1], "sleep") == 0) {
+    long micros = (long)(until - start);
+    struct timespec pause = { micros / 1000000, (micros % 1000000) * 1000 };
+    nanosleep(&pause, NULL);
+  } else {
+    return 2;
+  }
+  return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
@@ -0,0 +1,61 @@
+#!/bin/bash -e
+#
+# Launch latency of "userchroot <image> /bin/true" against running
+# /bin/true directly, and how it changes with the size of the
+# configuration, the depth of the base path and the size of the
+# environment.
+
+. /bench/lib.sh
+
+latency() {
+  as_user /bench/launch_latency -n $BENCH_ITERATIONS "$@"
+}
+
+make_base /images/base
+make_image /images/base img
+
+echo "== baseline"
+latency -l "direct /bin/true" /bin/true
+latency -l "userchroot /bin/true" $UC /images/base/img /bin/true
+
+echo "== configuration entries before the match"
+for n in 10 1000 100000; do
+  config_filler $n
+  latency -l "userchroot, $n entries" $UC /images/base/img /bin/true
+done
+config_filler 0
+
+echo "== depth of the base path"
+# the base path itself is the last component, so the shortest possible
+# depth is 2.
+for depth in 2 8 32; do
+  base=/depth$depth
+  for i in $(seq 2 $depth); do
+    base=$base/d$i
+  done
+  make_base $base
+  make_image $base img
+  latency -l "userchroot, depth $depth" $UC $base/img /bin/true
+done
+
+echo "== environment size"
+for n in 0 100 1000; do
+  latency -e $n -s 64 -l "direct, $n variables" /bin/true
+  latency -e $n -s 64 -l "userchroot, $n variables" $UC /images/base/img /bin/true
+done
+
+# ----------------------------------------------------------------------------
+# Copyright 2015 Bloomberg Finance L.P.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+# ----------------------------- END-OF-FILE ----------------------------------
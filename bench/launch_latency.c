@@ -0,0 +1,128 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "stats.h"
+
+/*
+ * Measures the end-to-end latency of running a command: from the
+ * spawn until it has been reaped. Pointing it at
+ * "userchroot <image> /bin/true" and at "/bin/true" directly gives
+ * the cost userchroot adds to every launch.
+ *
+ * usage: launch_latency [-n iterations] [-w warmup] [-e count]
+ *                       [-s size] [-l label] command [args...]
+ *
+ * -e and -s give the command an environment of 'count' variables
+ * whose values are 'size' bytes long.
+ */
+
+extern char** environ;
+
+static char** make_environment(int count, int size) {
+  int i;
+  char** env = calloc(count + 1, sizeof(char*));
+  if (env == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  for (i = 0; i < count; i++) {
+    env[i] = malloc(size + 32);
+    if (env[i] == NULL) {
+      perror("malloc");
+      exit(1);
+    }
+    int len = sprintf(env[i], "BENCH_VAR_%d=", i);
+    memset(env[i] + len, 'x', size);
+    env[i][len + size] = 0;
+  }
+  return env;
+}
+
+static double run_once(char* argv[], char* envp[]) {
+  pid_t pid;
+  int status;
+  double start = stats_now_us();
+  int rc = posix_spawn(&pid, argv[0], NULL, NULL, argv, envp);
+  if (rc != 0) {
+    fprintf(stderr, "launch_latency: failed to spawn %s: %s\n",
+            argv[0], strerror(rc));
+    exit(1);
+  }
+  if (waitpid(pid, &status, 0) < 0) {
+    perror("waitpid");
+    exit(1);
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "launch_latency: %s failed with status %d\n",
+            argv[0], status);
+    exit(1);
+  }
+  return stats_now_us() - start;
+}
+
+int main(int argc, char* argv[]) {
+  int iterations = 1000;
+  int warmup = 50;
+  int env_count = -1;
+  int env_size = 16;
+  const char* label = NULL;
+  int opt;
+  int i;
+
+  while ((opt = getopt(argc, argv, "+n:w:e:s:l:")) != -1) {
+    switch (opt) {
+    case 'n': iterations = atoi(optarg); break;
+    case 'w': warmup = atoi(optarg); break;
+    case 'e': env_count = atoi(optarg); break;
+    case 's': env_size = atoi(optarg); break;
+    case 'l': label = optarg; break;
+    default:
+      fprintf(stderr, "usage: launch_latency [-n iterations] [-w warmup] "
+              "[-e count] [-s size] [-l label] command [args...]\n");
+      return 1;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "launch_latency: no command given\n");
+    return 1;
+  }
+  char** cmd = argv + optind;
+  char** envp = env_count >= 0 ? make_environment(env_count, env_size)
+                               : environ;
+  double* samples = malloc(iterations * sizeof(double));
+  if (samples == NULL) {
+    perror("malloc");
+    return 1;
+  }
+
+  for (i = 0; i < warmup; i++) {
+    run_once(cmd, envp);
+  }
+  for (i = 0; i < iterations; i++) {
+    samples[i] = run_once(cmd, envp);
+  }
+  stats_print(stdout, label ? label : cmd[0], samples, iterations);
+  return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
@@ -0,0 +1,74 @@
+#
+# Helpers for the benchmark scripts, which run as root inside the
+# fake root built by fakeroot.sh.
+
+UC=/opt/userchroot/bin/userchroot
+CONFIG=/etc/userchroot.conf
+BENCH_USER=bench
+BENCH_UID=1000
+BENCH_ITERATIONS=${BENCH_ITERATIONS:-1000}
+
+# Makes the host binaries and libraries available under DIR.
+share_host_tree() {
+  local d
+  for d in usr bin sbin lib lib32 lib64 libx32; do
+    if [ -L /$d ]; then
+      ln -s "$(readlink /$d)" "$1/$d"
+    elif [ -d /$d ]; then
+      mkdir -p "$1/$d"
+      mount --bind /$d "$1/$d"
+    fi
+  done
+}
+
+# Creates a base path owned by the bench user, the whole path leading
+# to it owned by root, and authorizes it in the configuration.
+make_base() {
+  mkdir -p "$1"
+  chown $BENCH_UID:$BENCH_UID "$1"
+  chmod 755 "$1"
+  echo "$BENCH_USER:$1" >> $CONFIG
+}
+
+# Creates an image named NAME under the base path BASE, able to run
+# the host binaries.
+make_image() {
+  local image="$1/$2"
+  mkdir -p "$image"/dev "$image"/tmp
+  share_host_tree "$image"
+  chmod 1777 "$image"/tmp
+  chown $BENCH_UID:$BENCH_UID "$image" "$image"/dev
+  chmod 755 "$image"
+}
+
+# Puts COUNT entries that never match in front of the configuration.
+config_filler() {
+  local tmp=$(mktemp)
+  if [ "$1" -gt 0 ]; then
+    seq 1 "$1" | sed 's|.*|filler&:/no/such/base/&|' > $tmp
+  fi
+  grep -v '^filler' $CONFIG >> $tmp || true
+  cat $tmp > $CONFIG
+  rm -f $tmp
+}
+
+# Runs a command as the bench user.
+as_user() {
+  setpriv --reuid=$BENCH_UID --regid=$BENCH_UID --clear-groups "$@"
+}
+
+# ----------------------------------------------------------------------------
+# Copyright 2015 Bloomberg Finance L.P.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+# ----------------------------- END-OF-FILE ----------------------------------
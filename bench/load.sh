@@ -0,0 +1,39 @@
+#!/bin/bash -e
+#
+# Replays a mix of synthetic build jobs with Poisson arrivals across a
+# set of images, ramping the arrival rate, first directly and then
+# through userchroot. LOAD_RATES and LOAD_SECONDS override the rate
+# levels and the time spent at each of them.
+
+. /bench/lib.sh
+
+RATES=${LOAD_RATES:-10,20,40,80,160}
+SECONDS_PER_RATE=${LOAD_SECONDS:-10}
+
+make_base /images/base
+images=
+for i in $(seq 1 8); do
+  make_image /images/base img$i
+  cp /bench/job /images/base/img$i/job
+  as_user $UC /images/base/img$i --install-devices
+  images="$images /images/base/img$i"
+done
+
+as_user /bench/loadgen -d -r $RATES -t $SECONDS_PER_RATE $UC /bench/job $images
+as_user /bench/loadgen -r $RATES -t $SECONDS_PER_RATE $UC /bench/job $images
+
+# ----------------------------------------------------------------------------
+# Copyright 2015 Bloomberg Finance L.P.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+# ----------------------------- END-OF-FILE ----------------------------------
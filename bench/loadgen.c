@@ -0,0 +1,274 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "stats.h"
+
+/*
+ * Build-farm load generator. Jobs of a configurable mix of types
+ * arrive as a Poisson process and each one runs "job" (see job.c)
+ * inside a randomly chosen image through userchroot. The arrival rate
+ * ramps through the given levels, and for each level it reports the
+ * throughput, the failure rate, the peak concurrency, the launch
+ * latency (from spawn until the job starts running) and the total
+ * latency.
+ *
+ * With -d the jobs run directly instead, outside any image, which
+ * gives the baseline to compare against: where the launch latency
+ * through userchroot departs from it is where userchroot becomes the
+ * bottleneck.
+ *
+ * usage: loadgen [-d] [-r rate,rate,...] [-t seconds] [-m mix] [-s seed]
+ *                userchroot job image...
+ *
+ * The mix is a list of type=weight:milliseconds, defaulting to
+ * "compile=70:20,link=10:200,test=20:50".
+ */
+
+#define MAX_TYPES 8
+#define MAX_JOBS 4096
+
+struct job_type {
+  char name[16];
+  int weight;
+  char millis[16];
+};
+
+struct running_job {
+  pid_t pid;
+  int fd;
+  double spawned;
+  double started;
+  char buf[32];
+  int buflen;
+};
+
+static struct job_type types[MAX_TYPES];
+static int num_types;
+static int total_weight;
+
+static void parse_mix(const char* mix) {
+  char* copy = strdup(mix);
+  char* item;
+  for (item = strtok(copy, ","); item != NULL && num_types < MAX_TYPES;
+       item = strtok(NULL, ",")) {
+    struct job_type* t = &types[num_types];
+    if (sscanf(item, "%15[^=]=%d:%15s", t->name, &t->weight, t->millis) != 3) {
+      fprintf(stderr, "loadgen: bad mix entry %s\n", item);
+      exit(1);
+    }
+    total_weight += t->weight;
+    num_types++;
+  }
+  free(copy);
+}
+
+static struct job_type* pick_type() {
+  int r = (int)(drand48() * total_weight);
+  int i;
+  for (i = 0; i < num_types - 1; i++) {
+    if (r < types[i].weight) {
+      break;
+    }
+    r -= types[i].weight;
+  }
+  return &types[i];
+}
+
+static int spawn_job(struct running_job* job, int direct, char* uc,
+                     char* jobpath, char** images, int num_images) {
+  int fds[2];
+  char* argv[6];
+  int argc = 0;
+  struct job_type* type = pick_type();
+  posix_spawn_file_actions_t actions;
+
+  if (pipe2(fds, O_CLOEXEC) != 0) {
+    return -1;
+  }
+  if (!direct) {
+    argv[argc++] = uc;
+    argv[argc++] = images[(int)(drand48() * num_images)];
+    argv[argc++] = "/job";
+  } else {
+    argv[argc++] = jobpath;
+  }
+  argv[argc++] = type->name;
+  argv[argc++] = type->millis;
+  argv[argc] = NULL;
+
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, fds[1], 1);
+  posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+  job->spawned = stats_now_us();
+  int rc = posix_spawn(&job->pid, argv[0], &actions, NULL, argv, NULL);
+  posix_spawn_file_actions_destroy(&actions);
+  close(fds[1]);
+  if (rc != 0) {
+    close(fds[0]);
+    return -1;
+  }
+  job->fd = fds[0];
+  job->started = 0;
+  job->buflen = 0;
+  return 0;
+}
+
+static void run_level(double rate, double seconds, int direct, char* uc,
+                      char* jobpath, char** images, int num_images) {
+  static struct running_job jobs[MAX_JOBS];
+  static double launch[1 << 20];
+  static double total[1 << 20];
+  struct pollfd pfds[MAX_JOBS];
+  int active = 0;
+  int peak = 0;
+  int completed = 0;
+  int failed = 0;
+  int i;
+  double start = stats_now_us();
+  double end = start + seconds * 1e6;
+  double next = start - log(1 - drand48()) / rate * 1e6;
+
+  while (stats_now_us() < end || active > 0) {
+    double now = stats_now_us();
+    while (now >= next && now < end) {
+      if (active < MAX_JOBS &&
+          spawn_job(&jobs[active], direct, uc, jobpath, images,
+                    num_images) == 0) {
+        active++;
+      } else {
+        failed++;
+      }
+      next -= log(1 - drand48()) / rate * 1e6;
+    }
+    if (active > peak) {
+      peak = active;
+    }
+
+    int timeout = 10;
+    if (now < end && next - now < timeout * 1000) {
+      timeout = (int)((next - now) / 1000);
+    }
+    for (i = 0; i < active; i++) {
+      pfds[i].fd = jobs[i].fd;
+      pfds[i].events = POLLIN;
+    }
+    poll(pfds, active, timeout);
+    for (i = 0; i < active; i++) {
+      if (pfds[i].revents & (POLLIN | POLLHUP)) {
+        struct running_job* job = &jobs[i];
+        ssize_t len = read(job->fd, job->buf + job->buflen,
+                           sizeof(job->buf) - 1 - job->buflen);
+        if (len > 0) {
+          job->buflen += len;
+          job->buf[job->buflen] = 0;
+          if (job->started == 0 && strchr(job->buf, '\n') != NULL) {
+            job->started = atof(job->buf);
+          }
+        }
+      }
+    }
+
+    // reap whatever finished, compacting the table as we go.
+    for (i = 0; i < active; i++) {
+      int status;
+      struct running_job* job = &jobs[i];
+      if (waitpid(job->pid, &status, WNOHANG) != job->pid) {
+        continue;
+      }
+      double finished = stats_now_us();
+      if (job->started == 0) {
+        ssize_t len = read(job->fd, job->buf + job->buflen,
+                           sizeof(job->buf) - 1 - job->buflen);
+        if (len > 0) {
+          job->buf[job->buflen + len] = 0;
+          job->started = atof(job->buf);
+        }
+      }
+      close(job->fd);
+      if (WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+          job->started != 0 && completed < (int)(sizeof(total) / sizeof(double))) {
+        launch[completed] = job->started - job->spawned;
+        total[completed] = finished - job->spawned;
+        completed++;
+      } else {
+        failed++;
+      }
+      jobs[i] = jobs[--active];
+      i--;
+    }
+  }
+
+  double elapsed = (stats_now_us() - start) / 1e6;
+  printf("%s, %.0f jobs/s offered: %.1f jobs/s completed, %d failed "
+         "(%.2f%%), peak concurrency %d\n",
+         direct ? "direct" : "userchroot", rate, completed / elapsed, failed,
+         completed + failed ? 100.0 * failed / (completed + failed) : 0, peak);
+  stats_print(stdout, "  launch latency", launch, completed);
+  stats_print(stdout, "  total latency", total, completed);
+  fflush(stdout);
+}
+
+int main(int argc, char* argv[]) {
+  int direct = 0;
+  char* rates = "10,20,40,80";
+  double seconds = 10;
+  int opt;
+  char* rate;
+
+  srand48(1);
+  while ((opt = getopt(argc, argv, "dr:t:m:s:")) != -1) {
+    switch (opt) {
+    case 'd': direct = 1; break;
+    case 'r': rates = optarg; break;
+    case 't': seconds = atof(optarg); break;
+    case 'm': parse_mix(optarg); break;
+    case 's': srand48(atol(optarg)); break;
+    default:
+      fprintf(stderr, "usage: loadgen [-d] [-r rate,rate,...] [-t seconds] "
+              "[-m mix] [-s seed] userchroot job image...\n");
+      return 1;
+    }
+  }
+  if (num_types == 0) {
+    parse_mix("compile=70:20,link=10:200,test=20:50");
+  }
+  if (argc - optind < 3) {
+    fprintf(stderr, "loadgen: need userchroot, job and at least one image\n");
+    return 1;
+  }
+  char* uc = argv[optind];
+  char* jobpath = argv[optind + 1];
+  char** images = argv + optind + 2;
+  int num_images = argc - optind - 2;
+
+  rates = strdup(rates);
+  for (rate = strtok(rates, ","); rate != NULL; rate = strtok(NULL, ",")) {
+    run_level(atof(rate), seconds, direct, uc, jobpath, images, num_images);
+  }
+  return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
@@ -0,0 +1,195 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mount.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pwd.h>
+#include <grp.h>
+
+/*
+ * nsrun runs a command as root inside a new user and mount
+ * namespace, without needing any privileges on the host.
+ *
+ * userchroot can't be exercised with a single mapped user: it refuses
+ * to run as root and needs a root-owned configuration, so besides
+ * root the namespace needs at least one regular user. Inside the
+ * namespace, uid and gid 0 map to the invoking user and 1 to 65535
+ * map to the invoking user's subordinate ids from /etc/subuid and
+ * /etc/subgid, set up through newuidmap and newgidmap. When nsrun
+ * itself runs as root on the host, the maps are written directly.
+ *
+ * usage: nsrun command [args...]
+ */
+
+#define NSRUN_RANGE 65535
+
+static void fail(const char* what) {
+  fprintf(stderr, "nsrun: %s: %s\n", what, strerror(errno));
+  exit(125);
+}
+
+static int subordinate_start(const char* file, const char* name, uid_t id) {
+  char line[256];
+  char idstr[32];
+  FILE* f = fopen(file, "r");
+  if (f == NULL) {
+    return -1;
+  }
+  snprintf(idstr, sizeof(idstr), "%d", (int)id);
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char* owner = strtok(line, ":");
+    char* start = strtok(NULL, ":");
+    char* count = strtok(NULL, ":\n");
+    if (owner == NULL || start == NULL || count == NULL ||
+        atoi(count) < NSRUN_RANGE) {
+      continue;
+    }
+    if (strcmp(owner, idstr) == 0 || (name && strcmp(owner, name) == 0)) {
+      fclose(f);
+      return atoi(start);
+    }
+  }
+  fclose(f);
+  return -1;
+}
+
+static void write_map(pid_t pid, const char* file, const char* content) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/%s", (int)pid, file);
+  int fd = open(path, O_WRONLY);
+  if (fd < 0 || write(fd, content, strlen(content)) < 0) {
+    fail(path);
+  }
+  close(fd);
+}
+
+static void map_ids(pid_t pid) {
+  char map[128];
+  char pidstr[16];
+  uid_t uid = getuid();
+  gid_t gid = getgid();
+
+  if (geteuid() == 0) {
+    snprintf(map, sizeof(map), "0 0 1\n1 100000 %d\n", NSRUN_RANGE);
+    write_map(pid, "uid_map", map);
+    write_map(pid, "gid_map", map);
+    return;
+  }
+
+  struct passwd* pw = getpwuid(uid);
+  const char* name = pw ? pw->pw_name : NULL;
+  int subuid = subordinate_start("/etc/subuid", name, uid);
+  int subgid = subordinate_start("/etc/subgid", name, uid);
+  if (subuid < 0 || subgid < 0) {
+    fprintf(stderr, "nsrun: %d subordinate ids are needed in /etc/subuid "
+            "and /etc/subgid.\n", NSRUN_RANGE);
+    exit(125);
+  }
+
+  const char* tools[] = { "newuidmap", "newgidmap" };
+  int starts[] = { subuid, subgid };
+  int ids[] = { (int)uid, (int)gid };
+  int i;
+  snprintf(pidstr, sizeof(pidstr), "%d", (int)pid);
+  for (i = 0; i < 2; i++) {
+    char own[16], sub[16], count[16];
+    int status;
+    snprintf(own, sizeof(own), "%d", ids[i]);
+    snprintf(sub, sizeof(sub), "%d", starts[i]);
+    snprintf(count, sizeof(count), "%d", NSRUN_RANGE);
+    pid_t helper = fork();
+    if (helper < 0) {
+      fail("fork");
+    }
+    if (helper == 0) {
+      execlp(tools[i], tools[i], pidstr, "0", own, "1", "1", sub, count,
+             (char*)NULL);
+      fail(tools[i]);
+    }
+    if (waitpid(helper, &status, 0) < 0 ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "nsrun: %s failed.\n", tools[i]);
+      exit(125);
+    }
+  }
+}
+
+int main(int argc, char* argv[]) {
+  int ready[2];
+  int mapped[2];
+  char c = 0;
+  int status;
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: nsrun command [args...]\n");
+    return 125;
+  }
+  if (pipe(ready) != 0 || pipe(mapped) != 0) {
+    fail("pipe");
+  }
+
+  pid_t child = fork();
+  if (child < 0) {
+    fail("fork");
+  }
+  if (child == 0) {
+    close(ready[0]);
+    close(mapped[1]);
+    if (unshare(CLONE_NEWUSER | CLONE_NEWNS) != 0) {
+      fail("unshare");
+    }
+    if (write(ready[1], &c, 1) != 1) {
+      fail("write");
+    }
+    if (read(mapped[0], &c, 1) != 1) {
+      exit(125);
+    }
+    if (setresgid(0, 0, 0) != 0 || setgroups(0, NULL) != 0 ||
+        setresuid(0, 0, 0) != 0) {
+      fail("switching to root in the namespace");
+    }
+    // nothing mounted from now on should leak to the host.
+    if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0) {
+      fail("making mounts private");
+    }
+    execvp(argv[1], argv + 1);
+    fail(argv[1]);
+  }
+
+  close(ready[1]);
+  close(mapped[0]);
+  if (read(ready[0], &c, 1) != 1) {
+    waitpid(child, &status, 0);
+    return 125;
+  }
+  map_ids(child);
+  if (write(mapped[1], &c, 1) != 1) {
+    fail("write");
+  }
+  if (waitpid(child, &status, 0) < 0) {
+    fail("waitpid");
+  }
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
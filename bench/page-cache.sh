@@ -0,0 +1,100 @@
+#!/bin/bash -e
+#
+# Compile latency in a hot image while a bulk job streams through other
+# files, with and without the page cache protection of the hot image
+# (the "protect" and "bulk" options).
+#
+# The "compile" reads a working set of PAGE_CACHE_MB (defaults to 256)
+# from the host's /usr, the bulk job reads four times as much of the
+# rest of /usr over and over, and both run under a memory.max of one
+# and a half times the working set, so that they compete for the page
+# cache. Without protection the bulk job evicts the compile's files,
+# with protect=PAGE_CACHE_MB it can't. The cgroups an administrator
+# would set up, userchroot-hot and userchroot-bulk, are created in a
+# page-cache cgroup of BENCH_CGROUP, which has that memory.max.
+#
+# This needs a real cgroup v2 hierarchy: BENCH_CGROUP must name a
+# cgroup directory the invoking user can manage, with the memory
+# controller enabled for its children, in the same delegated subtree
+# as the cgroup the benchmark itself runs in (see fakeroot.sh). It is
+# skipped otherwise.
+
+. /bench/lib.sh
+
+if ! grep -qw memory /host-cgroup/cgroup.subtree_control 2> /dev/null; then
+  echo "page-cache: skipped, BENCH_CGROUP isn't a cgroup v2 directory" \
+       "with the memory controller enabled for its children."
+  exit 0
+fi
+mkdir -p /host-cgroup/page-cache /etc/cgroup
+MB=${PAGE_CACHE_MB:-256}
+echo $((MB * 3 / 2 * 1024 * 1024)) > /host-cgroup/page-cache/memory.max
+echo +memory > /host-cgroup/page-cache/cgroup.subtree_control
+mount --bind /host-cgroup/page-cache /etc/cgroup
+mkdir -p /etc/cgroup/userchroot-hot /etc/cgroup/userchroot-bulk
+echo max > /etc/cgroup/userchroot-hot/memory.low
+echo +memory > /etc/cgroup/userchroot-hot/cgroup.subtree_control
+echo +memory > /etc/cgroup/userchroot-bulk/cgroup.subtree_control
+
+ITERATIONS=$BENCH_ITERATIONS
+if [ $ITERATIONS -gt 50 ]; then
+  ITERATIONS=50
+fi
+
+make_base /images/hot
+make_image /images/hot tc
+make_base /images/bulk
+sed -i 's|^\(.*:/images/bulk\)$|\1:bulk|' $CONFIG
+make_image /images/bulk job
+
+# the working set, then the bulk job's files, from the rest of /usr.
+total=0
+limit=$((MB * 1024 * 1024))
+find /usr/include /usr/lib -type f -size +16k -printf '%s %p\n' 2> /dev/null |
+  sort -k 2 | while read size file; do
+    if [ $total -lt $limit ]; then
+      echo "$file" >&3
+    elif [ $total -lt $((5 * limit)) ]; then
+      echo "$file" >&4
+    else
+      break
+    fi
+    total=$((total + size))
+  done 3> /images/hot/tc/tmp/hot 4> /images/bulk/job/tmp/bulk
+chmod 644 /images/hot/tc/tmp/hot /images/bulk/job/tmp/bulk
+
+for protect in 1 ${MB}M; do
+  sed -i "s|^\(.*:/images/hot\).*\$|\1:protect=$protect|" $CONFIG
+  # start cold, and charge the working set to the hot image's cgroup.
+  while read file; do
+    dd if="$file" iflag=nocache count=0 2> /dev/null
+  done < /images/hot/tc/tmp/hot
+  as_user $UC /images/hot/tc /bin/sh -c \
+    'xargs -a /tmp/hot -d "\n" cat > /dev/null'
+  as_user $UC /images/bulk/job /bin/sh -c \
+    'while :; do xargs -a /tmp/bulk -d "\n" cat > /dev/null; done' &
+  bulk=$!
+  sleep 2
+  label="compile, protect=$protect"
+  [ $protect = 1 ] && label="compile, unprotected"
+  as_user /bench/launch_latency -n $ITERATIONS -w 0 -l "$label" \
+    $UC /images/hot/tc /bin/sh -c 'xargs -a /tmp/hot -d "\n" cat > /dev/null'
+  kill $bulk
+  wait $bulk 2> /dev/null || true
+done
+
+# ----------------------------------------------------------------------------
+# Copyright 2015 Bloomberg Finance L.P.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+# ----------------------------- END-OF-FILE ----------------------------------
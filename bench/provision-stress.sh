@@ -0,0 +1,34 @@
+#!/bin/bash -e
+#
+# Concurrent --install-devices, launch and --uninstall-devices across
+# many images, with an increasing number of workers.
+
+. /bench/lib.sh
+
+make_base /images/base
+images=
+for i in $(seq 1 32); do
+  make_image /images/base img$i
+  images="$images /images/base/img$i"
+done
+
+CYCLES=$((BENCH_ITERATIONS / 10))
+for workers in 1 4 16 32; do
+  as_user /bench/stress -p $workers -n $CYCLES $UC $images
+done
+
+# ----------------------------------------------------------------------------
+# Copyright 2015 Bloomberg Finance L.P.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+# ----------------------------- END-OF-FILE ----------------------------------
@@ -0,0 +1,228 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "stats.h"
+
+/*
+ * Replays launches recorded with "userchroot --record=FILE" against a
+ * test host, keeping their relative arrival times, optionally sped up.
+ *
+ * Every launch keeps the size of its arguments and environment, so
+ * userchroot handles as much data as it did in production. In stub
+ * mode (the default) the command is replaced by "/job sleep", which
+ * must exist in the images, lasting as long as the recorded command
+ * did, divided by the speed factor. In real mode the recorded command
+ * itself runs; only the size of its arguments was recorded, so it
+ * gets none, and the padding goes to the environment.
+ *
+ * It reports how late launches started compared to the schedule and
+ * the overhead of each launch over the duration it was supposed to
+ * last, which in stub mode is what userchroot costs under that load.
+ *
+ * usage: replay [-x speed] [-r] [-i image] userchroot recording
+ *
+ * -i replaces all recorded images with the given one.
+ */
+
+struct launch {
+  long long arrival;
+  char image[1024];
+  char command[1024];
+  long arg_bytes;
+  long env_bytes;
+  double duration;
+  pid_t pid;
+  double spawned;
+};
+
+static char* padding(const char* prefix, long bytes) {
+  long len = strlen(prefix);
+  if (bytes < len + 2) {
+    bytes = len + 2;
+  }
+  char* s = malloc(bytes);
+  if (s == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  memset(s, 'x', bytes - 1);
+  memcpy(s, prefix, len);
+  s[bytes - 1] = 0;
+  return s;
+}
+
+static void sleep_until(double when) {
+  double now = stats_now_us();
+  if (when > now) {
+    long micros = (long)(when - now);
+    struct timespec pause = { micros / 1000000, (micros % 1000000) * 1000 };
+    nanosleep(&pause, NULL);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  double speed = 1;
+  int real = 0;
+  const char* image = NULL;
+  int opt;
+  int i;
+
+  while ((opt = getopt(argc, argv, "x:ri:")) != -1) {
+    switch (opt) {
+    case 'x': speed = atof(optarg); break;
+    case 'r': real = 1; break;
+    case 'i': image = optarg; break;
+    default:
+      fprintf(stderr, "usage: replay [-x speed] [-r] [-i image] "
+              "userchroot recording\n");
+      return 1;
+    }
+  }
+  if (argc - optind != 2 || speed <= 0) {
+    fprintf(stderr, "usage: replay [-x speed] [-r] [-i image] "
+            "userchroot recording\n");
+    return 1;
+  }
+  char* uc = argv[optind];
+  FILE* f = fopen(argv[optind + 1], "r");
+  if (f == NULL) {
+    perror(argv[optind + 1]);
+    return 1;
+  }
+
+  int count = 0;
+  int capacity = 1024;
+  struct launch* launches = malloc(capacity * sizeof(struct launch));
+  struct launch l;
+  double duration_us;
+  int exit_code;
+  while (fscanf(f, "%lld %1023s %1023s %ld %ld %lf %d", &l.arrival, l.image,
+                l.command, &l.arg_bytes, &l.env_bytes, &duration_us,
+                &exit_code) == 7) {
+    if (count == capacity) {
+      capacity *= 2;
+      launches = realloc(launches, capacity * sizeof(struct launch));
+    }
+    if (launches == NULL) {
+      perror("realloc");
+      return 1;
+    }
+    l.duration = duration_us / speed;
+    l.pid = 0;
+    launches[count++] = l;
+  }
+  fclose(f);
+  if (count == 0) {
+    fprintf(stderr, "replay: no launches in %s\n", argv[optind + 1]);
+    return 1;
+  }
+
+  double* lag = malloc(count * sizeof(double));
+  double* overhead = malloc(count * sizeof(double));
+  int done = 0;
+  int failed = 0;
+  int next = 0;
+  double start = stats_now_us();
+  long long first = launches[0].arrival;
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+  posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+
+  while (done + failed < count) {
+    // launch everything that is due, then reap whatever finished.
+    while (next < count) {
+      struct launch* ln = &launches[next];
+      double due = start + (ln->arrival - first) / speed;
+      if (due > stats_now_us()) {
+        break;
+      }
+      char millis[32];
+      char* pad;
+      char* env[2] = { NULL, NULL };
+      char* args[7] = { uc, (char*)(image ? image : ln->image) };
+      if (real) {
+        args[2] = ln->command;
+        pad = padding("", 1);
+        env[0] = padding("PAD=", ln->env_bytes + ln->arg_bytes);
+      } else {
+        // "/job sleep" and the duration take some of the argument bytes.
+        snprintf(millis, sizeof(millis), "%.0f", ln->duration / 1000);
+        pad = padding("", ln->arg_bytes - strlen(millis) - 12);
+        args[2] = "/job";
+        args[3] = "sleep";
+        args[4] = millis;
+        args[5] = pad;
+        env[0] = padding("PAD=", ln->env_bytes);
+      }
+      ln->spawned = stats_now_us();
+      if (posix_spawn(&ln->pid, uc, &actions, NULL, args, env) != 0) {
+        failed++;
+      }
+      free(pad);
+      free(env[0]);
+      lag[next] = ln->spawned - due;
+      next++;
+    }
+
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      for (i = 0; i < next; i++) {
+        if (launches[i].pid == pid) {
+          break;
+        }
+      }
+      if (i == next) {
+        continue;
+      }
+      launches[i].pid = 0;
+      if (!WIFEXITED(status) || (!real && WEXITSTATUS(status) != 0)) {
+        failed++;
+        continue;
+      }
+      double took = stats_now_us() - launches[i].spawned;
+      overhead[done++] = took - (real ? 0 : launches[i].duration);
+    }
+
+    if (next < count) {
+      double due = start + (launches[next].arrival - first) / speed;
+      if (due - stats_now_us() > 1000) {
+        sleep_until(stats_now_us() + 1000);
+      }
+    } else if (pid == 0) {
+      sleep_until(stats_now_us() + 1000);
+    }
+  }
+
+  printf("replayed %d launches at %gx in %.1fs, %d failed\n", count, speed,
+         (stats_now_us() - start) / 1e6, failed);
+  stats_print(stdout, "  schedule lag", lag, next);
+  stats_print(stdout, real ? "  duration" : "  overhead over recorded",
+              overhead, done);
+  return failed ? 1 : 0;
+}
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
@@ -0,0 +1,48 @@
+#!/bin/bash -e
+#
+# Replays a launch recording (see "userchroot --record") through
+# userchroot, at 1x and at REPLAY_SPEED (defaults to 4x), against a
+# single image. With "-" as argument, the recording is read from the
+# standard input; otherwise a short one is recorded here first, from
+# launches of different durations and sizes.
+
+. /bench/lib.sh
+
+SPEED=${REPLAY_SPEED:-4}
+
+make_base /images/base
+make_image /images/base img
+cp /bench/job /images/base/img/job
+as_user $UC /images/base/img --install-devices
+
+RECORDING=/tmp/recording
+if [ "$1" = "-" ]; then
+  cat > $RECORDING
+else
+  for i in $(seq 1 200); do
+    env -i PAD=$(head -c $((i * 37 % 4096)) /dev/zero | tr '\0' x) \
+      setpriv --reuid=$BENCH_UID --regid=$BENCH_UID --clear-groups \
+      $UC --record=$RECORDING /images/base/img /job sleep $((i % 7 * 5)) \
+      $(seq 1 $((i % 50))) > /dev/null
+  done
+fi
+chmod 644 $RECORDING
+
+as_user /bench/replay -x 1 -i /images/base/img $UC $RECORDING
+as_user /bench/replay -x $SPEED -i /images/base/img $UC $RECORDING
+
+# ----------------------------------------------------------------------------
+# Copyright 2015 Bloomberg Finance L.P.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+# ----------------------------- END-OF-FILE ----------------------------------
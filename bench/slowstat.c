@@ -0,0 +1,85 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * A preloaded shim that adds a fixed delay to every stat-family call,
+ * to reproduce locally what base paths on NFS cost, where each lstat
+ * is a network round trip.
+ *
+ * userchroot is setuid, so LD_PRELOAD doesn't apply to it, but
+ * /etc/ld.so.preload does. The benchmark writes both that file and
+ * the delay in microseconds, in /etc/slowstat.conf, inside its fake
+ * root; neither ever exists on the host. The delay is read once,
+ * when the library is loaded.
+ *
+ * Older C libraries route stat calls through the versioned __xstat
+ * family, so those are covered too.
+ */
+
+static struct timespec delay;
+
+__attribute__((constructor))
+static void slowstat_init() {
+  char buf[32];
+  int fd = open("/etc/slowstat.conf", O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len > 0) {
+    buf[len] = 0;
+    long usec = atol(buf);
+    delay.tv_sec = usec / 1000000;
+    delay.tv_nsec = (usec % 1000000) * 1000;
+  }
+}
+
+static void slowstat_wait() {
+  if (delay.tv_sec != 0 || delay.tv_nsec != 0) {
+    nanosleep(&delay, NULL);
+  }
+}
+
+#define SLOWSTAT_WRAP(ret, name, params, args)                    \
+  ret name params {                                               \
+    static ret (*real) params = NULL;                             \
+    if (real == NULL) {                                           \
+      real = (ret (*) params) dlsym(RTLD_NEXT, #name);            \
+    }                                                             \
+    slowstat_wait();                                              \
+    return real args;                                             \
+  }
+
+SLOWSTAT_WRAP(int, stat, (const char* p, struct stat* s), (p, s))
+SLOWSTAT_WRAP(int, lstat, (const char* p, struct stat* s), (p, s))
+SLOWSTAT_WRAP(int, fstat, (int fd, struct stat* s), (fd, s))
+SLOWSTAT_WRAP(int, fstatat, (int d, const char* p, struct stat* s, int f),
+              (d, p, s, f))
+SLOWSTAT_WRAP(int, statx, (int d, const char* p, int f, unsigned int m,
+                           struct statx* s), (d, p, f, m, s))
+SLOWSTAT_WRAP(int, __xstat, (int v, const char* p, struct stat* s), (v, p, s))
+SLOWSTAT_WRAP(int, __lxstat, (int v, const char* p, struct stat* s), (v, p, s))
+SLOWSTAT_WRAP(int, __fxstat, (int v, int fd, struct stat* s), (v, fd, s))
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
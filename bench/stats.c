@@ -0,0 +1,70 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "stats.h"
+
+/*
+ * Latency distribution helpers shared by the benchmarks. Percentiles
+ * use the nearest-rank method, so p99.9 is only meaningful with at
+ * least a thousand samples.
+ */
+
+static int compare_doubles(const void* a, const void* b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+double stats_now_us() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+double stats_percentile(const double* sorted, int count, double p) {
+  int rank;
+  if (count == 0) {
+    return 0;
+  }
+  rank = (int)(p / 100 * count + 0.999999);
+  if (rank < 1) {
+    rank = 1;
+  }
+  if (rank > count) {
+    rank = count;
+  }
+  return sorted[rank - 1];
+}
+
+void stats_print(FILE* out, const char* label, double* samples, int count) {
+  int i;
+  double sum = 0;
+  qsort(samples, count, sizeof(double), compare_doubles);
+  for (i = 0; i < count; i++) {
+    sum += samples[i];
+  }
+  fprintf(out, "%-44s n=%-6d mean=%9.1fus p50=%9.1fus p99=%9.1fus "
+          "p99.9=%9.1fus max=%9.1fus\n",
+          label, count, count ? sum / count : 0,
+          stats_percentile(samples, count, 50),
+          stats_percentile(samples, count, 99),
+          stats_percentile(samples, count, 99.9),
+          count ? samples[count - 1] : 0);
+}
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
@@ -0,0 +1,23 @@
+#include <stdio.h>
+
+// Sorts 'samples' (in microseconds) and prints their distribution as
+// a single line prefixed by 'label'.
+void stats_print(FILE* out, const char* label, double* samples, int count);
+double stats_percentile(const double* sorted, int count, double p);
+double stats_now_us();
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
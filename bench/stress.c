@@ -0,0 +1,183 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "stats.h"
+
+/*
+ * Stress test for device provisioning. Each of the worker processes
+ * owns a share of the images and cycles through them running
+ * --install-devices, a launch of /bin/true and --uninstall-devices,
+ * so that provisioning of different images always overlaps. Reports
+ * the throughput of whole cycles, the latency distribution of each
+ * step, the failures, and any mount left behind under the images.
+ *
+ * usage: stress [-p workers] [-n cycles] userchroot image...
+ */
+
+enum { OP_INSTALL, OP_LAUNCH, OP_UNINSTALL, NUM_OPS };
+static const char* op_names[] = { "install-devices", "launch",
+                                  "uninstall-devices" };
+
+struct sample {
+  double latency;
+  int failed;
+};
+
+static int run(char* argv[]) {
+  pid_t pid;
+  int status;
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+  if (posix_spawn(&pid, argv[0], &actions, NULL, argv, NULL) != 0) {
+    return -1;
+  }
+  posix_spawn_file_actions_destroy(&actions);
+  if (waitpid(pid, &status, 0) < 0) {
+    return -1;
+  }
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static void worker(int id, int workers, int cycles, char* uc,
+                   char** images, int num_images, struct sample* out) {
+  int i;
+  for (i = 0; i < cycles; i++) {
+    char* image = images[(id + i * workers) % num_images];
+    char* install[] = { uc, image, "--install-devices", NULL };
+    char* launch[] = { uc, image, "/bin/true", NULL };
+    char* uninstall[] = { uc, image, "--uninstall-devices", NULL };
+    char** steps[] = { install, launch, uninstall };
+    int op;
+    for (op = 0; op < NUM_OPS; op++) {
+      double start = stats_now_us();
+      out[i * NUM_OPS + op].failed = run(steps[op]) != 0;
+      out[i * NUM_OPS + op].latency = stats_now_us() - start;
+    }
+  }
+}
+
+// Counts the mounts still present under any of the images.
+static int leaked_mounts(char** images, int num_images) {
+  char line[4096];
+  int leaks = 0;
+  FILE* f = fopen("/proc/self/mountinfo", "r");
+  if (f == NULL) {
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char mountpoint[4096];
+    int i;
+    if (sscanf(line, "%*s %*s %*s %*s %4095s", mountpoint) != 1) {
+      continue;
+    }
+    for (i = 0; i < num_images; i++) {
+      size_t len = strlen(images[i]);
+      if (strncmp(mountpoint, images[i], len) == 0 &&
+          strncmp(mountpoint + len, "/dev/", 5) == 0) {
+        fprintf(stderr, "stress: leaked mount %s\n", mountpoint);
+        leaks++;
+      }
+    }
+  }
+  fclose(f);
+  return leaks;
+}
+
+int main(int argc, char* argv[]) {
+  int workers = 4;
+  int cycles = 100;
+  int opt;
+  int w, op, i;
+
+  while ((opt = getopt(argc, argv, "p:n:")) != -1) {
+    switch (opt) {
+    case 'p': workers = atoi(optarg); break;
+    case 'n': cycles = atoi(optarg); break;
+    default:
+      fprintf(stderr, "usage: stress [-p workers] [-n cycles] "
+              "userchroot image...\n");
+      return 1;
+    }
+  }
+  if (argc - optind < 2) {
+    fprintf(stderr, "stress: need userchroot and at least one image\n");
+    return 1;
+  }
+  char* uc = argv[optind];
+  char** images = argv + optind + 1;
+  int num_images = argc - optind - 1;
+  if (num_images < workers) {
+    fprintf(stderr, "stress: need at least as many images as workers\n");
+    return 1;
+  }
+
+  size_t total = (size_t)workers * cycles * NUM_OPS;
+  struct sample* samples = mmap(NULL, total * sizeof(struct sample),
+                                PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (samples == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+
+  double start = stats_now_us();
+  for (w = 0; w < workers; w++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      return 1;
+    }
+    if (pid == 0) {
+      worker(w, workers, cycles, uc, images, num_images,
+             samples + (size_t)w * cycles * NUM_OPS);
+      _exit(0);
+    }
+  }
+  while (wait(NULL) > 0) {
+  }
+  double elapsed = (stats_now_us() - start) / 1e6;
+
+  printf("%d workers, %d images: %.1f cycles/s\n", workers, num_images,
+         workers * cycles / elapsed);
+  int failures = 0;
+  double* latencies = malloc(workers * cycles * sizeof(double));
+  for (op = 0; op < NUM_OPS; op++) {
+    int n = 0;
+    int failed = 0;
+    char label[64];
+    for (i = op; i < (int)total; i += NUM_OPS) {
+      latencies[n++] = samples[i].latency;
+      failed += samples[i].failed;
+    }
+    snprintf(label, sizeof(label), "  %s (%d failed)", op_names[op], failed);
+    stats_print(stdout, label, latencies, n);
+    failures += failed;
+  }
+  int leaks = leaked_mounts(images, num_images);
+  printf("  %d failures, %d leaked mounts\n", failures, leaks);
+  return failures || leaks ? 1 : 0;
+}
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
@@ -0,0 +1,52 @@
+#!/bin/bash -e
+#
+# Launch latency as a function of the depth of the base path and of
+# the latency of each stat-family call, which slowstat.so injects to
+# emulate base paths on a network filesystem.
+
+. /bench/lib.sh
+
+ITERATIONS=$BENCH_ITERATIONS
+if [ $ITERATIONS -gt 200 ]; then
+  ITERATIONS=200
+fi
+
+for depth in 2 8 32; do
+  base=/depth$depth
+  for i in $(seq 2 $depth); do
+    base=$base/d$i
+  done
+  make_base $base
+  make_image $base img
+done
+
+echo /bench/slowstat.so > /etc/ld.so.preload
+for delay in 0 100 1000; do
+  echo $delay > /etc/slowstat.conf
+  echo "== ${delay}us per stat call"
+  for depth in 2 8 32; do
+    base=/depth$depth
+    for i in $(seq 2 $depth); do
+      base=$base/d$i
+    done
+    as_user /bench/launch_latency -n $ITERATIONS -w 5 \
+      -l "userchroot, depth $depth" $UC $base/img /bin/true
+  done
+done
+rm -f /etc/ld.so.preload /etc/slowstat.conf
+
+# ----------------------------------------------------------------------------
+# Copyright 2015 Bloomberg Finance L.P.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+# ----------------------------- END-OF-FILE ----------------------------------
@@ -0,0 +1,153 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "userchroot.h"
+#include "config.h"
+#include "cgroup.h"
+
+/*
+ * Page cache protection for hot images. One large link or data
+ * generation job can evict the page cache of the images every compile
+ * on the host reads from, and each compile after it pays for cold
+ * reads. With cgroup v2, launches from a base configured with
+ * "protect=SIZE" run in a cgroup of that base whose memory.low is
+ * SIZE, so the kernel leaves that much of its memory, page cache
+ * included, alone for as long as there is anything unprotected to
+ * reclaim. Launches from a base configured with "bulk" run in a cgroup
+ * outside of any protection, which is where reclaim goes first, and
+ * with "bulk=SIZE" under a memory.high of SIZE.
+ *
+ * Moving a job to another cgroup takes it out of the limits, and the
+ * systemd unit, of the one it was launched from, so userchroot only
+ * moves jobs under two cgroups the administrator created and
+ * configured, and only creates their children, which can't be less
+ * strict than they are:
+ *
+ *   userchroot-hot/      the administrator's, with memory.low set
+ *     <base>/            memory.low=SIZE
+ *   userchroot-bulk/     the administrator's, without memory.low
+ *     <base>/            memory.high=SIZE, with bulk=SIZE
+ *
+ * Protection only reaches a cgroup through its ancestors, so
+ * userchroot-hot needs a memory.low of its own, up to "max", and
+ * userchroot-bulk none, nor any ancestor with one: with the
+ * memory_recursiveprot mount option, a cgroup gets the protection its
+ * parent doesn't pass on explicitly. Both must be owned by root and
+ * have the memory controller enabled for their children. The base is
+ * named with its '/' turned into '@', which can't be in a whitelisted
+ * path.
+ *
+ * Without them, or without a cgroup v2 memory controller, the launch
+ * stays where it is, unprotected.
+ */
+
+#ifndef CGROUP_DIR
+#define CGROUP_DIR "/sys/fs/cgroup"
+#endif
+
+#define CGROUP_HOT CGROUP_DIR "/userchroot-hot"
+#define CGROUP_BULK CGROUP_DIR "/userchroot-bulk"
+
+// Whether the administrator set up the cgroup 'dir' for userchroot.
+static int cgroup_ready(const char* dir) {
+  char path[PATH_MAX];
+  char line[256];
+  struct stat sb;
+  int found = 0;
+  if (lstat(dir, &sb) != 0 || !S_ISDIR(sb.st_mode) || sb.st_uid != 0 ||
+      (sb.st_mode & 00022)) {
+    return 0;
+  }
+  snprintf(path, sizeof(path), "%s/cgroup.subtree_control", dir);
+  FILE* f = fopen(path, "r");
+  if (f == NULL) {
+    return 0;
+  }
+  if (fgets(line, sizeof(line), f) != NULL) {
+    char* saveptr = NULL;
+    char* word;
+    for (word = strtok_r(line, " \n", &saveptr); word != NULL;
+         word = strtok_r(NULL, " \n", &saveptr)) {
+      if (strcmp(word, "memory") == 0) {
+        found = 1;
+      }
+    }
+  }
+  fclose(f);
+  return found;
+}
+
+static void cgroup_make(const char* dir) {
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr,"Failed to create cgroup %s: %s. Aborting.\n", dir,
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+}
+
+static void cgroup_write(const char* dir, const char* file,
+                         const char* value) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", dir, file);
+  int fd = open(path, O_WRONLY | O_TRUNC | O_CLOEXEC);
+  if (fd < 0 || write(fd, value, strlen(value)) != (ssize_t)strlen(value)) {
+    fprintf(stderr,"Failed to write %s to %s: %s. Aborting.\n", value, path,
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  close(fd);
+}
+
+// Moves userchroot, and so the job, to the cgroup the base's options
+// ask for. Must run as root.
+void cgroup_enter(const char* base, const struct image_options* opts) {
+  char leaf[PATH_MAX];
+  char value[32];
+  char* p;
+  if (opts->protect == 0 && !opts->bulk) {
+    return;
+  }
+  const char* top = opts->bulk ? CGROUP_BULK : CGROUP_HOT;
+  if (!cgroup_ready(top)) {
+    return;
+  }
+  snprintf(leaf, sizeof(leaf), "%s/%s", top, base + 1);
+  for (p = leaf + strlen(top) + 1; *p; p++) {
+    if (*p == '/') {
+      *p = '@';
+    }
+  }
+  cgroup_make(leaf);
+  if (opts->bulk && opts->bulk_high > 0) {
+    snprintf(value, sizeof(value), "%llu", opts->bulk_high);
+    cgroup_write(leaf, "memory.high", value);
+  } else if (!opts->bulk) {
+    snprintf(value, sizeof(value), "%llu", opts->protect);
+    cgroup_write(leaf, "memory.low", value);
+  }
+  snprintf(value, sizeof(value), "%d", (int)getpid());
+  cgroup_write(leaf, "cgroup.procs", value);
+}
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
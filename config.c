@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "userchroot.h"
+#include "config.h"
+
+/*
+ * Helpers to read the configuration file, which has one entry per
+ * line in the format:
+ * user:/absolute/path[:option,option...]
+ *
+ * The options apply to every image under that base path. Paths can't
+ * contain ':', so there is no ambiguity.
+ *
+ * The file must already have been validated by check_config_file.
+ */
+
+// Looks for the exact entry 'line', which is 'linelen' bytes long
+// including the line break and the terminating nul, in the
+// configuration, with or without options. Returns non-zero if it is
+// there. Unless 'options' is NULL, it is set to a newly allocated copy
+// of the options of the entry, or NULL if it has none.
+int config_has_entry(FILE* config, const char* line, int linelen,
+                     char** options) {
+  // we're going to use fgets, which will return the next line or up
+  // to the buffer limit, that means that if a line is bigger then the
+  // buffer, it will go another pass.
+  //
+  // we're going to set the buffer to the same as our desired line,
+  // since we don't care of anything bigger than that.
+  char *rline = malloc(linelen);
+  if (rline == NULL) {
+    fprintf(stderr,"Failed to allocate memory. Aborting.\n");
+    exit(ERR_EXIT_CODE);
+  }
+
+  int found = 0;
+  if (options != NULL) {
+    *options = NULL;
+  }
+  rewind(config);
+  while (feof(config) == 0 &&
+         fgets(rline, linelen, config) != NULL) {
+    int ignore = 0;
+    // the buffer fits the entry and one more character, a ':' there
+    // means the rest of the line is options.
+    if (strchr(rline, '\n') == NULL &&
+        strncmp(line, rline, linelen - 2) == 0 &&
+        rline[linelen - 2] == ':') {
+      char* rest = NULL;
+      size_t restcap = 0;
+      ssize_t len = getline(&rest, &restcap, config);
+      if (len < 0) {
+        free(rest);
+        rest = strdup("");
+      } else if (len > 0 && rest[len - 1] == '\n') {
+        rest[len - 1] = 0;
+      }
+      if (rest == NULL) {
+        fprintf(stderr,"Failed to allocate memory. Aborting.\n");
+        exit(ERR_EXIT_CODE);
+      }
+      if (options != NULL) {
+        *options = rest;
+      } else {
+        free(rest);
+      }
+      found = 1;
+      break;
+    }
+    while (strchr(rline, '\n') == NULL) {
+      // we want to ignore lines bigger than linelen...
+      // so we will continue to consume until we find a line break.
+      ignore = 1;
+      if (feof(config) || fgets(rline, linelen, config) == NULL) {
+        break;
+      }
+    }
+    if (!ignore && strncmp(line, rline, linelen) == 0) {
+      found = 1;
+      break;
+    }
+  }
+  free(rline);
+  return found;
+}
+
+// Returns the number of base paths in the configuration, storing a
+// newly allocated array of them in 'bases'. Lines that don't look
+// like an entry are skipped, the same way the lookup in main() would
+// never match them.
+int config_list_bases(FILE* config, char*** bases) {
+  char* rline = NULL;
+  size_t rlinecap = 0;
+  ssize_t len;
+  int count = 0;
+  *bases = NULL;
+  rewind(config);
+  while ((len = getline(&rline, &rlinecap, config)) > 0) {
+    if (rline[len - 1] == '\n') {
+      rline[len - 1] = 0;
+    }
+    char* colon = strchr(rline, ':');
+    if (colon == NULL || colon == rline || colon[1] != '/') {
+      continue;
+    }
+    char* options = strchr(colon + 1, ':');
+    if (options != NULL) {
+      *options = 0;
+    }
+    *bases = realloc(*bases, (count + 1) * sizeof(char*));
+    if (*bases == NULL) {
+      fprintf(stderr,"Failed to allocate memory. Aborting.\n");
+      exit(ERR_EXIT_CODE);
+    }
+    (*bases)[count] = strdup(colon + 1);
+    if ((*bases)[count] == NULL) {
+      fprintf(stderr,"Failed to allocate memory. Aborting.\n");
+      exit(ERR_EXIT_CODE);
+    }
+    count++;
+  }
+  free(rline);
+  return count;
+}
+
+// Parses a size in bytes, with an optional K, M or G suffix. Returns
+// 0 if it isn't one.
+static unsigned long long parse_size(const char* str) {
+  char* end;
+  unsigned long long size = strtoull(str, &end, 10);
+  if (end == str || str[0] == '-') {
+    return 0;
+  }
+  switch (*end) {
+  case 'G':
+    size *= 1024;
+    // fall through
+  case 'M':
+    size *= 1024;
+    // fall through
+  case 'K':
+    size *= 1024;
+    end++;
+  }
+  return *end == 0 ? size : 0;
+}
+
+// Parses the options of a configuration entry into 'opts'. Unknown
+// options are an error: ignoring one could mean running a job with
+// less isolation than the owner of the base asked for.
+void config_parse_options(const char* options, struct image_options* opts) {
+  memset(opts, 0, sizeof(*opts));
+  if (options == NULL) {
+    return;
+  }
+  char* copy = strdup(options);
+  if (copy == NULL) {
+    fprintf(stderr,"Failed to allocate memory. Aborting.\n");
+    exit(ERR_EXIT_CODE);
+  }
+  char* saveptr = NULL;
+  char* opt;
+  for (opt = strtok_r(copy, ",", &saveptr); opt != NULL;
+       opt = strtok_r(NULL, ",", &saveptr)) {
+    if (strcmp(opt, "net") == 0) {
+      opts->namespaces |= IMAGE_NEWNET;
+    } else if (strcmp(opt, "ipc") == 0) {
+      opts->namespaces |= IMAGE_NEWIPC;
+    } else if (strcmp(opt, "uts") == 0) {
+      opts->namespaces |= IMAGE_NEWUTS;
+    } else if (strncmp(opt, "protect=", 8) == 0) {
+      opts->protect = parse_size(opt + 8);
+      if (opts->protect == 0) {
+        fprintf(stderr,"Invalid size in option %s in configuration. "
+                "Aborting.\n", opt);
+        exit(ERR_EXIT_CODE);
+      }
+    } else if (strcmp(opt, "bulk") == 0) {
+      opts->bulk = 1;
+    } else if (strncmp(opt, "bulk=", 5) == 0) {
+      opts->bulk = 1;
+      opts->bulk_high = parse_size(opt + 5);
+      if (opts->bulk_high == 0) {
+        fprintf(stderr,"Invalid size in option %s in configuration. "
+                "Aborting.\n", opt);
+        exit(ERR_EXIT_CODE);
+      }
+    } else if (strcmp(opt, "ephemeral") == 0) {
+      opts->ephemeral = 1;
+    } else if (strncmp(opt, "ephemeral=", 10) == 0) {
+      opts->ephemeral = 1;
+      opts->ephemeral_size = parse_size(opt + 10);
+      if (opts->ephemeral_size == 0) {
+        fprintf(stderr,"Invalid size in option %s in configuration. "
+                "Aborting.\n", opt);
+        exit(ERR_EXIT_CODE);
+      }
+    } else if (strncmp(opt, "golden=", 7) == 0 && opt[7] != 0) {
+      free(opts->golden);
+      opts->golden = strdup(opt + 7);
+      if (opts->golden == NULL) {
+        fprintf(stderr,"Failed to allocate memory. Aborting.\n");
+        exit(ERR_EXIT_CODE);
+      }
+    } else if (strncmp(opt, "workspaces=", 11) == 0 && opt[11] != 0) {
+      free(opts->workspaces);
+      opts->workspaces = strdup(opt + 11);
+      if (opts->workspaces == NULL) {
+        fprintf(stderr,"Failed to allocate memory. Aborting.\n");
+        exit(ERR_EXIT_CODE);
+      }
+    } else if (strncmp(opt, "workspace-budget=", 17) == 0) {
+      opts->workspace_budget = parse_size(opt + 17);
+      if (opts->workspace_budget == 0) {
+        fprintf(stderr,"Invalid size in option %s in configuration. "
+                "Aborting.\n", opt);
+        exit(ERR_EXIT_CODE);
+      }
+    } else {
+      fprintf(stderr,"Unknown option %s in configuration. Aborting.\n", opt);
+      exit(ERR_EXIT_CODE);
+    }
+  }
+  free(copy);
+  if (opts->protect > 0 && opts->bulk) {
+    fprintf(stderr,"Options protect and bulk can't be combined in "
+            "configuration. Aborting.\n");
+    exit(ERR_EXIT_CODE);
+  }
+}
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
@@ -0,0 +1,37 @@
+// Namespaces a job starts in, from the configuration options.
+#define IMAGE_NEWNET 1  // "net": only a loopback interface
+#define IMAGE_NEWIPC 2  // "ipc": SysV IPC and POSIX message queues
+#define IMAGE_NEWUTS 4  // "uts": hostname and domain name
+
+struct image_options {
+  int namespaces;
+  int ephemeral;  // "ephemeral": writes go to a throw-away overlay
+  unsigned long long ephemeral_size;  // "ephemeral=SIZE", or 0
+  char* golden;   // "golden=DIR": root's golden images, or NULL
+  unsigned long long protect;  // "protect=SIZE": memory.low, in bytes
+  int bulk;       // "bulk": page cache reclaimed before the others'
+  unsigned long long bulk_high;  // "bulk=SIZE": memory.high, or 0
+  char* workspaces;  // "workspaces=DIR": the workspace store, or NULL
+  unsigned long long workspace_budget;  // "workspace-budget=SIZE", or 0
+};
+
+int config_has_entry(FILE* config, const char* line, int linelen,
+                     char** options);
+int config_list_bases(FILE* config, char*** bases);
+void config_parse_options(const char* options, struct image_options* opts);
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
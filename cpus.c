@@ -0,0 +1,297 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/mount.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#endif
+
+#include "userchroot.h"
+#include "cpus.h"
+
+/*
+ * Makes the number of CPUs a job sees match what it can actually use,
+ * so that tools sizing their thread pools from it don't oversubscribe
+ * the machine.
+ *
+ * The job can use the CPUs in its affinity mask, and no more than the
+ * quota of its cgroup (cpu.max, or cpu.cfs_quota_us on cgroup v1)
+ * worth of them. When the quota is the tighter limit, the mask is
+ * narrowed to its first CPUs, which is what nproc, the JVM and most
+ * runtimes look at. If the image has /proc or /sys mounted, the
+ * cpuinfo and cpu/online files are then covered, in the job's own
+ * mount namespace (see namespaces_private_mounts), by copies listing
+ * only those CPUs, for the tools reading them instead.
+ */
+
+#ifdef __linux__
+
+#define CPUS_FILE_MAX (1 << 20)
+
+// Reads a whole file, up to CPUS_FILE_MAX bytes, into a newly
+// allocated string. Returns NULL if it can't be read.
+static char* read_file(const char* path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+  char* buf = malloc(CPUS_FILE_MAX);
+  size_t len = 0;
+  ssize_t n;
+  while (buf != NULL && len < CPUS_FILE_MAX - 1 &&
+         (n = read(fd, buf + len, CPUS_FILE_MAX - 1 - len)) > 0) {
+    len += n;
+  }
+  close(fd);
+  if (buf != NULL) {
+    buf[len] = 0;
+  }
+  return buf;
+}
+
+// Number of CPUs the quota of the cgroup at 'path', or any of its
+// ancestors, amounts to, rounded up. Returns 0 if there is no quota.
+static int cgroup_quota_cpus(const char* root, const char* file,
+                             const char* path) {
+  char dir[4096];
+  int cpus = 0;
+  snprintf(dir, sizeof(dir), "%s%s", root, path);
+  for (;;) {
+    char limit[4096 + 32];
+    long long quota, period = 0;
+    char* content;
+    snprintf(limit, sizeof(limit), "%s/%s", dir, file);
+    if ((content = read_file(limit)) != NULL) {
+      if (strcmp(file, "cpu.max") == 0) {
+        // "max 100000" or "quota period"
+        if (sscanf(content, "%lld %lld", &quota, &period) != 2) {
+          period = 0;
+        }
+      } else {
+        // cgroup v1 keeps the period in a file of its own.
+        char* p;
+        quota = atoll(content);
+        snprintf(limit, sizeof(limit), "%s/cpu.cfs_period_us", dir);
+        if ((p = read_file(limit)) != NULL) {
+          period = atoll(p);
+          free(p);
+        }
+      }
+      free(content);
+      if (quota > 0 && period > 0) {
+        int n = (quota + period - 1) / period;
+        if (cpus == 0 || n < cpus) {
+          cpus = n;
+        }
+      }
+    }
+    char* slash = strrchr(dir, '/');
+    if (slash == NULL || strlen(dir) <= strlen(root)) {
+      break;
+    }
+    *slash = 0;
+  }
+  return cpus;
+}
+
+static int quota_cpus() {
+  char* cgroups = read_file("/proc/self/cgroup");
+  char* line;
+  char* saveptr = NULL;
+  int cpus = 0;
+  if (cgroups == NULL) {
+    return 0;
+  }
+  for (line = strtok_r(cgroups, "\n", &saveptr); line != NULL;
+       line = strtok_r(NULL, "\n", &saveptr)) {
+    char* controllers = strchr(line, ':');
+    char* path = controllers ? strchr(controllers + 1, ':') : NULL;
+    int n = 0;
+    if (path == NULL) {
+      continue;
+    }
+    *path++ = 0;
+    controllers++;
+    if (*controllers == 0) {
+      n = cgroup_quota_cpus("/sys/fs/cgroup", "cpu.max", path);
+    } else if (strcmp(controllers, "cpu") == 0 ||
+               strcmp(controllers, "cpu,cpuacct") == 0 ||
+               strcmp(controllers, "cpuacct,cpu") == 0) {
+      n = cgroup_quota_cpus("/sys/fs/cgroup/cpu", "cpu.cfs_quota_us", path);
+    }
+    if (n > 0 && (cpus == 0 || n < cpus)) {
+      cpus = n;
+    }
+  }
+  free(cgroups);
+  return cpus;
+}
+
+// Formats the CPUs in 'set' the way cpu/online does, e.g. "0-3,8".
+static void format_cpu_list(const cpu_set_t* set, char* out, size_t outlen) {
+  int cpu;
+  size_t len = 0;
+  out[0] = 0;
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, set)) {
+      continue;
+    }
+    int last = cpu;
+    while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) {
+      last++;
+    }
+    if (last == cpu) {
+      len += snprintf(out + len, outlen - len, "%s%d", len ? "," : "", cpu);
+    } else {
+      len += snprintf(out + len, outlen - len, "%s%d-%d", len ? "," : "",
+                      cpu, last);
+    }
+    if (len >= outlen) {
+      out[outlen - 1] = 0;
+      return;
+    }
+    cpu = last;
+  }
+}
+
+// Keeps only the "processor" blocks of /proc/cpuinfo for CPUs in set.
+static char* filter_cpuinfo(const char* cpuinfo, const cpu_set_t* set) {
+  char* out = malloc(strlen(cpuinfo) + 1);
+  size_t len = 0;
+  const char* block = cpuinfo;
+  if (out == NULL) {
+    return NULL;
+  }
+  while (*block) {
+    const char* end = strstr(block, "\n\n");
+    end = end ? end + 2 : block + strlen(block);
+    int cpu;
+    if (sscanf(block, "processor : %d", &cpu) != 1 ||
+        (cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, set))) {
+      memcpy(out + len, block, end - block);
+      len += end - block;
+    }
+    block = end;
+  }
+  out[len] = 0;
+  return out;
+}
+
+// Covers 'path', which must be a file of a filesystem of type
+// 'fstype', with a file holding 'content'.
+static void overlay_file(const char* path, long fstype, const char* content) {
+  struct statfs sfs;
+  char target[64];
+  int rc;
+  // O_PATH with O_NOFOLLOW: the image belongs to its owner, who could
+  // have put a link there, but only a real proc or sys file gets
+  // covered.
+  int fd = open(path, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  if (fstatfs(fd, &sfs) != 0 || sfs.f_type != fstype) {
+    close(fd);
+    return;
+  }
+  // the copy must live on a filesystem mounted in this namespace to be
+  // bind mounted, which rules out a memfd. It is unlinked right away,
+  // the mount keeps it alive.
+  char source[] = "/tmp/userchroot-cpus.XXXXXX";
+  int copy = mkstemp(source);
+  size_t len = strlen(content);
+  if (copy < 0 || fchmod(copy, 0444) != 0 ||
+      write(copy, content, len) != (ssize_t)len) {
+    fprintf(stderr,"Failed to create the contents of %s. Aborting.\n", path);
+    exit(ERR_EXIT_CODE);
+  }
+  close(copy);
+  snprintf(target, sizeof(target), "/proc/self/fd/%d", fd);
+  rc = mount(source, target, NULL, MS_BIND, NULL);
+  unlink(source);
+  if (rc != 0) {
+    fprintf(stderr,"Failed to cover %s: %s. Aborting.\n", path,
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  close(fd);
+}
+
+#endif
+
+// Must run as root, before the chroot, in a private mount namespace.
+void cpus_match(const char* image) {
+#ifdef __linux__
+  cpu_set_t set;
+  char path[4096];
+  char online[4096];
+  int cpu;
+  if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+    fprintf(stderr,"Failed to get the CPU affinity: %s. Aborting.\n",
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  int quota = quota_cpus();
+  if (quota > 0 && quota < CPU_COUNT(&set)) {
+    int kept = 0;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &set) && kept++ >= quota) {
+        CPU_CLR(cpu, &set);
+      }
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+      fprintf(stderr,"Failed to set the CPU affinity: %s. Aborting.\n",
+              strerror(errno));
+      exit(ERR_EXIT_CODE);
+    }
+  }
+  if (CPU_COUNT(&set) == sysconf(_SC_NPROCESSORS_ONLN)) {
+    return;
+  }
+
+  format_cpu_list(&set, online, sizeof(online) - 1);
+  strcat(online, "\n");
+  snprintf(path, sizeof(path), "%s/sys/devices/system/cpu/online", image);
+  overlay_file(path, SYSFS_MAGIC, online);
+
+  snprintf(path, sizeof(path), "%s/proc/cpuinfo", image);
+  char* cpuinfo = read_file("/proc/cpuinfo");
+  char* filtered = cpuinfo ? filter_cpuinfo(cpuinfo, &set) : NULL;
+  if (filtered != NULL) {
+    overlay_file(path, PROC_SUPER_MAGIC, filtered);
+  }
+  free(cpuinfo);
+  free(filtered);
+#else
+  fprintf(stderr,"Matching the CPU count is only supported on Linux. "
+          "Aborting.\n");
+  exit(ERR_EXIT_CODE);
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
@@ -0,0 +1,294 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <sys/mount.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#endif
+
+#include "userchroot.h"
+#include "namespaces.h"
+#include "ephemeral.h"
+
+/*
+ * Ephemeral images, for jobs whose writes are thrown away anyway. The
+ * job runs in an overlay of the image with its upper layer on a
+ * tmpfs, so whatever it writes stays in memory, and fsync, fdatasync,
+ * sync and syncfs have nothing to write back: package managers and
+ * test frameworks that sync thousands of times no longer hit the
+ * disk. The overlay is also mounted "volatile" where the kernel knows
+ * the option (Linux 5.10), which skips even the sync of the upper
+ * layer.
+ *
+ * Everything is mounted in the job's own mount namespace (see
+ * namespaces_private_mounts), and goes away with it. The tmpfs, of at
+ * most "ephemeral=SIZE" (EPHEMERAL_SIZE by default), is created
+ * detached and then mounted on the image itself, holding the upper
+ * and work directories of the overlay and the directory it is mounted
+ * on, which becomes the root of the job. The image underneath stays
+ * reachable through a descriptor opened before, and the mounts inside
+ * it, like its devices or an output directory, are bound at the same
+ * places in the overlay, which doesn't see them on its own. The overlay
+ * is nosuid and nodev whatever the image's filesystem is mounted with,
+ * so devices created in the image with mknod are bound from it as well.
+ * The owner
+ * controls the base, so everything is reached through descriptors that
+ * were checked, or that the mounts were created with, never through
+ * the path again.
+ */
+
+#ifndef EPHEMERAL_SIZE
+#define EPHEMERAL_SIZE (4ULL * 1024 * 1024 * 1024)
+#endif
+
+#ifdef __linux__
+// From linux/mount.h, which can't be included along with sys/mount.h
+// with every C library.
+#define EPHEMERAL_FSOPEN_CLOEXEC 0x1
+#define EPHEMERAL_FSCONFIG_SET_STRING 1
+#define EPHEMERAL_FSCONFIG_CMD_CREATE 6
+#define EPHEMERAL_FSMOUNT_CLOEXEC 0x1
+#define EPHEMERAL_MOUNT_ATTR_NOSUID 0x2
+#define EPHEMERAL_MOUNT_ATTR_NODEV 0x4
+#define EPHEMERAL_MOVE_MOUNT_F_EMPTY_PATH 0x4
+#define EPHEMERAL_MOVE_MOUNT_T_EMPTY_PATH 0x40
+
+static void tmpfs_config(int fsfd, const char* key, const char* value,
+                         const char* image) {
+  if (syscall(SYS_fsconfig, fsfd, EPHEMERAL_FSCONFIG_SET_STRING, key, value,
+              0) != 0) {
+    fprintf(stderr,"Failed to set %s=%s on the tmpfs of %s: %s. Aborting.\n",
+            key, value, image, strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+}
+
+// Creates the tmpfs of the overlay, detached, and mounts it on
+// 'image_fd'. Returns the descriptor of the mount.
+static int mount_tmpfs(int image_fd, const char* image,
+                       unsigned long long size) {
+#if defined(SYS_fsopen) && defined(SYS_fsconfig) && \
+    defined(SYS_fsmount) && defined(SYS_move_mount)
+  char value[32];
+  int fsfd = syscall(SYS_fsopen, "tmpfs", EPHEMERAL_FSOPEN_CLOEXEC);
+  if (fsfd < 0) {
+    fprintf(stderr,"Failed to create a tmpfs for %s: %s. Aborting.\n",
+            image, strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  snprintf(value, sizeof(value), "%llu", size ? size : EPHEMERAL_SIZE);
+  // so that it can be told apart in mountinfo.
+  tmpfs_config(fsfd, "source", "userchroot-ephemeral", image);
+  tmpfs_config(fsfd, "size", value, image);
+  tmpfs_config(fsfd, "mode", "0755", image);
+  if (syscall(SYS_fsconfig, fsfd, EPHEMERAL_FSCONFIG_CMD_CREATE, NULL, NULL,
+              0) != 0) {
+    fprintf(stderr,"Failed to create a tmpfs for %s: %s. Aborting.\n",
+            image, strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  int fd = syscall(SYS_fsmount, fsfd, EPHEMERAL_FSMOUNT_CLOEXEC,
+                   EPHEMERAL_MOUNT_ATTR_NOSUID | EPHEMERAL_MOUNT_ATTR_NODEV);
+  if (fd < 0 ||
+      syscall(SYS_move_mount, fd, "", image_fd, "",
+              EPHEMERAL_MOVE_MOUNT_F_EMPTY_PATH |
+              EPHEMERAL_MOVE_MOUNT_T_EMPTY_PATH) != 0) {
+    fprintf(stderr,"Failed to mount a tmpfs on %s: %s. Aborting.\n", image,
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  close(fsfd);
+  return fd;
+#else
+  fprintf(stderr,"Ephemeral images need the mount API of Linux 5.2. "
+          "Aborting.\n");
+  exit(ERR_EXIT_CODE);
+#endif
+}
+
+// Opens 'name' in dir_fd, which must be a directory on a filesystem
+// of type 'fstype' other than the one of 'other'.
+static int open_mounted(int dir_fd, const char* name, long fstype,
+                        dev_t other) {
+  struct stat sb;
+  struct statfs sfs;
+  int fd = openat(dir_fd, name, O_PATH | O_DIRECTORY | O_NOFOLLOW |
+                  O_CLOEXEC);
+  if (fd < 0 || fstat(fd, &sb) != 0 || fstatfs(fd, &sfs) != 0 ||
+      sfs.f_type != fstype || sb.st_dev == other) {
+    fprintf(stderr,"%s changed while it was mounted on. Aborting.\n", name);
+    exit(ERR_EXIT_CODE);
+  }
+  return fd;
+}
+
+// Binds every mount found inside the image at the same place in the
+// overlay, outermost first; the binds are recursive, so the mounts
+// inside those come along.
+static void bind_submounts(int image_fd, char** found, int count,
+                           int root_fd) {
+  int i, j;
+  for (i = 0; i < count; i++) {
+    for (j = 0; j < count; j++) {
+      size_t len = strlen(found[j]);
+      if (j != i && strncmp(found[i], found[j], len) == 0 &&
+          found[i][len] == '/') {
+        break;
+      }
+    }
+    if (j < count) {
+      continue;
+    }
+    char source[64];
+    char target[64];
+    int source_fd = namespaces_open_beneath(image_fd, found[i]);
+    int target_fd = namespaces_open_beneath(root_fd, found[i]);
+    if (source_fd < 0 || target_fd < 0) {
+      fprintf(stderr,"Failed to open the mount point %s: %s. Aborting.\n",
+              found[i], strerror(errno));
+      exit(ERR_EXIT_CODE);
+    }
+    snprintf(source, sizeof(source), "/proc/self/fd/%d", source_fd);
+    snprintf(target, sizeof(target), "/proc/self/fd/%d", target_fd);
+    if (mount(source, target, NULL, MS_BIND | MS_REC, NULL) != 0) {
+      fprintf(stderr,"Failed to bind %s into the overlay: %s. Aborting.\n",
+              found[i], strerror(errno));
+      exit(ERR_EXIT_CODE);
+    }
+    close(source_fd);
+    close(target_fd);
+  }
+}
+
+// Binds the devices created in the image by --install-devices, rather
+// than mounted there, at the same places in the overlay, where they
+// would otherwise not work.
+static void bind_devices(int image_fd, int root_fd) {
+  static const char* devices[] = { "dev/null", "dev/zero", "dev/random",
+                                   "dev/urandom" };
+  struct stat imagesb;
+  size_t i;
+  if (fstat(image_fd, &imagesb) != 0) {
+    fprintf(stderr,"Failed to stat the image. Aborting.\n");
+    exit(ERR_EXIT_CODE);
+  }
+  for (i = 0; i < sizeof(devices) / sizeof(devices[0]); i++) {
+    struct stat sb;
+    char source[64];
+    char target[64];
+    if (fstatat(image_fd, devices[i], &sb, AT_SYMLINK_NOFOLLOW) != 0 ||
+        !S_ISCHR(sb.st_mode) || sb.st_dev != imagesb.st_dev) {
+      continue;
+    }
+    int source_fd = namespaces_open_beneath(image_fd, devices[i]);
+    int target_fd = namespaces_open_beneath(root_fd, devices[i]);
+    if (source_fd < 0 || target_fd < 0) {
+      fprintf(stderr,"Failed to open %s: %s. Aborting.\n", devices[i],
+              strerror(errno));
+      exit(ERR_EXIT_CODE);
+    }
+    snprintf(source, sizeof(source), "/proc/self/fd/%d", source_fd);
+    snprintf(target, sizeof(target), "/proc/self/fd/%d", target_fd);
+    if (mount(source, target, NULL, MS_BIND, NULL) != 0) {
+      fprintf(stderr,"Failed to bind %s into the overlay: %s. Aborting.\n",
+              devices[i], strerror(errno));
+      exit(ERR_EXIT_CODE);
+    }
+    close(source_fd);
+    close(target_fd);
+  }
+}
+#endif
+
+// Mounts the ephemeral view of 'image', opened by the caller as
+// image_fd, with a tmpfs of 'size' bytes, or EPHEMERAL_SIZE if 0, and
+// returns the path to chroot to, through a descriptor that stays open.
+// Must run as root, in a private mount namespace.
+char* ephemeral_mount(const char* image, int image_fd,
+                      unsigned long long size) {
+#ifdef __linux__
+  char** found;
+  char image_proc[64];
+  char tmp_proc[64];
+  int i;
+  int count = namespaces_mounts_under(image, &found);
+  snprintf(image_proc, sizeof(image_proc), "/proc/self/fd/%d", image_fd);
+  int tmp_fd = mount_tmpfs(image_fd, image, size);
+  snprintf(tmp_proc, sizeof(tmp_proc), "/proc/self/fd/%d", tmp_fd);
+  if (mkdirat(tmp_fd, "upper", 0755) != 0 ||
+      mkdirat(tmp_fd, "work", 0755) != 0 ||
+      mkdirat(tmp_fd, "root", 0755) != 0) {
+    fprintf(stderr,"Failed to prepare the overlay of %s: %s. Aborting.\n",
+            image, strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+
+  char options[256];
+  char target[80];
+  snprintf(options, sizeof(options),
+           "lowerdir=%s,upperdir=%s/upper,workdir=%s/work,volatile",
+           image_proc, tmp_proc, tmp_proc);
+  snprintf(target, sizeof(target), "%s/root", tmp_proc);
+  // the image's filesystem is typically nosuid and nodev; the overlay
+  // is a filesystem of its own, and must be too.
+  int rc = mount("overlay", target, "overlay", MS_NOSUID | MS_NODEV,
+                 options);
+  if (rc != 0 && errno == EINVAL) {
+    // a kernel without "volatile": the tmpfs alone makes syncs free.
+    options[strlen(options) - strlen(",volatile")] = 0;
+    rc = mount("overlay", target, "overlay", MS_NOSUID | MS_NODEV, options);
+  }
+  if (rc != 0) {
+    fprintf(stderr,"Failed to mount an overlay of %s: %s. Aborting.\n",
+            image, strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  int root_fd = open_mounted(tmp_fd, "root", OVERLAYFS_SUPER_MAGIC, 0);
+
+  bind_submounts(image_fd, found, count, root_fd);
+  bind_devices(image_fd, root_fd);
+  for (i = 0; i < count; i++) {
+    free(found[i]);
+  }
+  free(found);
+  close(tmp_fd);
+  char* root = malloc(64);
+  if (root == NULL) {
+    fprintf(stderr,"Failed to allocate memory. Aborting.\n");
+    exit(ERR_EXIT_CODE);
+  }
+  snprintf(root, 64, "/proc/self/fd/%d", root_fd);
+  return root;
+#else
+  fprintf(stderr,"Ephemeral images are only supported on Linux. "
+          "Aborting.\n");
+  exit(ERR_EXIT_CODE);
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
@@ -1,3 +1,6 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -14,10 +17,14 @@
 
 #ifdef __linux__
 #include <sys/mount.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
 #endif
 
 #include "userchroot.h"
 #include "fundamental_devices.h"
+#include "shm_size.h"
 
 static void create_fundamental_device(const char* chroot_path,
                                      const char* device_path) {
@@ -59,6 +66,20 @@ static void create_fundamental_device(const char* chroot_path,
     fprintf(stderr,"Failed to lofs mount %s.", final_path);
     exit(ERR_EXIT_CODE);
   }
+#elif defined(_USE_BIND_MOUNT_INSTEAD_OF_MKNOD)
+  // devices can't be created inside a user namespace, but the real
+  // ones can be bind mounted over empty files.
+  rc = open(final_path, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW, 0644);
+  if (rc < 0) {
+    fprintf(stderr,"Failed to create %s to mount. Aborting.\n", final_path);
+    exit(ERR_EXIT_CODE);
+  }
+  close(rc);
+  rc = mount(device_path, final_path, NULL, MS_BIND, NULL);
+  if (rc) {
+    fprintf(stderr,"Failed to bind mount %s. Aborting.\n", final_path);
+    exit(ERR_EXIT_CODE);
+  }
 #else
   rc = mknod(final_path, realdev.st_mode, realdev.st_rdev);
   if (rc) {
@@ -97,6 +118,13 @@ static void unlink_fundamental_device(const char* chroot_path,
   }
   rc = rmdir(final_path);
 #else
+#ifdef _USE_BIND_MOUNT_INSTEAD_OF_MKNOD
+  rc = umount(final_path);
+  if (rc) {
+    fprintf(stderr,"Failed to umount %s. Aborting.\n", final_path);
+    exit(ERR_EXIT_CODE);
+  }
+#endif
   rc = unlink(final_path);
   if (rc) {
     fprintf(stderr,"Failed to unlink %s. Aborting.\n", final_path);
@@ -106,25 +134,13 @@ static void unlink_fundamental_device(const char* chroot_path,
   free(final_path);
 }
 
-int create_fundamental_devices(const char* chroot_path) {
-  // we need to let the devices be created with the appropriate
-  // modes. However, since the file will be group-owned by
-  // the user creating the device, we make sure the umask prevent
-  // the user from having any permission granted just by the group.
-  mode_t original_mask = umask(0070);
-  create_fundamental_device(chroot_path,"/dev/null");
-  create_fundamental_device(chroot_path,"/dev/zero");
-  create_fundamental_device(chroot_path,"/dev/random");
-  create_fundamental_device(chroot_path,"/dev/urandom");
-
-  // add a mount for /dev/shm for linux only
 #ifdef __linux__
-    char *fullpath = (char *)
-        malloc(strlen(chroot_path) + strlen("/dev/shm") + 1);
-    sprintf(fullpath, "%s/dev/shm", chroot_path);
-
+// The legacy way: tear down whatever is there, recreate the directory
+// and mount a tmpfs on it.
+static void mount_shm_legacy(const char* fullpath, const char* size) {
     struct stat statbuf;
     mode_t perms = (0777 | S_ISVTX);
+    char options[64];
 
     // clean up from a previous run and set up for this one
     umount2(fullpath, MNT_FORCE);
@@ -156,12 +172,201 @@ int create_fundamental_devices(const char* chroot_path) {
         fprintf(stderr, "Wrong perms on %s.  Aborting.\n", fullpath);
         exit(ERR_EXIT_CODE);
     }
-    if (mount("tmpfs", fullpath, "tmpfs", MS_MGC_VAL, "size=128m") < 0)
+    snprintf(options, sizeof(options), "size=%s", size);
+    if (mount("tmpfs", fullpath, "tmpfs", MS_MGC_VAL, options) < 0)
     {
         fprintf(stderr, "Could not mount %s.  Aborting.\n", fullpath);
         exit(ERR_EXIT_CODE);
     }
-    free(fullpath);
+}
+
+// From linux/mount.h, which can't be included along with sys/mount.h
+// with every C library.
+#define SHM_FSOPEN_CLOEXEC 0x1
+#define SHM_FSCONFIG_SET_STRING 1
+#define SHM_FSCONFIG_CMD_CREATE 6
+#define SHM_FSMOUNT_CLOEXEC 0x1
+#define SHM_MOVE_MOUNT_F_EMPTY_PATH 0x4
+#define SHM_MOVE_MOUNT_T_EMPTY_PATH 0x40
+
+// Whether a call of the mount API failed because the kernel, or a
+// seccomp filter, doesn't allow it, rather than for this image.
+static int shm_unsupported() {
+  return errno == ENOSYS || errno == EPERM;
+}
+
+// Returns -1 if the new API isn't allowed.
+static int shm_config(int fsfd, const char* key, const char* value) {
+  if (syscall(SYS_fsconfig, fsfd, SHM_FSCONFIG_SET_STRING, key, value,
+              0) < 0) {
+    if (shm_unsupported()) {
+      return -1;
+    }
+    fprintf(stderr, "Could not set %s=%s on the /dev/shm tmpfs (%s).  "
+            "Aborting.\n", key, value, strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  return 0;
+}
+
+// Gives the /dev/shm tmpfs opened as shmfd a new size, which only
+// changes what it is given on a remount. A tmpfs already holding more
+// than that keeps its size, with a warning.
+static void shm_resize(int shmfd, const char* devpath, const char* size) {
+  char target[64];
+  char options[64];
+  struct statfs sfs;
+  if (fstatfs(shmfd, &sfs) < 0 || sfs.f_type != TMPFS_MAGIC) {
+    fprintf(stderr, "%s/shm is not a tmpfs.  Aborting.\n", devpath);
+    exit(ERR_EXIT_CODE);
+  }
+  snprintf(target, sizeof(target), "/proc/self/fd/%d", shmfd);
+  snprintf(options, sizeof(options), "size=%s", size);
+  if (mount(NULL, target, NULL, MS_REMOUNT, options) < 0) {
+    fprintf(stderr, "userchroot: could not resize %s/shm to %s (%s).\n",
+            devpath, size, strerror(errno));
+  }
+}
+
+// With the mount API of Linux 5.2, the tmpfs is created and fully
+// configured while detached, and only then attached in one step, so
+// no half-configured /dev/shm is ever visible. An image that already
+// has its /dev/shm keeps it, resized. Returns -1, having changed
+// nothing, if the kernel (or a seccomp filter) doesn't allow any of
+// the calls: all but the last are made before the image is touched,
+// and the directory is only given to root once the tmpfs covers it.
+static int mount_shm_detached(const char* chroot_path, const char* size) {
+#if defined(SYS_fsopen) && defined(SYS_fsconfig) && \
+    defined(SYS_fsmount) && defined(SYS_move_mount)
+  struct stat devstat;
+  struct stat shmstat;
+  mode_t perms = (0777 | S_ISVTX);
+  char *devpath = (char *)malloc(strlen(chroot_path) + strlen("/dev") + 1);
+  sprintf(devpath, "%s/dev", chroot_path);
+
+  int fsfd = syscall(SYS_fsopen, "tmpfs", SHM_FSOPEN_CLOEXEC);
+  if (fsfd < 0) {
+    free(devpath);
+    return -1;
+  }
+  if (shm_config(fsfd, "size", size) < 0 ||
+      shm_config(fsfd, "mode", "1777") < 0 ||
+      shm_config(fsfd, "uid", "0") < 0 ||
+      shm_config(fsfd, "gid", "0") < 0) {
+    close(fsfd);
+    free(devpath);
+    return -1;
+  }
+  if (syscall(SYS_fsconfig, fsfd, SHM_FSCONFIG_CMD_CREATE, NULL, NULL,
+              0) < 0) {
+    if (shm_unsupported()) {
+      close(fsfd);
+      free(devpath);
+      return -1;
+    }
+    fprintf(stderr, "Could not create the /dev/shm tmpfs (%s).  Aborting.\n",
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  int mntfd = syscall(SYS_fsmount, fsfd, SHM_FSMOUNT_CLOEXEC, 0);
+  if (mntfd < 0) {
+    if (shm_unsupported()) {
+      close(fsfd);
+      free(devpath);
+      return -1;
+    }
+    fprintf(stderr, "Could not create the /dev/shm mount (%s).  Aborting.\n",
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  // the image belongs to its owner: nothing on the way is followed.
+  int devfd = open(devpath, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (devfd < 0 || fstat(devfd, &devstat) < 0) {
+    fprintf(stderr, "Could not open %s (%s).  Aborting.\n", devpath,
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  int created = mkdirat(devfd, "shm", perms) == 0;
+  if (!created && errno != EEXIST) {
+    fprintf(stderr, "Could not create %s/shm (%s).  Aborting.\n", devpath,
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  int shmfd = openat(devfd, "shm", O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+                     O_CLOEXEC);
+  if (shmfd < 0 || fstat(shmfd, &shmstat) < 0) {
+    fprintf(stderr, "%s/shm not a directory.  Aborting.\n", devpath);
+    exit(ERR_EXIT_CODE);
+  }
+  if (shmstat.st_dev != devstat.st_dev) {
+    // already mounted, by a previous --install-devices.
+    shm_resize(shmfd, devpath, size);
+    close(shmfd);
+    close(devfd);
+    close(mntfd);
+    close(fsfd);
+    free(devpath);
+    return 0;
+  }
+  // the mount goes on the very directory that was checked above.
+  if (syscall(SYS_move_mount, mntfd, "", shmfd, "",
+              SHM_MOVE_MOUNT_F_EMPTY_PATH | SHM_MOVE_MOUNT_T_EMPTY_PATH) < 0) {
+    if (shm_unsupported()) {
+      close(shmfd);
+      if (created) {
+        unlinkat(devfd, "shm", AT_REMOVEDIR);
+      }
+      close(devfd);
+      close(mntfd);
+      close(fsfd);
+      free(devpath);
+      return -1;
+    }
+    fprintf(stderr, "Could not mount %s/shm (%s).  Aborting.\n", devpath,
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  // what is left under the mount, which shmfd still is, is the same as
+  // with the legacy way.
+  if (fchown(shmfd, 0, 0) < 0 || fchmod(shmfd, perms) < 0) {
+    fprintf(stderr, "Could not chown %s/shm to root.  Aborting.\n", devpath);
+    exit(ERR_EXIT_CODE);
+  }
+  close(mntfd);
+  close(shmfd);
+  close(devfd);
+  close(fsfd);
+  free(devpath);
+  return 0;
+#else
+  return -1;
+#endif
+}
+#endif
+
+int create_fundamental_devices(const char* chroot_path) {
+  // we need to let the devices be created with the appropriate
+  // modes. However, since the file will be group-owned by
+  // the user creating the device, we make sure the umask prevent
+  // the user from having any permission granted just by the group.
+  mode_t original_mask = umask(0070);
+  create_fundamental_device(chroot_path,"/dev/null");
+  create_fundamental_device(chroot_path,"/dev/zero");
+  create_fundamental_device(chroot_path,"/dev/random");
+  create_fundamental_device(chroot_path,"/dev/urandom");
+
+  // add a mount for /dev/shm for linux only
+#ifdef __linux__
+    // sized from what the image used before, see shm_size.c.
+    char size[32];
+    snprintf(size, sizeof(size), "%llum", shm_size_for(chroot_path));
+    if (mount_shm_detached(chroot_path, size) != 0) {
+        char *fullpath = (char *)
+            malloc(strlen(chroot_path) + strlen("/dev/shm") + 1);
+        sprintf(fullpath, "%s/dev/shm", chroot_path);
+        mount_shm_legacy(fullpath, size);
+        free(fullpath);
+    }
 #endif
   umask(original_mask);
   return 0;
@@ -177,6 +382,11 @@ int unlink_fundamental_devices(const char* chroot_path) {
     char *fullpath = (char *)
         malloc(strlen(chroot_path) + strlen("/dev/shm") + 1);
     sprintf(fullpath, "%s/dev/shm", chroot_path);
+    int shmfd = shm_size_open(chroot_path);
+    if (shmfd >= 0) {
+        shm_size_record(chroot_path, shm_size_used(shmfd));
+        close(shmfd);
+    }
     if (umount2(fullpath, MNT_FORCE) < 0)
     {
         fprintf(stderr, "Could not unmount %s (%s).  Aborting.\n",
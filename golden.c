@@ -0,0 +1,430 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/mount.h>
+#include <sys/syscall.h>
+#endif
+
+#include "userchroot.h"
+#include "golden.h"
+
+/*
+ * Golden images: one root-owned tree, kept by root in the directory
+ * given with the "golden=DIR" option of a base, that shows up under
+ * the owner's base as if the owner had a copy of it. The image is an
+ * idmapped mount of DIR/IMAGE on the owner's own, empty, IMAGE
+ * directory, in which root is mapped to the owner, so every check a
+ * launch makes on the image still holds. Every owner sharing a golden
+ * image shares its blocks on disk and its pages in the page cache.
+ *
+ * The mount is read-only, so the owner, who seems to own everything
+ * in it, can't change it. It is also nosuid: a root-owned setuid
+ * binary now looks like the owner's, and must not let the user running
+ * the job become the owner. Only root maps to the owner, anything in
+ * the golden tree owned by someone else shows up as the overflow user.
+ *
+ * The idmapped mount is created detached with open_tree, so nothing
+ * is visible in the base before it is complete, and attached with
+ * move_mount onto the directory that was checked.
+ *
+ * Devices can't live in a read-only tree shared by every owner, so
+ * the image gets a /dev of its own: a small tmpfs owned by the owner,
+ * mounted on the /dev directory the golden tree must have, for
+ * --install-devices to fill like the /dev of any other image. It goes
+ * away with the image when it is uninstalled.
+ *
+ * Uninstalling only detaches an idmapped mount of the golden tree of
+ * the same name, never any other mount the administrator placed on
+ * the owner's directory.
+ */
+
+#ifdef __linux__
+// From linux/mount.h, which can't be included along with sys/mount.h
+// with every C library.
+#define GOLDEN_OPEN_TREE_CLONE 1
+#define GOLDEN_MOVE_MOUNT_F_EMPTY_PATH 0x4
+#define GOLDEN_MOVE_MOUNT_T_EMPTY_PATH 0x40
+#define GOLDEN_MOUNT_ATTR_RDONLY 0x1
+#define GOLDEN_MOUNT_ATTR_NOSUID 0x2
+#define GOLDEN_MOUNT_ATTR_NODEV 0x4
+#define GOLDEN_MOUNT_ATTR_IDMAP 0x00100000
+#define GOLDEN_FSOPEN_CLOEXEC 0x1
+#define GOLDEN_FSCONFIG_SET_STRING 1
+#define GOLDEN_FSCONFIG_CMD_CREATE 6
+#define GOLDEN_FSMOUNT_CLOEXEC 0x1
+
+// the devices themselves take no space, /dev/shm is a mount of its own.
+#define GOLDEN_DEV_SIZE "1m"
+
+struct golden_mount_attr {
+  unsigned long long attr_set;
+  unsigned long long attr_clr;
+  unsigned long long propagation;
+  unsigned long long userns_fd;
+};
+
+static void write_map(pid_t pid, const char* file, unsigned int id) {
+  char path[64];
+  char map[64];
+  snprintf(path, sizeof(path), "/proc/%d/%s", (int)pid, file);
+  snprintf(map, sizeof(map), "0 %u 1\n", id);
+  int fd = open(path, O_WRONLY | O_CLOEXEC);
+  if (fd < 0 || write(fd, map, strlen(map)) != (ssize_t)strlen(map)) {
+    fprintf(stderr,"Failed to write %s: %s. Aborting.\n", path,
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  close(fd);
+}
+
+// Returns a descriptor for a user namespace in which root is 'uid'
+// and 'gid' outside, which is how an idmapped mount is described. A
+// child holds the namespace just long enough to open it.
+static int idmap_userns(uid_t uid, gid_t gid) {
+  int ready[2];
+  int done[2];
+  char c = 0;
+  if (pipe(ready) != 0 || pipe(done) != 0) {
+    fprintf(stderr,"Failed to create pipe: %s. Aborting.\n", strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  pid_t child = fork();
+  if (child < 0) {
+    fprintf(stderr,"Failed to fork: %s. Aborting.\n", strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  if (child == 0) {
+    close(ready[0]);
+    close(done[1]);
+    if (unshare(CLONE_NEWUSER) != 0 || write(ready[1], &c, 1) != 1) {
+      _exit(ERR_EXIT_CODE);
+    }
+    // until the parent is done with us.
+    while (read(done[0], &c, 1) < 0 && errno == EINTR) {
+    }
+    _exit(0);
+  }
+  close(ready[1]);
+  close(done[0]);
+  if (read(ready[0], &c, 1) != 1) {
+    fprintf(stderr,"Failed to create a user namespace. Aborting.\n");
+    exit(ERR_EXIT_CODE);
+  }
+  close(ready[0]);
+  write_map(child, "uid_map", uid);
+  write_map(child, "gid_map", gid);
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/ns/user", (int)child);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr,"Failed to open %s: %s. Aborting.\n", path,
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  close(done[1]);
+  waitpid(child, NULL, 0);
+  return fd;
+}
+
+// Opens DIR/IMAGE as root, returning the name of the golden image in
+// 'source' for messages. The whole path to it must be root's, the same
+// way the path to a base must be.
+static int open_golden(const char* golden, const char* image,
+                       char** source) {
+  struct stat sb;
+  *source = malloc(strlen(golden) + strlen(image) + 2);
+  if (*source == NULL) {
+    fprintf(stderr,"Failed to allocate memory. Aborting.\n");
+    exit(ERR_EXIT_CODE);
+  }
+  sprintf(*source, "%s/%s", golden, image);
+  if (golden[0] != '/' || !whitelisted_path(golden, 1)) {
+    fprintf(stderr,"Invalid golden image directory %s. Aborting.\n", golden);
+    exit(ERR_EXIT_CODE);
+  }
+  check_base_path(*source);
+  int fd = open(*source, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0 || fstat(fd, &sb) != 0) {
+    fprintf(stderr,"There is no golden image %s. Aborting.\n", *source);
+    exit(ERR_EXIT_CODE);
+  }
+  if (sb.st_uid != 0) {
+    fprintf(stderr,"Golden image %s should be owned by root. Aborting.\n",
+            *source);
+    exit(ERR_EXIT_CODE);
+  }
+  if (sb.st_mode & 00022) {
+    fprintf(stderr,"Golden image %s has non-restrictive permissions. "
+            "Aborting.\n", *source);
+    exit(ERR_EXIT_CODE);
+  }
+  return fd;
+}
+
+static void dev_config(int fsfd, const char* key, const char* value) {
+  if (syscall(SYS_fsconfig, fsfd, GOLDEN_FSCONFIG_SET_STRING, key, value,
+              0) != 0) {
+    fprintf(stderr,"Failed to set %s=%s on the /dev tmpfs: %s. Aborting.\n",
+            key, value, strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+}
+
+// Mounts the /dev tmpfs of a golden image on 'dev_fd', its /dev
+// directory in the installed mount, created detached like the image.
+static void mount_dev(int dev_fd, const char* source, uid_t owner,
+                      gid_t group) {
+  char id[32];
+  int fsfd = syscall(SYS_fsopen, "tmpfs", GOLDEN_FSOPEN_CLOEXEC);
+  if (fsfd < 0) {
+    fprintf(stderr,"Failed to create the /dev of %s: %s. Aborting.\n",
+            source, strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  dev_config(fsfd, "size", GOLDEN_DEV_SIZE);
+  dev_config(fsfd, "mode", "0755");
+  snprintf(id, sizeof(id), "%u", (unsigned int)owner);
+  dev_config(fsfd, "uid", id);
+  snprintf(id, sizeof(id), "%u", (unsigned int)group);
+  dev_config(fsfd, "gid", id);
+  if (syscall(SYS_fsconfig, fsfd, GOLDEN_FSCONFIG_CMD_CREATE, NULL, NULL,
+              0) != 0) {
+    fprintf(stderr,"Failed to create the /dev of %s: %s. Aborting.\n",
+            source, strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  // not nodev, which is the whole point.
+  int mntfd = syscall(SYS_fsmount, fsfd, GOLDEN_FSMOUNT_CLOEXEC,
+                      GOLDEN_MOUNT_ATTR_NOSUID);
+  if (mntfd < 0 ||
+      syscall(SYS_move_mount, mntfd, "", dev_fd, "",
+              GOLDEN_MOVE_MOUNT_F_EMPTY_PATH |
+              GOLDEN_MOVE_MOUNT_T_EMPTY_PATH) != 0) {
+    fprintf(stderr,"Failed to mount the /dev of %s: %s. Aborting.\n",
+            source, strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  close(mntfd);
+  close(fsfd);
+}
+
+#ifndef STATX_ATTR_MOUNT_ROOT
+#define STATX_ATTR_MOUNT_ROOT 0x2000
+#endif
+
+// Whether 'fd' is the root of a mount. Golden images are often on the
+// same filesystem as the base, so the device doesn't tell; only
+// kernels older than 5.8 don't say, and there it has to do.
+static int is_mount_root(int fd, dev_t base_dev) {
+  struct statx stx;
+  if (statx(fd, "", AT_EMPTY_PATH, STATX_BASIC_STATS, &stx) == 0 &&
+      (stx.stx_attributes_mask & STATX_ATTR_MOUNT_ROOT)) {
+    return (stx.stx_attributes & STATX_ATTR_MOUNT_ROOT) != 0;
+  }
+  struct stat sb;
+  return fstat(fd, &sb) == 0 && sb.st_dev != base_dev;
+}
+
+// Returns non-zero if the mount 'fd' is the root of is idmapped, as
+// /proc/self/mountinfo tells, through the mount ID in its fdinfo.
+static int is_idmapped(int fd) {
+  char path[64];
+  char line[4096];
+  char options[4096];
+  int mnt_id = -1;
+  int id;
+  int idmapped = 0;
+  snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", fd);
+  FILE* f = fopen(path, "re");
+  if (f == NULL) {
+    return 0;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, "mnt_id: %d", &id) == 1) {
+      mnt_id = id;
+    }
+  }
+  fclose(f);
+  f = fopen("/proc/self/mountinfo", "re");
+  if (f == NULL || mnt_id < 0) {
+    if (f != NULL) {
+      fclose(f);
+    }
+    return 0;
+  }
+  // ID PARENT MAJOR:MINOR ROOT MOUNT-POINT OPTIONS ...
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, "%d %*d %*s %*s %*s %4095s", &id, options) == 2 &&
+        id == mnt_id) {
+      char* option;
+      char* saveptr = NULL;
+      for (option = strtok_r(options, ",", &saveptr); option != NULL;
+           option = strtok_r(NULL, ",", &saveptr)) {
+        if (strcmp(option, "idmapped") == 0) {
+          idmapped = 1;
+        }
+      }
+    }
+  }
+  fclose(f);
+  return idmapped;
+}
+
+// Opens the owner's IMAGE directory in 'base', refusing anything but
+// a plain directory unless 'mounted' is set, and anything but a mount
+// when it is.
+static int open_image(const char* base, const char* image, int mounted,
+                      int flags) {
+  struct stat basesb;
+  int base_fd = open(base, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (base_fd < 0 || fstat(base_fd, &basesb) != 0) {
+    fprintf(stderr,"Failed to open %s: %s. Aborting.\n", base,
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  int fd = openat(base_fd, image, flags | O_DIRECTORY | O_NOFOLLOW |
+                  O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr,"Failed to open %s/%s: %s. Aborting.\n", base, image,
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  close(base_fd);
+  int mount_root = is_mount_root(fd, basesb.st_dev);
+  if (mounted && !mount_root) {
+    fprintf(stderr,"%s/%s is not a golden image. Aborting.\n", base, image);
+    exit(ERR_EXIT_CODE);
+  }
+  if (!mounted && mount_root) {
+    fprintf(stderr,"%s/%s already has something mounted. Aborting.\n", base,
+            image);
+    exit(ERR_EXIT_CODE);
+  }
+  return fd;
+}
+#endif
+
+int golden_install(const char* base, const char* image, const char* golden,
+                   uid_t owner, gid_t group) {
+#if defined(__linux__) && defined(SYS_open_tree) && \
+    defined(SYS_mount_setattr) && defined(SYS_move_mount) && \
+    defined(SYS_fsopen) && defined(SYS_fsconfig) && defined(SYS_fsmount)
+  char* source;
+  struct stat devsb;
+  int golden_fd = open_golden(golden, image, &source);
+  if (fstatat(golden_fd, "dev", &devsb, AT_SYMLINK_NOFOLLOW) != 0 ||
+      !S_ISDIR(devsb.st_mode)) {
+    fprintf(stderr,"Golden image %s has no /dev directory. Aborting.\n",
+            source);
+    exit(ERR_EXIT_CODE);
+  }
+  int image_fd = open_image(base, image, 0, O_RDONLY);
+  int tree_fd = syscall(SYS_open_tree, golden_fd, "",
+                        GOLDEN_OPEN_TREE_CLONE | O_CLOEXEC | AT_EMPTY_PATH);
+  if (tree_fd < 0) {
+    fprintf(stderr,"Failed to clone %s: %s. Aborting.\n", source,
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  struct golden_mount_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.attr_set = GOLDEN_MOUNT_ATTR_IDMAP | GOLDEN_MOUNT_ATTR_RDONLY |
+    GOLDEN_MOUNT_ATTR_NOSUID | GOLDEN_MOUNT_ATTR_NODEV;
+  attr.userns_fd = idmap_userns(owner, group);
+  if (syscall(SYS_mount_setattr, tree_fd, "", AT_EMPTY_PATH, &attr,
+              sizeof(attr)) != 0) {
+    fprintf(stderr,"Failed to map %s to the owner: %s. Aborting.\n", source,
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  if (syscall(SYS_move_mount, tree_fd, "", image_fd, "",
+              GOLDEN_MOVE_MOUNT_F_EMPTY_PATH |
+              GOLDEN_MOVE_MOUNT_T_EMPTY_PATH) != 0) {
+    fprintf(stderr,"Failed to mount %s on %s/%s: %s. Aborting.\n", source,
+            base, image, strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  int dev_fd = openat(tree_fd, "dev", O_PATH | O_DIRECTORY | O_NOFOLLOW |
+                      O_CLOEXEC);
+  if (dev_fd < 0) {
+    fprintf(stderr,"Failed to open the /dev of %s: %s. Aborting.\n", source,
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  mount_dev(dev_fd, source, owner, group);
+  close(dev_fd);
+  close((int)attr.userns_fd);
+  close(tree_fd);
+  close(image_fd);
+  close(golden_fd);
+  free(source);
+  return 0;
+#else
+  fprintf(stderr,"Golden images are not supported on this system. "
+          "Aborting.\n");
+  exit(ERR_EXIT_CODE);
+#endif
+}
+
+int golden_uninstall(const char* base, const char* image,
+                     const char* golden) {
+#ifdef __linux__
+  char path[64];
+  char* source;
+  struct stat goldensb;
+  struct stat sb;
+  int golden_fd = open_golden(golden, image, &source);
+  int fd = open_image(base, image, 1, O_PATH);
+  // the golden tree itself, not any mount on the owner's directory.
+  if (fstat(golden_fd, &goldensb) != 0 || fstat(fd, &sb) != 0 ||
+      sb.st_dev != goldensb.st_dev || sb.st_ino != goldensb.st_ino ||
+      !is_idmapped(fd)) {
+    fprintf(stderr,"%s/%s is not a golden image. Aborting.\n", base, image);
+    exit(ERR_EXIT_CODE);
+  }
+  close(golden_fd);
+  free(source);
+  // running jobs keep the image until they are done with it.
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+  if (umount2(path, MNT_DETACH) != 0) {
+    fprintf(stderr,"Failed to unmount %s/%s: %s. Aborting.\n", base, image,
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  close(fd);
+  return 0;
+#else
+  fprintf(stderr,"Golden images are not supported on this system. "
+          "Aborting.\n");
+  exit(ERR_EXIT_CODE);
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
@@ -0,0 +1,132 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "userchroot.h"
+#include "jobserver.h"
+#include "passfd.h"
+
+/*
+ * A single GNU make jobserver for the whole host. Every build sizing
+ * its own -j to the host means several builds at once oversubscribe
+ * the CPUs several times over; with --jobserver, every make launched
+ * through userchroot instead takes its tokens from one pool.
+ *
+ * The pool is a named FIFO owned by root, which root fills with one
+ * token per job slot and keeps open (see userchroot-jobserver.sh), as
+ * a FIFO's contents only live as long as someone holds it open. The
+ * FIFO doesn't need to be visible in the image: userchroot opens it
+ * before the chroot and the command inherits the descriptor, which is
+ * announced in MAKEFLAGS the way a parent make announces its own
+ * jobserver, with --jobserver-auth=FD,FD (GNU make 4.2 and later).
+ */
+
+#ifndef JOBSERVER_FIFO
+#define JOBSERVER_FIFO "/run/userchroot-jobserver"
+#endif
+
+#define JOBSERVER_AUTH "--jobserver-auth="
+
+static int jobserver_fd = -1;
+
+// Opens the host's jobserver. The descriptor is left open across exec,
+// above any number a directory is passed as, so that it doesn't need
+// to be put in place in every process that executes the command.
+void jobserver_open() {
+  struct stat sb;
+  check_base_path(JOBSERVER_FIFO);
+  int fd = open(JOBSERVER_FIFO, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr,"Failed to open the jobserver %s: %s. Aborting.\n",
+            JOBSERVER_FIFO, strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  if (fstat(fd, &sb) != 0 || !S_ISFIFO(sb.st_mode) || sb.st_uid != 0 ||
+      (sb.st_mode & 00022)) {
+    fprintf(stderr,"The jobserver %s should be a FIFO owned and only "
+            "writable by root. Aborting.\n", JOBSERVER_FIFO);
+    exit(ERR_EXIT_CODE);
+  }
+  jobserver_fd = fcntl(fd, F_DUPFD, passfd_highest() + 1);
+  if (jobserver_fd < 0) {
+    fprintf(stderr,"Failed to move descriptor: %s. Aborting.\n",
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  close(fd);
+}
+
+// Returns a copy of the environment in which MAKEFLAGS announces the
+// jobserver, in place of any jobserver or -j it already had.
+char** jobserver_environment(char* envp[]) {
+  int count = 0;
+  int i;
+  const char* makeflags = "";
+  while (envp[count] != NULL) {
+    if (strncmp(envp[count], "MAKEFLAGS=", 10) == 0) {
+      makeflags = envp[count] + 10;
+    }
+    count++;
+  }
+  char** env = malloc((count + 2) * sizeof(char*));
+  char* flags = malloc(strlen(makeflags) + strlen(JOBSERVER_AUTH) + 40);
+  if (env == NULL || flags == NULL) {
+    fprintf(stderr,"Failed to allocate memory. Aborting.\n");
+    exit(ERR_EXIT_CODE);
+  }
+
+  // MAKEFLAGS is a list of words; a -j or another jobserver would
+  // take precedence over ours.
+  char* copy = strdup(makeflags);
+  char* saveptr = NULL;
+  char* word;
+  if (copy == NULL) {
+    fprintf(stderr,"Failed to allocate memory. Aborting.\n");
+    exit(ERR_EXIT_CODE);
+  }
+  strcpy(flags, "MAKEFLAGS=");
+  for (word = strtok_r(copy, " ", &saveptr); word != NULL;
+       word = strtok_r(NULL, " ", &saveptr)) {
+    if (strncmp(word, "-j", 2) == 0 ||
+        strncmp(word, "--jobs", 6) == 0 ||
+        strncmp(word, "--jobserver-", 12) == 0) {
+      continue;
+    }
+    strcat(flags, word);
+    strcat(flags, " ");
+  }
+  free(copy);
+  sprintf(flags + strlen(flags), "%s%d,%d", JOBSERVER_AUTH, jobserver_fd,
+          jobserver_fd);
+
+  int n = 0;
+  for (i = 0; i < count; i++) {
+    if (strncmp(envp[i], "MAKEFLAGS=", 10) != 0) {
+      env[n++] = envp[i];
+    }
+  }
+  env[n++] = flags;
+  env[n] = NULL;
+  return env;
+}
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
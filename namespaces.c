@@ -0,0 +1,220 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mount.h>
+#include <net/if.h>
+#endif
+
+#include "userchroot.h"
+#include "config.h"
+#include "namespaces.h"
+
+/*
+ * Per-image namespaces, so that jobs which would otherwise fight over
+ * fixed TCP ports, SysV IPC keys or the hostname can run side by side
+ * in the same image. They are entered as root, just before the
+ * chroot; the job can't change anything about them afterwards.
+ *
+ * A new network namespace only has a loopback interface, which is
+ * brought up here so that tests can still talk to themselves. A new
+ * UTS namespace gets a hostname of its own, userchroot-PID, since the
+ * job can't set one once it runs as its owner.
+ */
+
+#ifdef __linux__
+static void loopback_up() {
+  struct ifreq ifr;
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    fprintf(stderr,"Failed to create socket: %s. Aborting.\n",
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, "lo", IFNAMSIZ - 1);
+  if (ioctl(fd, SIOCGIFFLAGS, &ifr) != 0) {
+    fprintf(stderr,"Failed to get loopback flags: %s. Aborting.\n",
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
+  if (ioctl(fd, SIOCSIFFLAGS, &ifr) != 0) {
+    fprintf(stderr,"Failed to bring up loopback: %s. Aborting.\n",
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  close(fd);
+}
+#endif
+
+#ifdef __linux__
+// Decodes the octal escapes of a path in /proc/self/mountinfo.
+static void unescape(char* s) {
+  char* out = s;
+  while (*s) {
+    if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' &&
+        s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+      *out++ = (s[1] - '0') * 64 + (s[2] - '0') * 8 + (s[3] - '0');
+      s += 4;
+    } else {
+      *out++ = *s++;
+    }
+  }
+  *out = 0;
+}
+
+// Returns the number of mount points below the directory 'dir',
+// storing newly allocated copies of their paths relative to it in
+// 'found', in the order of /proc/self/mountinfo.
+int namespaces_mounts_under(const char* dir, char*** found) {
+  FILE* mountinfo = fopen("/proc/self/mountinfo", "r");
+  char* line = NULL;
+  size_t linecap = 0;
+  int count = 0;
+  int i;
+  size_t prefixlen = strlen(dir) + 1;
+  char* prefix = malloc(prefixlen + 1);
+  *found = NULL;
+  if (mountinfo == NULL || prefix == NULL) {
+    free(prefix);
+    if (mountinfo != NULL) {
+      fclose(mountinfo);
+    }
+    return 0;
+  }
+  snprintf(prefix, prefixlen + 1, "%s/", dir);
+  while (getline(&line, &linecap, mountinfo) > 0) {
+    // the mount point is the fifth field.
+    char* saveptr = NULL;
+    char* field = strtok_r(line, " ", &saveptr);
+    for (i = 1; field != NULL && i < 5; i++) {
+      field = strtok_r(NULL, " ", &saveptr);
+    }
+    if (field == NULL) {
+      continue;
+    }
+    unescape(field);
+    if (strncmp(field, prefix, prefixlen) != 0) {
+      continue;
+    }
+    *found = realloc(*found, (count + 1) * sizeof(char*));
+    if (*found == NULL ||
+        ((*found)[count] = strdup(field + prefixlen)) == NULL) {
+      fprintf(stderr,"Failed to allocate memory. Aborting.\n");
+      exit(ERR_EXIT_CODE);
+    }
+    count++;
+  }
+  free(line);
+  fclose(mountinfo);
+  free(prefix);
+  return count;
+}
+
+// Opens 'relative' below dir_fd with O_PATH, one component at a time
+// and without following links, for directories someone else
+// controls. Returns -1 if anything on the way is missing or a link.
+int namespaces_open_beneath(int dir_fd, const char* relative) {
+  char* copy = strdup(relative);
+  char* saveptr = NULL;
+  char* component;
+  if (copy == NULL) {
+    fprintf(stderr,"Failed to allocate memory. Aborting.\n");
+    exit(ERR_EXIT_CODE);
+  }
+  int fd = dup(dir_fd);
+  for (component = strtok_r(copy, "/", &saveptr);
+       fd >= 0 && component != NULL;
+       component = strtok_r(NULL, "/", &saveptr)) {
+    int next = openat(fd, component, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+    close(fd);
+    fd = next;
+  }
+  free(copy);
+  return fd;
+}
+#endif
+
+// Moves to a mount namespace of our own, for mounts only the job
+// should see. Must run as root, before opening anything that will be
+// mounted on through a descriptor: a descriptor opened in the
+// previous namespace can't be mounted on.
+void namespaces_private_mounts() {
+#ifdef __linux__
+  if (unshare(CLONE_NEWNS) != 0 ||
+      mount(NULL, "/", NULL, MS_REC | MS_SLAVE, NULL) != 0) {
+    fprintf(stderr,"Failed to create a mount namespace: %s. Aborting.\n",
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+#else
+  fprintf(stderr,"Private mounts are only supported on Linux. Aborting.\n");
+  exit(ERR_EXIT_CODE);
+#endif
+}
+
+void namespaces_enter(int namespaces) {
+  if (namespaces == 0) {
+    return;
+  }
+#ifdef __linux__
+  int flags = 0;
+  if (namespaces & IMAGE_NEWNET) {
+    flags |= CLONE_NEWNET;
+  }
+  if (namespaces & IMAGE_NEWIPC) {
+    flags |= CLONE_NEWIPC;
+  }
+  if (namespaces & IMAGE_NEWUTS) {
+    flags |= CLONE_NEWUTS;
+  }
+  if (unshare(flags) != 0) {
+    fprintf(stderr,"Failed to create namespaces: %s. Aborting.\n",
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  if (namespaces & IMAGE_NEWNET) {
+    loopback_up();
+  }
+  if (namespaces & IMAGE_NEWUTS) {
+    char hostname[64];
+    snprintf(hostname, sizeof(hostname), "userchroot-%d", (int)getpid());
+    if (sethostname(hostname, strlen(hostname)) != 0) {
+      fprintf(stderr,"Failed to set the hostname: %s. Aborting.\n",
+              strerror(errno));
+      exit(ERR_EXIT_CODE);
+    }
+  }
+#else
+  fprintf(stderr,"Namespaces are only supported on Linux. Aborting.\n");
+  exit(ERR_EXIT_CODE);
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
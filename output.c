@@ -0,0 +1,157 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <sys/mount.h>
+#endif
+
+#include "userchroot.h"
+#include "output.h"
+#include "tree.h"
+
+/*
+ * Output directories on a tmpfs. The job sees a fresh tmpfs on a
+ * directory of the image, so whatever it writes there stays in
+ * memory. Once it exits successfully, the paths it declared as
+ * results are copied back to the directory underneath, and the rest
+ * is thrown away.
+ *
+ * The tmpfs is mounted in a mount namespace of its own (see
+ * namespaces_private_mounts), so no other process ever sees it, and
+ * it goes away with the namespace when the last process of the job
+ * exits. The directory underneath stays reachable through a
+ * descriptor opened before the mount.
+ */
+
+#define OUTPUT_THREADS_MAX 8
+
+static int valid_relative_path(const char* path) {
+  const char* p = path;
+  if (*path == 0 || *path == '/' || !whitelisted_path(path, 1)) {
+    return 0;
+  }
+  while (*p) {
+    const char* end = strchr(p, '/');
+    size_t len = end ? (size_t)(end - p) : strlen(p);
+    if (len == 0 || (len == 1 && p[0] == '.') ||
+        (len == 2 && p[0] == '.' && p[1] == '.')) {
+      return 0;
+    }
+    p += len + (end != NULL);
+  }
+  return 1;
+}
+
+// Opens the output directory 'dir', an absolute path inside the
+// image, and makes sure it belongs to 'owner'; 'what' names it in
+// messages, as workspaces are mounted on directories opened the same
+// way. This must run with the caller's permissions: whatever the path
+// resolves to, the caller could already write there.
+int output_open(const char* image, const char* dir, uid_t owner,
+                const char* what) {
+  struct stat sb;
+  if (dir[0] != '/' || !valid_relative_path(dir + 1)) {
+    fprintf(stderr,"Invalid %s %s. Aborting.\n", what, dir);
+    exit(ERR_EXIT_CODE);
+  }
+  char* path = malloc(strlen(image) + strlen(dir) + 1);
+  if (path == NULL) {
+    fprintf(stderr,"Failed to allocate memory. Aborting.\n");
+    exit(ERR_EXIT_CODE);
+  }
+  sprintf(path, "%s%s", image, dir);
+  int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+  if (fd < 0) {
+    fprintf(stderr,"Failed to open %s %s: %s. Aborting.\n", what,
+            path, strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  if (fstat(fd, &sb) != 0 || sb.st_uid != owner) {
+    fprintf(stderr,"The %s %s should be owned by the caller. "
+            "Aborting.\n", what, path);
+    exit(ERR_EXIT_CODE);
+  }
+  if (fcntl(fd, F_SETFD, FD_CLOEXEC) != 0) {
+    fprintf(stderr,"Failed to set close-on-exec on the %s. Aborting.\n",
+            what);
+    exit(ERR_EXIT_CODE);
+  }
+  free(path);
+  return fd;
+}
+
+// Mounts a tmpfs of at most 'size' (any size tmpfs accepts, or NULL
+// for the default) owned by uid and gid over the directory opened by
+// output_open. Must run as root, before the chroot.
+void output_mount(int dir_fd, const char* size, uid_t uid, gid_t gid) {
+#ifdef __linux__
+  char target[64];
+  char options[256];
+  if (size != NULL && !whitelisted_path(size, 0)) {
+    fprintf(stderr,"Invalid output size %s. Aborting.\n", size);
+    exit(ERR_EXIT_CODE);
+  }
+  snprintf(options, sizeof(options), "mode=0700,uid=%d,gid=%d%s%s",
+           (int)uid, (int)gid, size ? ",size=" : "", size ? size : "");
+  // mounting through the descriptor leaves no room for the path to
+  // change between the checks and the mount.
+  snprintf(target, sizeof(target), "/proc/self/fd/%d", dir_fd);
+  if (mount("userchroot-output", target, "tmpfs", MS_NOSUID | MS_NODEV,
+            options) != 0) {
+    fprintf(stderr,"Failed to mount the output tmpfs: %s. Aborting.\n",
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+#endif
+}
+
+// Copies the 'keep' paths, relative to the output directory 'dir',
+// from the tmpfs mounted there to the directory underneath it, which
+// dir_fd still refers to. Returns 0 on success.
+int output_write_back(const char* dir, int dir_fd, char* keep[], int nkeep) {
+  int rc = 0;
+  int i;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads < 1) {
+    threads = 1;
+  } else if (threads > OUTPUT_THREADS_MAX) {
+    threads = OUTPUT_THREADS_MAX;
+  }
+  int tmpfs_fd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (tmpfs_fd < 0) {
+    fprintf(stderr,"Failed to open %s: %s.\n", dir, strerror(errno));
+    return -1;
+  }
+  for (i = 0; i < nkeep && rc == 0; i++) {
+    rc = tree_copy(tmpfs_fd, dir_fd, keep[i], threads);
+  }
+  close(tmpfs_fd);
+  return rc;
+}
+
+// Validates a path given with --keep.
+int output_valid_keep(const char* path) {
+  return valid_relative_path(path);
+}
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
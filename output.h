@@ -0,0 +1,23 @@
+#include <sys/types.h>
+
+int output_open(const char* image, const char* dir, uid_t owner,
+                const char* what);
+void output_mount(int dir_fd, const char* size, uid_t uid, gid_t gid);
+int output_write_back(const char* dir, int dir_fd, char* keep[], int nkeep);
+int output_valid_keep(const char* path);
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
@@ -0,0 +1,130 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "userchroot.h"
+#include "passfd.h"
+
+/*
+ * Host directories handed to the command as open descriptors, given
+ * as --pass-dir=HOSTPATH:FD. The directories are opened with the
+ * caller's own permissions before the chroot, so the command can only
+ * reach what the caller could already reach, and they are put at the
+ * requested numbers only in the process about to execute the command,
+ * so they never clash with userchroot's own descriptors.
+ */
+
+#define PASSFD_MAX 64
+
+struct passed_dir {
+  const char* path;
+  int target;
+  int fd;
+};
+
+static struct passed_dir passed[PASSFD_MAX];
+static int npassed = 0;
+
+// Records a HOSTPATH:FD specification. Returns 0 if it is valid.
+int passfd_parse(char* spec) {
+  char* colon = strrchr(spec, ':');
+  char* end;
+  int i;
+  if (colon == NULL || colon == spec || npassed == PASSFD_MAX) {
+    return -1;
+  }
+  long target = strtol(colon + 1, &end, 10);
+  if (colon[1] == 0 || *end != 0 || target < 3 ||
+      target >= getdtablesize()) {
+    return -1;
+  }
+  for (i = 0; i < npassed; i++) {
+    if (passed[i].target == target) {
+      return -1;
+    }
+  }
+  *colon = 0;
+  passed[npassed].path = spec;
+  passed[npassed].target = target;
+  passed[npassed].fd = -1;
+  npassed++;
+  return 0;
+}
+
+// Opens the recorded directories. Must run with the caller's
+// permissions.
+void passfd_open() {
+  int i;
+  for (i = 0; i < npassed; i++) {
+    passed[i].fd = open(passed[i].path,
+                        O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (passed[i].fd < 0) {
+      fprintf(stderr,"Failed to open %s: %s. Aborting.\n", passed[i].path,
+              strerror(errno));
+      exit(ERR_EXIT_CODE);
+    }
+  }
+}
+
+// Returns the highest descriptor number a directory will be passed
+// as, or 2 if there are none.
+int passfd_highest() {
+  int highest = 2;
+  int i;
+  for (i = 0; i < npassed; i++) {
+    if (passed[i].target > highest) {
+      highest = passed[i].target;
+    }
+  }
+  return highest;
+}
+
+// Puts the directories at their requested numbers, open across exec.
+// Only for the process about to execute the command.
+void passfd_install() {
+  int highest = passfd_highest();
+  int i;
+  // first out of the way of every target, then into place.
+  for (i = 0; i < npassed; i++) {
+    if (passed[i].fd <= highest) {
+      int fd = fcntl(passed[i].fd, F_DUPFD_CLOEXEC, highest + 1);
+      if (fd < 0) {
+        fprintf(stderr,"Failed to move descriptor: %s. Aborting.\n",
+                strerror(errno));
+        _exit(ERR_EXIT_CODE);
+      }
+      close(passed[i].fd);
+      passed[i].fd = fd;
+    }
+  }
+  for (i = 0; i < npassed; i++) {
+    if (dup2(passed[i].fd, passed[i].target) < 0) {
+      fprintf(stderr,"Failed to pass %s as descriptor %d: %s. Aborting.\n",
+              passed[i].path, passed[i].target, strerror(errno));
+      _exit(ERR_EXIT_CODE);
+    }
+    close(passed[i].fd);
+    passed[i].fd = passed[i].target;
+  }
+}
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
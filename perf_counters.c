@@ -0,0 +1,136 @@
+#include <sys/types.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "perf_counters.h"
+
+/*
+ * Hardware and software counters for a supervised job.
+ *
+ * The counters are opened on the supervising process itself, with
+ * inheritance enabled, right before it forks the job. Every process
+ * in the job's tree inherits them, and the kernel folds the counts of
+ * each child into ours as it exits. Once the job has been reaped,
+ * reading our own counters gives the totals for the whole tree.
+ *
+ * Opening the counters on ourselves instead of on the child pid means
+ * we don't need ptrace access to the child, which we wouldn't have
+ * anyway, since a process that just dropped its setuid privileges is
+ * not dumpable.
+ *
+ * Any counter the kernel refuses to open (perf_event_paranoid, no
+ * PMU in a virtual machine, or no perf support at all) is reported
+ * as unavailable and doesn't affect the job.
+ */
+
+#ifdef __linux__
+
+struct perf_counter {
+  const char* name;
+  __u32 type;
+  __u64 config;
+  int needs_kernel;  // meaningless when restricted to user space
+  int fd;
+  int user_only;
+};
+
+static struct perf_counter counters[] = {
+  { "cycles",           PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,       0, -1, 0 },
+  { "instructions",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,     0, -1, 0 },
+  { "cache-misses",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES,     0, -1, 0 },
+  { "branch-misses",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES,    0, -1, 0 },
+  { "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, 1, -1, 0 },
+  { "page-faults",      PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS,      0, -1, 0 },
+};
+#define NUM_COUNTERS (sizeof(counters) / sizeof(counters[0]))
+
+static int open_counter(struct perf_counter* counter, int exclude_kernel) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = counter->type;
+  attr.config = counter->config;
+  attr.inherit = 1;
+  attr.exclude_kernel = exclude_kernel;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                     PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+                 PERF_FLAG_FD_CLOEXEC);
+}
+
+int perf_counters_open() {
+  unsigned int i;
+  int opened = 0;
+  for (i = 0; i < NUM_COUNTERS; i++) {
+    counters[i].fd = open_counter(&counters[i], 0);
+    if (counters[i].fd < 0 && !counters[i].needs_kernel &&
+        (errno == EACCES || errno == EPERM)) {
+      // perf_event_paranoid >= 2 still allows user-space only counts.
+      counters[i].fd = open_counter(&counters[i], 1);
+      counters[i].user_only = 1;
+    }
+    if (counters[i].fd >= 0) {
+      opened++;
+    }
+  }
+  return opened;
+}
+
+void perf_counters_report(FILE* out) {
+  unsigned int i;
+  for (i = 0; i < NUM_COUNTERS; i++) {
+    __u64 values[3]; // value, time enabled, time running
+    if (counters[i].fd < 0) {
+      fprintf(out, "userchroot:   %-17s n/a\n", counters[i].name);
+      continue;
+    }
+    if (read(counters[i].fd, values, sizeof(values)) != sizeof(values)) {
+      fprintf(out, "userchroot:   %-17s n/a\n", counters[i].name);
+    } else {
+      // scale up if the counter was multiplexed with others.
+      double value = values[0];
+      if (values[2] != 0 && values[2] < values[1]) {
+        value = value * values[1] / values[2];
+      }
+      fprintf(out, "userchroot:   %-17s %.0f%s\n", counters[i].name, value,
+              counters[i].user_only ? " (user)" : "");
+    }
+    close(counters[i].fd);
+    counters[i].fd = -1;
+  }
+}
+
+#else
+
+int perf_counters_open() {
+  return 0;
+}
+
+void perf_counters_report(FILE* out) {
+}
+
+#endif // __linux__
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
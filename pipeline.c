@@ -0,0 +1,193 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "userchroot.h"
+#include "pipeline.h"
+#include "passfd.h"
+
+/*
+ * Pipeline mode runs "gen | sort | gzip" without a shell: argv holds
+ * the commands of every stage separated by the delimiter, which must
+ * be an argument of its own. Each stage is forked and executed
+ * directly, with its stdout connected to the stdin of the next one.
+ * The first stage reads userchroot's stdin and the last one writes to
+ * its stdout, so there are no redirections.
+ *
+ * The exit status is the one of the last stage, or with pipefail the
+ * one of the last stage that failed, as in bash. A stage killed by a
+ * signal counts as 128 plus the signal number.
+ *
+ * By the time we get here the chroot has happened and the privileges
+ * were already given up.
+ */
+
+// far more than any pipeline needs, and few enough that the stages
+// and their pids can always be allocated.
+#ifndef PIPELINE_MAX_STAGES
+#define PIPELINE_MAX_STAGES 1024
+#endif
+
+static pid_t* stage_pids = NULL;
+static size_t stage_count = 0;
+
+static void forward_signal(int sig) {
+  size_t i;
+  for (i = 0; i < stage_count; i++) {
+    if (stage_pids[i] > 0) {
+      kill(stage_pids[i], sig);
+    }
+  }
+}
+
+int pipeline_run(char* argv[], char* envp[], const char* delimiter,
+                 int pipefail) {
+  char*** stages;
+  size_t i;
+
+  // split argv in place, every delimiter becomes the end of a stage.
+  stage_count = 1;
+  for (i = 0; argv[i] != NULL; i++) {
+    if (strcmp(argv[i], delimiter) == 0) {
+      stage_count++;
+    }
+  }
+  if (stage_count > PIPELINE_MAX_STAGES) {
+    fprintf(stderr,"Pipeline has more than %d stages. Aborting.\n",
+            PIPELINE_MAX_STAGES);
+    exit(ERR_EXIT_CODE);
+  }
+  stages = malloc(stage_count * sizeof(char**));
+  stage_pids = calloc(stage_count, sizeof(pid_t));
+  if (stages == NULL || stage_pids == NULL) {
+    fprintf(stderr,"Failed to allocate memory. Aborting.\n");
+    exit(ERR_EXIT_CODE);
+  }
+  stages[0] = argv;
+  size_t n = 1;
+  for (i = 0; argv[i] != NULL; i++) {
+    if (strcmp(argv[i], delimiter) == 0) {
+      argv[i] = NULL;
+      stages[n++] = argv + i + 1;
+    }
+  }
+  for (i = 0; i < stage_count; i++) {
+    if (stages[i][0] == NULL) {
+      fprintf(stderr,"Empty stage in pipeline. Aborting.\n");
+      exit(ERR_EXIT_CODE);
+    }
+    if (!whitelisted_path(stages[i][0], 1)) {
+      fprintf(stderr,"Path %s contains non-whitelisted characters. Aborting.\n",
+              stages[i][0]);
+      exit(ERR_EXIT_CODE);
+    }
+  }
+
+  // signals are forwarded from the moment the first stage exists.
+  signal(SIGINT, SIG_IGN);
+  signal(SIGQUIT, SIG_IGN);
+  signal(SIGTERM, forward_signal);
+  signal(SIGHUP, forward_signal);
+
+  int input = -1;
+  for (i = 0; i < stage_count; i++) {
+    int fds[2] = { -1, -1 };
+    if (i < stage_count - 1 && pipe(fds) != 0) {
+      fprintf(stderr,"Failed to create pipe: %s. Aborting.\n", strerror(errno));
+      forward_signal(SIGTERM);
+      exit(ERR_EXIT_CODE);
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+      fprintf(stderr,"Failed to fork: %s. Aborting.\n", strerror(errno));
+      forward_signal(SIGTERM);
+      exit(ERR_EXIT_CODE);
+    }
+    if (pid == 0) {
+      signal(SIGINT, SIG_DFL);
+      signal(SIGQUIT, SIG_DFL);
+      if ((input >= 0 && dup2(input, 0) < 0) ||
+          (fds[1] >= 0 && dup2(fds[1], 1) < 0)) {
+        _exit(ERR_EXIT_CODE);
+      }
+      if (input >= 0) {
+        close(input);
+      }
+      if (fds[0] >= 0) {
+        close(fds[0]);
+        close(fds[1]);
+      }
+      passfd_install();
+      execve(stages[i][0],stages[i],envp);
+      fprintf(stderr,"Failed to exec %s: %s\n", stages[i][0], strerror(errno));
+      _exit(ERR_EXIT_CODE);
+    }
+    stage_pids[i] = pid;
+    if (input >= 0) {
+      close(input);
+    }
+    if (fds[1] >= 0) {
+      close(fds[1]);
+    }
+    input = fds[0];
+  }
+
+  int code = 0;
+  int* codes = calloc(stage_count, sizeof(int));
+  size_t remaining = stage_count;
+  if (codes == NULL) {
+    fprintf(stderr,"Failed to allocate memory. Aborting.\n");
+    exit(ERR_EXIT_CODE);
+  }
+  while (remaining > 0) {
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr,"Failed to wait for the pipeline: %s. Aborting.\n",
+              strerror(errno));
+      exit(ERR_EXIT_CODE);
+    }
+    for (i = 0; i < stage_count; i++) {
+      if (stage_pids[i] == pid) {
+        stage_pids[i] = -1;
+        codes[i] = WIFSIGNALED(status) ? 128 + WTERMSIG(status)
+                                       : WEXITSTATUS(status);
+        remaining--;
+        break;
+      }
+    }
+  }
+  // the last stage wins, or with pipefail the last one that failed.
+  for (i = 0; i < stage_count; i++) {
+    if (!pipefail || codes[i] != 0) {
+      code = codes[i];
+    }
+  }
+  free(codes);
+  free(stages);
+  return code;
+}
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
@@ -0,0 +1,158 @@
+#include <sys/types.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#include "userchroot.h"
+#include "pressure.h"
+#include "trace.h"
+
+/*
+ * Launch deferral under memory or io pressure. Starting another big
+ * job on a host that is already stalling on memory tips it into
+ * reclaim storms or the OOM killer, which costs far more than waiting
+ * a little, or than running the job elsewhere.
+ *
+ * Before the launch, the share of time some task was stalled on
+ * memory or io over the last 10 seconds, from the kernel's pressure
+ * stall information, is compared to the given thresholds. While it is
+ * above, userchroot waits, doubling the pause from a quarter of a
+ * second up to 5 seconds, for at most max_wait seconds in total. If
+ * the pressure is still there by then, it exits with
+ * DEFERRED_EXIT_CODE instead, so a scheduler can send the job
+ * elsewhere; a max_wait of 0 does that right away.
+ *
+ * Kernels without pressure stall information never defer anything.
+ */
+
+#ifndef PRESSURE_DIR
+#define PRESSURE_DIR "/proc/pressure"
+#endif
+
+#define PRESSURE_FIRST_PAUSE 0.25
+#define PRESSURE_MAX_PAUSE 5.0
+
+void pressure_init(struct pressure_limits* limits) {
+  limits->memory = -1;
+  limits->io = -1;
+  limits->max_wait = 0;
+}
+
+// Parses "memory:PERCENT,io:PERCENT", either part being optional.
+// Returns 0 if it is valid.
+int pressure_parse(char* spec, struct pressure_limits* limits) {
+  char* saveptr = NULL;
+  char* part;
+  for (part = strtok_r(spec, ",", &saveptr); part != NULL;
+       part = strtok_r(NULL, ",", &saveptr)) {
+    char* end;
+    char* colon = strchr(part, ':');
+    if (colon == NULL) {
+      return -1;
+    }
+    double value = strtod(colon + 1, &end);
+    if (colon[1] == 0 || *end != 0 || value < 0 || value > 100) {
+      return -1;
+    }
+    *colon = 0;
+    if (strcmp(part, "memory") == 0) {
+      limits->memory = value;
+    } else if (strcmp(part, "io") == 0) {
+      limits->io = value;
+    } else {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Returns the "some" avg10 of the given resource, or -1 if it isn't
+// available.
+static double some_avg10(const char* resource) {
+  char path[64];
+  double avg10;
+  snprintf(path, sizeof(path), "%s/%s", PRESSURE_DIR, resource);
+  FILE* f = fopen(path, "r");
+  if (f == NULL) {
+    return -1;
+  }
+  if (fscanf(f, "some avg10=%lf", &avg10) != 1) {
+    avg10 = -1;
+  }
+  fclose(f);
+  return avg10;
+}
+
+static double now_seconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Waits until the pressure is below the limits and returns how long
+// that took, in seconds. Exits with DEFERRED_EXIT_CODE if it doesn't
+// get there in time.
+double pressure_wait(const struct pressure_limits* limits) {
+  double start = now_seconds();
+  long long trace_start = trace_now();
+  double pause = PRESSURE_FIRST_PAUSE;
+  double memory, io;
+  char args[128];
+
+  if (limits->memory < 0 && limits->io < 0) {
+    return 0;
+  }
+  for (;;) {
+    memory = limits->memory < 0 ? -1 : some_avg10("memory");
+    io = limits->io < 0 ? -1 : some_avg10("io");
+    if (memory <= limits->memory && io <= limits->io) {
+      break;
+    }
+    double waited = now_seconds() - start;
+    if (waited >= limits->max_wait) {
+      fprintf(stderr,"userchroot: deferred, memory pressure %.2f%%, "
+              "io pressure %.2f%% after waiting %.1f s.\n",
+              memory, io, waited);
+      snprintf(args, sizeof(args), "\"memory\":%.2f,\"io\":%.2f,"
+               "\"deferred\":1", memory, io);
+      trace_complete("pressure-wait", 0, trace_start, trace_now(), args);
+      exit(DEFERRED_EXIT_CODE);
+    }
+    if (pause > limits->max_wait - waited) {
+      pause = limits->max_wait - waited;
+    }
+    struct timespec ts = { (time_t)pause,
+                           (long)((pause - (time_t)pause) * 1e9) };
+    nanosleep(&ts, NULL);
+    pause *= 2;
+    if (pause > PRESSURE_MAX_PAUSE) {
+      pause = PRESSURE_MAX_PAUSE;
+    }
+  }
+  double waited = now_seconds() - start;
+  if (waited > 0.001) {
+    snprintf(args, sizeof(args), "\"memory\":%.2f,\"io\":%.2f",
+             memory, io);
+    trace_complete("pressure-wait", 0, trace_start, trace_now(), args);
+  }
+  return waited;
+}
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
@@ -0,0 +1,27 @@
+// Launch deferral thresholds, percentages of the "some" avg10 of
+// /proc/pressure; negative when not set.
+struct pressure_limits {
+  double memory;
+  double io;
+  double max_wait;  // seconds to wait before giving up
+};
+
+void pressure_init(struct pressure_limits* limits);
+int pressure_parse(char* spec, struct pressure_limits* limits);
+double pressure_wait(const struct pressure_limits* limits);
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
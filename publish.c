@@ -0,0 +1,409 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/mount.h>
+#endif
+
+#include "userchroot.h"
+#include "publish.h"
+#include "namespaces.h"
+#include "tree.h"
+
+/*
+ * Atomic publication of a new version of an image. The owner prepares
+ * the new tree next to the image, under the same base path, and
+ * publishing exchanges the two directories in a single
+ * renameat2(RENAME_EXCHANGE): launches from then on get the new tree,
+ * while running jobs keep the old one, which is still their root.
+ *
+ * The old tree is then renamed to IMAGE@old.<time>.<pid>. '@' is not
+ * a whitelisted character, so old generations can never be launched
+ * again. They are deleted once no job uses them anymore, when
+ * publishing or on request.
+ *
+ * Every launch holds a shared flock on a lock file of the tree it runs
+ * in (see publish_hold), in PUBLISH_LOCK_DIR, where only root can open
+ * it, and collecting skips any generation it can't lock exclusively,
+ * or that some process has as its root. A job whose root is the tree
+ * itself is seen that way, so the lock is only held until its chroot;
+ * the job never gets the descriptor. Where the job's root is an
+ * overlay of the tree, or there is no single job, userchroot holds the
+ * lock until it is done.
+ *
+ * Renames and deletions happen with the owner's permissions, as they
+ * only touch the owner's base directory; only looking at the roots of
+ * other users' processes and detaching the mounts left in an old tree,
+ * like its /dev/shm, need root.
+ */
+
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+
+#define GENERATION_MARK "@old."
+
+#ifndef PUBLISH_LOCK_DIR
+#define PUBLISH_LOCK_DIR "/run/userchroot"
+#endif
+
+static void as_owner(uid_t owner) {
+  if (seteuid(owner) != 0) {
+    fprintf(stderr,"Failed to switch to the owner. Aborting.\n");
+    exit(ERR_EXIT_CODE);
+  }
+}
+
+static void as_root() {
+  if (seteuid(0) != 0) {
+    fprintf(stderr,"Failed to regain privileges. Aborting.\n");
+    exit(ERR_EXIT_CODE);
+  }
+}
+
+static int open_base(const char* base) {
+  int fd = open(base, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr,"Failed to open %s: %s. Aborting.\n", base,
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  return fd;
+}
+
+// Returns non-zero if any process has the directory described by sb
+// as its root.
+static int generation_in_use(const struct stat* sb) {
+  DIR* proc = opendir("/proc");
+  struct dirent* de;
+  int in_use = 0;
+  if (proc == NULL) {
+    // without /proc nothing can be known, so nothing is deleted.
+    return 1;
+  }
+  while (!in_use && (de = readdir(proc)) != NULL) {
+    char root[300];
+    struct stat rootsb;
+    if (de->d_name[0] < '0' || de->d_name[0] > '9') {
+      continue;
+    }
+    snprintf(root, sizeof(root), "/proc/%s/root", de->d_name);
+    if (stat(root, &rootsb) == 0 &&
+        rootsb.st_dev == sb->st_dev && rootsb.st_ino == sb->st_ino) {
+      in_use = 1;
+    }
+  }
+  closedir(proc);
+  return in_use;
+}
+
+#ifdef __linux__
+// Opens the lock file of the tree described by sb, in PUBLISH_LOCK_DIR,
+// which is created if needed and must be root's alone.
+static int open_lock(const struct stat* sb) {
+  char name[64];
+  struct stat dirsb;
+  if (mkdir(PUBLISH_LOCK_DIR, 0700) != 0 && errno != EEXIST) {
+    fprintf(stderr,"Failed to create %s: %s. Aborting.\n", PUBLISH_LOCK_DIR,
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  check_base_path(PUBLISH_LOCK_DIR);
+  int dir_fd = open(PUBLISH_LOCK_DIR, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+                    O_CLOEXEC);
+  if (dir_fd < 0 || fstat(dir_fd, &dirsb) != 0 || dirsb.st_uid != 0 ||
+      (dirsb.st_mode & 00077)) {
+    fprintf(stderr,"Directory %s should be owned and only accessible by "
+            "root. Aborting.\n", PUBLISH_LOCK_DIR);
+    exit(ERR_EXIT_CODE);
+  }
+  snprintf(name, sizeof(name), "%llx.%llx", (unsigned long long)sb->st_dev,
+           (unsigned long long)sb->st_ino);
+  int fd = openat(dir_fd, name, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+                  0600);
+  close(dir_fd);
+  if (fd < 0) {
+    fprintf(stderr,"Failed to open the lock of %s: %s. Aborting.\n",
+            PUBLISH_LOCK_DIR, strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  return fd;
+}
+
+// Drops the lock file of the tree described by sb, once it is gone.
+static void remove_lock(const struct stat* sb) {
+  char path[sizeof(PUBLISH_LOCK_DIR) + 64];
+  snprintf(path, sizeof(path), "%s/%llx.%llx", PUBLISH_LOCK_DIR,
+           (unsigned long long)sb->st_dev, (unsigned long long)sb->st_ino);
+  unlink(path);
+}
+#endif
+
+// Opens the directory 'image' for a launch, which then runs in the
+// tree behind the returned descriptor, and locks that tree until
+// userchroot exits or executes the job, which gets neither descriptor.
+// Only other launches and collections, all root, take the lock, so
+// waiting for it is bounded by them. A publish can exchange the path
+// for a new tree between the open and the lock, leaving the lock on an
+// old generation that may already be collected, so the path is looked
+// at again once locked. Must run as root. Returns -1 where trees
+// aren't published, and the launch uses the path.
+int publish_hold(const char* image) {
+#ifdef __linux__
+  for (;;) {
+    struct stat fdsb;
+    struct stat locksb;
+    struct stat sb;
+    int fd = open(image, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &fdsb) != 0) {
+      fprintf(stderr,"Failed to open %s: %s. Aborting.\n", image,
+              strerror(errno));
+      exit(ERR_EXIT_CODE);
+    }
+    int lock_fd = open_lock(&fdsb);
+    while (flock(lock_fd, LOCK_SH) != 0) {
+      if (errno != EINTR) {
+        fprintf(stderr,"Failed to lock %s: %s. Aborting.\n", image,
+                strerror(errno));
+        exit(ERR_EXIT_CODE);
+      }
+    }
+    // a collection that got the lock first removed the lock file.
+    if (fstat(lock_fd, &locksb) == 0 && locksb.st_nlink > 0 &&
+        lstat(image, &sb) == 0 &&
+        fdsb.st_dev == sb.st_dev && fdsb.st_ino == sb.st_ino) {
+      return fd;
+    }
+    close(lock_fd);
+    close(fd);
+  }
+#else
+  return -1;
+#endif
+}
+
+#ifdef __linux__
+// Detaches one mount, 'relative' to the generation 'name' in base_fd.
+// The owner controls every directory on the way.
+static void detach_mount(int base_fd, const char* name, const char* relative) {
+  char target[64];
+  int gen_fd = openat(base_fd, name, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+  int fd = gen_fd < 0 ? -1 : namespaces_open_beneath(gen_fd, relative);
+  if (gen_fd >= 0) {
+    close(gen_fd);
+  }
+  if (fd < 0) {
+    return;
+  }
+  snprintf(target, sizeof(target), "/proc/self/fd/%d", fd);
+  umount2(target, MNT_DETACH);
+  close(fd);
+}
+
+// Detaches every mount left inside the generation, deepest first,
+// like the /dev/shm of an image whose devices were installed.
+static void detach_mounts(int base_fd, const char* base, const char* name) {
+  char** found;
+  int i, j;
+  char* dir = malloc(strlen(base) + strlen(name) + 2);
+  if (dir == NULL) {
+    fprintf(stderr,"Failed to allocate memory. Aborting.\n");
+    exit(ERR_EXIT_CODE);
+  }
+  sprintf(dir, "%s/%s", base, name);
+  int count = namespaces_mounts_under(dir, &found);
+  free(dir);
+  for (i = 0; i < count; i++) {
+    for (j = i + 1; j < count; j++) {
+      if (strlen(found[j]) > strlen(found[i])) {
+        char* tmp = found[i];
+        found[i] = found[j];
+        found[j] = tmp;
+      }
+    }
+  }
+  for (i = 0; i < count; i++) {
+    detach_mount(base_fd, name, found[i]);
+    free(found[i]);
+  }
+  free(found);
+}
+#endif
+
+// Deletes the old generations of 'image' that no job uses anymore.
+// Must run as root. Returns 0 unless a deletion failed.
+int collect_generations(const char* base, const char* image, uid_t owner) {
+  int base_fd = open_base(base);
+  int rc = 0;
+  size_t marklen = strlen(image) + strlen(GENERATION_MARK);
+  char* mark = malloc(marklen + 1);
+  if (mark == NULL) {
+    fprintf(stderr,"Failed to allocate memory. Aborting.\n");
+    exit(ERR_EXIT_CODE);
+  }
+  snprintf(mark, marklen + 1, "%s%s", image, GENERATION_MARK);
+
+  struct stat basesb;
+  if (fstat(base_fd, &basesb) != 0) {
+    fprintf(stderr,"Failed to stat %s. Aborting.\n", base);
+    exit(ERR_EXIT_CODE);
+  }
+  int list_fd = dup(base_fd);
+  DIR* dir = list_fd < 0 ? NULL : fdopendir(list_fd);
+  if (dir == NULL) {
+    fprintf(stderr,"Failed to list %s. Aborting.\n", base);
+    exit(ERR_EXIT_CODE);
+  }
+  struct dirent* de;
+  while ((de = readdir(dir)) != NULL) {
+    struct stat sb;
+    if (strncmp(de->d_name, mark, marklen) != 0 ||
+        fstatat(base_fd, de->d_name, &sb, AT_SYMLINK_NOFOLLOW) != 0 ||
+        !S_ISDIR(sb.st_mode) || sb.st_uid != owner) {
+      continue;
+    }
+#ifdef __linux__
+    // held until the tree is gone, so a launch that opened it just
+    // before it was published away waits, and then sees it moved.
+    int lock_fd = open_lock(&sb);
+    if (flock(lock_fd, LOCK_EX | LOCK_NB) != 0 || generation_in_use(&sb)) {
+      fprintf(stderr,"userchroot: %s/%s is still in use.\n", base,
+              de->d_name);
+      close(lock_fd);
+      continue;
+    }
+    detach_mounts(base_fd, base, de->d_name);
+#else
+    if (generation_in_use(&sb)) {
+      fprintf(stderr,"userchroot: %s/%s is still in use.\n", base,
+              de->d_name);
+      continue;
+    }
+#endif
+    as_owner(owner);
+    int removed = tree_remove(base_fd, de->d_name, basesb.st_dev) == 0;
+    if (!removed) {
+      fprintf(stderr,"Failed to delete %s/%s: %s.\n", base, de->d_name,
+              strerror(errno));
+      rc = ERR_EXIT_CODE;
+    }
+    as_root();
+#ifdef __linux__
+    if (removed) {
+      remove_lock(&sb);
+    }
+    close(lock_fd);
+#endif
+  }
+  closedir(dir);
+  close(base_fd);
+  free(mark);
+  return rc;
+}
+
+// Validates the staging directory given to --publish, an absolute
+// path in 'base' other than the image, the way a launch validates an
+// image. Returns its name in 'base'.
+const char* publish_check_staging(const char* base, const char* image,
+                                  const char* staging, uid_t owner) {
+  size_t baselen = strlen(base);
+  struct stat sb;
+  if (strncmp(staging, base, baselen) != 0 || staging[baselen] != '/' ||
+      !whitelisted_path(staging + baselen + 1, 0)) {
+    fprintf(stderr,"%s should be a directory in %s. Aborting.\n", staging,
+            base);
+    exit(ERR_EXIT_CODE);
+  }
+  const char* name = staging + baselen + 1;
+  if (name[0] == 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+      strcmp(name, image) == 0) {
+    fprintf(stderr,"%s can't be published over %s/%s. Aborting.\n", staging,
+            base, image);
+    exit(ERR_EXIT_CODE);
+  }
+  if (lstat(staging, &sb) != 0) {
+    fprintf(stderr,"Failed to stat %s. Aborting.\n", staging);
+    exit(ERR_EXIT_CODE);
+  }
+  if (!S_ISDIR(sb.st_mode)) {
+    fprintf(stderr,"%s is not a directory. Aborting.\n", staging);
+    exit(ERR_EXIT_CODE);
+  }
+  if (sb.st_mode & 00022) {
+    fprintf(stderr,"Directory %s has non-restrictive permissions. Aborting.\n",
+            staging);
+    exit(ERR_EXIT_CODE);
+  }
+  if (sb.st_uid != owner) {
+    fprintf(stderr,"%s and %s must have the same owner. Aborting.\n", base,
+            staging);
+    exit(ERR_EXIT_CODE);
+  }
+  return name;
+}
+
+// Makes the directory 'staging' the new 'image', both names in the
+// directory 'base', and moves the previous tree out of the way as an
+// old generation. Both must already have been validated. Must run as
+// root.
+int publish_image(const char* base, const char* image, const char* staging,
+                  uid_t owner) {
+#ifdef SYS_renameat2
+  char old[4096];
+  int base_fd = open_base(base);
+  int rc;
+  snprintf(old, sizeof(old), "%s%s%ld.%d", image, GENERATION_MARK,
+           (long)time(NULL), (int)getpid());
+
+  as_owner(owner);
+  rc = syscall(SYS_renameat2, base_fd, staging, base_fd, image,
+               RENAME_EXCHANGE);
+  if (rc != 0) {
+    fprintf(stderr,"Failed to exchange %s/%s and %s/%s: %s. Aborting.\n",
+            base, staging, base, image, strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  // from here on new launches get the new tree, the previous one is
+  // under the staging name until it is renamed.
+  if (renameat(base_fd, staging, base_fd, old) != 0) {
+    fprintf(stderr,"Failed to rename %s/%s to %s/%s: %s. Aborting.\n",
+            base, staging, base, old, strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  as_root();
+  close(base_fd);
+  return collect_generations(base, image, owner);
+#else
+  fprintf(stderr,"Publishing is only supported on Linux. Aborting.\n");
+  exit(ERR_EXIT_CODE);
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
@@ -0,0 +1,24 @@
+#include <sys/types.h>
+
+const char* publish_check_staging(const char* base, const char* image,
+                                  const char* staging, uid_t owner);
+int publish_image(const char* base, const char* image, const char* staging,
+                  uid_t owner);
+int collect_generations(const char* base, const char* image, uid_t owner);
+int publish_hold(const char* image);
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
@@ -0,0 +1,84 @@
+#include <sys/types.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#include "userchroot.h"
+#include "record.h"
+
+/*
+ * Launch recording, for replaying production traffic against a test
+ * host later (see bench/replay.c). Each launch appends one line:
+ *
+ * arrival image command argument_bytes environment_bytes duration exit_code
+ *
+ * The arrival is the wall-clock time userchroot started, and the
+ * duration the time the command ran, both in microseconds. The image
+ * and command are whitelisted paths, so the fields never contain
+ * spaces. Only the sizes of the arguments and the environment are
+ * kept, never their contents.
+ *
+ * Like the trace output, every line is a single write on a file
+ * opened with O_APPEND, so concurrent launches can share a file.
+ */
+
+static int record_fd = -1;
+
+void record_open(const char* path) {
+  record_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+  if (record_fd < 0) {
+    fprintf(stderr,"Failed to open record file %s: %s. Aborting.\n",
+            path, strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+}
+
+static long vector_bytes(char* v[]) {
+  long bytes = 0;
+  while (v != NULL && *v != NULL) {
+    bytes += strlen(*v) + 1;
+    v++;
+  }
+  return bytes;
+}
+
+void record_launch(const struct timespec* arrival, const char* image,
+                   char* argv[], char* envp[], double duration,
+                   int exit_code) {
+  char line[2048];
+  if (record_fd < 0) {
+    return;
+  }
+  int len = snprintf(line, sizeof(line), "%lld %s %s %ld %ld %.0f %d\n",
+                     (long long)arrival->tv_sec * 1000000 +
+                     arrival->tv_nsec / 1000,
+                     image, argv[0], vector_bytes(argv + 1),
+                     vector_bytes(envp), duration * 1e6, exit_code);
+  if (len >= (int)sizeof(line)) {
+    fprintf(stderr,"Launch record too long, not recorded.\n");
+    return;
+  }
+  if (write(record_fd, line, len) != len) {
+    fprintf(stderr,"Failed to write launch record: %s.\n", strerror(errno));
+  }
+}
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
@@ -0,0 +1,297 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <sys/mount.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#endif
+
+#include "userchroot.h"
+#include "shm_size.h"
+
+/*
+ * Sizing of the /dev/shm tmpfs of an image from what it used before.
+ * A fixed size is too small for some images, whose jobs then fail with
+ * ENOSPC, and needlessly large for most. Each image has a history
+ * file in SHM_HISTORY_DIR, named after the image with its '/' turned
+ * into '@', holding the last SHM_HISTORY peaks of its /dev/shm, in
+ * bytes, one per line, newest last. A name too long for a file, with
+ * room for the suffix of the temporary file it is written to, is cut
+ * and ends with '#' and a hash of the whole path instead; neither
+ * character can be in a whitelisted path.
+ *
+ *  - --uninstall-devices records what the tmpfs holds when it is
+ *    unmounted;
+ *  - --install-devices sizes the tmpfs to the highest peak of the
+ *    history plus SHM_HEADROOM percent, or to 128 MiB without a
+ *    history, within SHM_SIZE_MIN and SHM_SIZE_MAX (in MiB);
+ *  - every launch looks at the tmpfs, and if it is three quarters
+ *    full, doubles it, up to SHM_SIZE_MAX, and records that peak.
+ *
+ * Nothing is recorded, and the size stays 128 MiB, unless root created
+ * SHM_HISTORY_DIR. It must be root's, and so must the path leading to
+ * it.
+ */
+
+#ifndef SHM_HISTORY_DIR
+#define SHM_HISTORY_DIR "/var/lib/userchroot/shm"
+#endif
+#ifndef SHM_SIZE_MIN
+#define SHM_SIZE_MIN 16
+#endif
+#ifndef SHM_SIZE_MAX
+#define SHM_SIZE_MAX 4096
+#endif
+#ifndef SHM_HEADROOM
+#define SHM_HEADROOM 50
+#endif
+
+#define SHM_SIZE_DEFAULT 128
+#define SHM_HISTORY 8
+#define SHM_MIB (1024ULL * 1024)
+// room for ".PID" after the name of a history file.
+#define SHM_NAME_MAX (NAME_MAX - 16)
+
+// Opens SHM_HISTORY_DIR, or returns -1 if there is none.
+static int open_history_dir() {
+  struct stat sb;
+  if (lstat(SHM_HISTORY_DIR, &sb) != 0) {
+    return -1;
+  }
+  check_base_path(SHM_HISTORY_DIR);
+  int fd = open(SHM_HISTORY_DIR, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+                O_CLOEXEC);
+  if (fd < 0 || fstat(fd, &sb) != 0 || sb.st_uid != 0 ||
+      (sb.st_mode & 00022)) {
+    fprintf(stderr,"Directory %s should be owned and only writable by "
+            "root. Aborting.\n", SHM_HISTORY_DIR);
+    exit(ERR_EXIT_CODE);
+  }
+  return fd;
+}
+
+// The name of the history of 'image', in a buffer of SHM_NAME_MAX + 1.
+static void history_name(const char* image, char* name) {
+  char* p;
+  const char* c;
+  if (strlen(image + 1) <= SHM_NAME_MAX) {
+    strcpy(name, image + 1);
+  } else {
+    // FNV-1a.
+    unsigned long long hash = 14695981039346656037ULL;
+    for (c = image; *c; c++) {
+      hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    }
+    snprintf(name, SHM_NAME_MAX + 1, "%.*s#%016llx", SHM_NAME_MAX - 17,
+             image + 1, hash);
+  }
+  for (p = name; *p; p++) {
+    if (*p == '/') {
+      *p = '@';
+    }
+  }
+}
+
+// Reads the history of 'image' into 'peaks', returning how many there
+// are.
+static int read_history(int dir_fd, const char* name,
+                        unsigned long long* peaks) {
+  char buf[SHM_HISTORY * 24];
+  int count = 0;
+  int fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0) {
+    return 0;
+  }
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0) {
+    return 0;
+  }
+  buf[n] = 0;
+  char* saveptr = NULL;
+  char* line;
+  for (line = strtok_r(buf, "\n", &saveptr);
+       line != NULL && count < SHM_HISTORY;
+       line = strtok_r(NULL, "\n", &saveptr)) {
+    peaks[count++] = strtoull(line, NULL, 10);
+  }
+  return count;
+}
+
+// The size, in MiB, to give the /dev/shm of 'image'.
+unsigned long long shm_size_for(const char* image) {
+  unsigned long long peaks[SHM_HISTORY];
+  unsigned long long size = SHM_SIZE_DEFAULT;
+  char name[SHM_NAME_MAX + 1];
+  int i;
+  int dir_fd = open_history_dir();
+  int count = 0;
+  if (dir_fd >= 0) {
+    history_name(image, name);
+    count = read_history(dir_fd, name, peaks);
+    close(dir_fd);
+  }
+  if (count > 0) {
+    unsigned long long highest = 0;
+    for (i = 0; i < count; i++) {
+      if (peaks[i] > highest) {
+        highest = peaks[i];
+      }
+    }
+    size = highest + highest / 100 * SHM_HEADROOM;
+    size = (size + SHM_MIB - 1) / SHM_MIB;
+  }
+  if (size < SHM_SIZE_MIN) {
+    return SHM_SIZE_MIN;
+  }
+  return size > SHM_SIZE_MAX ? SHM_SIZE_MAX : size;
+}
+
+// Adds 'peak', in bytes, to the history of 'image', dropping the
+// oldest beyond SHM_HISTORY. Must run as root.
+void shm_size_record(const char* image, unsigned long long peak) {
+  unsigned long long peaks[SHM_HISTORY];
+  char name[SHM_NAME_MAX + 1];
+  char tmp[NAME_MAX + 1];
+  char buf[SHM_HISTORY * 24];
+  size_t len = 0;
+  int i;
+  int dir_fd = open_history_dir();
+  if (dir_fd < 0) {
+    return;
+  }
+  history_name(image, name);
+  int count = read_history(dir_fd, name, peaks);
+  int first = count == SHM_HISTORY ? 1 : 0;
+  for (i = first; i < count; i++) {
+    len += snprintf(buf + len, sizeof(buf) - len, "%llu\n", peaks[i]);
+  }
+  len += snprintf(buf + len, sizeof(buf) - len, "%llu\n", peak);
+
+  // a new file renamed over the old one, so that a launch never reads
+  // half of it.
+  snprintf(tmp, sizeof(tmp), "%s.%d", name, (int)getpid());
+  int fd = openat(dir_fd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW |
+                  O_CLOEXEC, 0644);
+  if (fd < 0 || write(fd, buf, len) != (ssize_t)len || close(fd) != 0 ||
+      renameat(dir_fd, tmp, dir_fd, name) != 0) {
+    fprintf(stderr,"userchroot: failed to record the /dev/shm usage of "
+            "%s: %s.\n", image, strerror(errno));
+    unlinkat(dir_fd, tmp, 0);
+  }
+  close(dir_fd);
+}
+
+// Opens the /dev/shm tmpfs mounted in 'image', or returns -1 if there
+// is none. The image belongs to its owner: nothing on the way is
+// followed, and only a tmpfs mounted on it counts.
+int shm_size_open(const char* image) {
+#ifdef __linux__
+  struct stat devsb;
+  struct stat shmsb;
+  struct statfs sfs;
+  char* dev = malloc(strlen(image) + strlen("/dev") + 1);
+  if (dev == NULL) {
+    fprintf(stderr,"Failed to allocate memory. Aborting.\n");
+    exit(ERR_EXIT_CODE);
+  }
+  sprintf(dev, "%s/dev", image);
+  int dev_fd = open(dev, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  free(dev);
+  if (dev_fd < 0) {
+    return -1;
+  }
+  int fd = openat(dev_fd, "shm", O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+                  O_CLOEXEC);
+  int mounted = fd >= 0 && fstat(dev_fd, &devsb) == 0 &&
+                fstat(fd, &shmsb) == 0 && fstatfs(fd, &sfs) == 0 &&
+                sfs.f_type == TMPFS_MAGIC && shmsb.st_dev != devsb.st_dev;
+  close(dev_fd);
+  if (!mounted) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  return fd;
+#else
+  return -1;
+#endif
+}
+
+// What the tmpfs opened by shm_size_open holds, in bytes.
+unsigned long long shm_size_used(int shm_fd) {
+#ifdef __linux__
+  struct statfs sfs;
+  if (fstatfs(shm_fd, &sfs) == 0) {
+    return (unsigned long long)(sfs.f_blocks - sfs.f_bfree) * sfs.f_bsize;
+  }
+#endif
+  return 0;
+}
+
+// Doubles the /dev/shm of 'image', up to SHM_SIZE_MAX, if it is three
+// quarters full. Must run as root, before anything is mounted in the
+// image for the job.
+void shm_size_grow(const char* image) {
+#ifdef __linux__
+  struct statfs sfs;
+  char target[64];
+  char options[64];
+  int fd = shm_size_open(image);
+  if (fd < 0) {
+    return;
+  }
+  if (fstatfs(fd, &sfs) != 0) {
+    close(fd);
+    return;
+  }
+  unsigned long long size = (unsigned long long)sfs.f_blocks * sfs.f_bsize;
+  unsigned long long used = shm_size_used(fd);
+  if (used * 4 < size * 3 || size >= SHM_SIZE_MAX * SHM_MIB) {
+    close(fd);
+    return;
+  }
+  size = size * 2 / SHM_MIB;
+  if (size > SHM_SIZE_MAX) {
+    size = SHM_SIZE_MAX;
+  }
+  // a tmpfs only changes the options it is given on a remount.
+  snprintf(target, sizeof(target), "/proc/self/fd/%d", fd);
+  snprintf(options, sizeof(options), "size=%llum", size);
+  if (mount(NULL, target, NULL, MS_REMOUNT, options) != 0) {
+    fprintf(stderr,"userchroot: failed to grow the /dev/shm of %s: %s.\n",
+            image, strerror(errno));
+  } else {
+    shm_size_record(image, used);
+  }
+  close(fd);
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
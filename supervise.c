@@ -0,0 +1,136 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#include "userchroot.h"
+#include "supervise.h"
+#include "perf_counters.h"
+#include "passfd.h"
+
+/*
+ * In supervised mode userchroot doesn't replace itself with the
+ * command. Instead it forks, waits for the command to finish and
+ * reports what the command consumed on stderr before exiting with the
+ * command's own exit code.
+ *
+ * By the time we get here the chroot has happened and the privileges
+ * were already given up, so both processes run as the calling user.
+ */
+
+static pid_t supervised_child = -1;
+
+static void forward_signal(int sig) {
+  if (supervised_child > 0) {
+    kill(supervised_child, sig);
+  }
+}
+
+static double seconds_since(const struct timespec* start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) +
+    (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int supervise_command(char* argv[], char* envp[], struct job_report* report) {
+  int rc;
+  clock_gettime(CLOCK_MONOTONIC, &report->start);
+
+  // the counters must exist before the fork so that the child
+  // inherits them.
+  perf_counters_open();
+
+  supervised_child = fork();
+  if (supervised_child < 0) {
+    fprintf(stderr,"Failed to fork: %s. Aborting.\n", strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  if (supervised_child == 0) {
+    passfd_install();
+    execve(argv[0],argv,envp);
+    fprintf(stderr,"Failed to exec %s: %s\n", argv[0], strerror(errno));
+    _exit(ERR_EXIT_CODE);
+  }
+
+  // a terminal delivers interrupts to the whole process group, so the
+  // child gets those on its own. Anything sent to us directly is
+  // passed along.
+  signal(SIGINT, SIG_IGN);
+  signal(SIGQUIT, SIG_IGN);
+  signal(SIGTERM, forward_signal);
+  signal(SIGHUP, forward_signal);
+
+  do {
+    rc = waitpid(supervised_child, &report->status, 0);
+  } while (rc < 0 && errno == EINTR);
+  if (rc < 0) {
+    fprintf(stderr,"Failed to wait for %s: %s. Aborting.\n",
+            argv[0], strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  report->pid = supervised_child;
+  report->waited_seconds = 0;
+  report->real_seconds = seconds_since(&report->start);
+  getrusage(RUSAGE_CHILDREN, &report->usage);
+  supervised_child = -1;
+  return 0;
+}
+
+void supervise_print_report(const char* command,
+                            const struct job_report* report) {
+  const struct rusage* ru = &report->usage;
+  fprintf(stderr, "userchroot: resource report for %s\n", command);
+  if (WIFSIGNALED(report->status)) {
+    fprintf(stderr, "userchroot:   %-17s signal %d\n", "terminated by",
+            WTERMSIG(report->status));
+  } else {
+    fprintf(stderr, "userchroot:   %-17s %d\n", "exit status",
+            WEXITSTATUS(report->status));
+  }
+  if (report->waited_seconds > 0) {
+    fprintf(stderr, "userchroot:   %-17s %.3f s\n", "pressure wait",
+            report->waited_seconds);
+  }
+  fprintf(stderr, "userchroot:   %-17s %.3f s\n", "real",
+          report->real_seconds);
+  fprintf(stderr, "userchroot:   %-17s %ld.%03ld s\n", "user",
+          (long)ru->ru_utime.tv_sec, (long)ru->ru_utime.tv_usec / 1000);
+  fprintf(stderr, "userchroot:   %-17s %ld.%03ld s\n", "sys",
+          (long)ru->ru_stime.tv_sec, (long)ru->ru_stime.tv_usec / 1000);
+  fprintf(stderr, "userchroot:   %-17s %ld KiB\n", "max rss",
+          ru->ru_maxrss);
+  fprintf(stderr, "userchroot:   %-17s %ld major, %ld minor\n", "rusage faults",
+          ru->ru_majflt, ru->ru_minflt);
+  fprintf(stderr, "userchroot:   %-17s %ld voluntary, %ld involuntary\n",
+          "rusage switches", ru->ru_nvcsw, ru->ru_nivcsw);
+  perf_counters_report(stderr);
+}
+
+int supervise_exit_code(int status) {
+  if (WIFSIGNALED(status)) {
+    return 128 + WTERMSIG(status);
+  }
+  return WEXITSTATUS(status);
+}
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
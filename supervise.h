@@ -0,0 +1,35 @@
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
+
+// Outcome of a supervised command, filled by supervise_command.
+struct job_report {
+  pid_t pid;              // pid of the command
+  struct timespec start;  // CLOCK_MONOTONIC time of the fork
+  int status;             // raw status as returned by waitpid
+  double real_seconds;    // wall-clock time from fork to reap
+  struct rusage usage;    // accumulated usage of the reaped children
+  double waited_seconds;  // wait for pressure to drop before the launch
+};
+
+int supervise_command(char* argv[], char* envp[], struct job_report* report);
+void supervise_print_report(const char* command,
+                            const struct job_report* report);
+int supervise_exit_code(int status);
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
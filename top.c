@@ -0,0 +1,420 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#endif
+
+#include "userchroot.h"
+#include "config.h"
+#include "top.h"
+
+/*
+ * "userchroot --top" shows which images have processes running in
+ * them and what those processes use, grouped by image.
+ *
+ * A process belongs to an image when its root directory, as seen in
+ * /proc/<pid>/root, is an immediate child of one of the configured
+ * base paths. Processes chroot'd anywhere else are not shown.
+ *
+ * /proc lists the pids in increasing order, so each sample is kept as
+ * an array sorted by pid and the next sample is merged against it in
+ * a single pass. The root directory has to be checked on every
+ * sample, since userchroot changes it in place before exec, but the
+ * per-process stat and io files are only read for processes inside an
+ * image, and the cgroup only once per process.
+ *
+ * This needs root privileges to look at the root directory and io
+ * counters of other users' processes, so only per-image totals are
+ * ever shown.
+ */
+
+#ifdef __linux__
+
+#define TOP_REFRESH_SECONDS 2
+#define TOP_SNAPSHOT_SECONDS 1
+
+struct top_process {
+  pid_t pid;
+  unsigned long long starttime;  // in clock ticks since boot
+  int image;                     // index in images, or -1
+  unsigned long long cpu_ticks;  // utime + stime
+  unsigned long long read_bytes;
+  unsigned long long write_bytes;
+  unsigned long cgroup_hash;
+};
+
+struct top_image {
+  char* path;
+  int processes;
+  double cpu_percent;
+  unsigned long long rss_bytes;
+  unsigned long long shm_bytes;
+  double read_rate;
+  double write_rate;
+  int cgroups;
+  unsigned long* cgroup_hashes;
+};
+
+struct top_sample {
+  struct top_process* procs;
+  int count;
+  int capacity;
+  double uptime;
+};
+
+static char** bases;
+static int num_bases;
+static struct top_image* images;
+static int num_images;
+static long clock_ticks;
+static long page_size;
+
+static void* top_realloc(void* ptr, size_t size) {
+  ptr = realloc(ptr, size);
+  if (ptr == NULL) {
+    fprintf(stderr,"Failed to allocate memory. Aborting.\n");
+    exit(ERR_EXIT_CODE);
+  }
+  return ptr;
+}
+
+static double read_uptime() {
+  double uptime = 0;
+  FILE* f = fopen("/proc/uptime", "r");
+  if (f != NULL) {
+    if (fscanf(f, "%lf", &uptime) != 1) {
+      uptime = 0;
+    }
+    fclose(f);
+  }
+  return uptime;
+}
+
+// Returns the image index for the given root directory, registering
+// the image the first time it is seen, or -1 if the root is not an
+// image under one of the configured bases.
+static int image_for_root(const char* root) {
+  int i;
+  const char* slash = strrchr(root, '/');
+  if (slash == NULL || slash == root || slash[1] == 0 ||
+      !whitelisted_path(slash + 1, 0)) {
+    return -1;
+  }
+  for (i = 0; i < num_images; i++) {
+    if (strcmp(images[i].path, root) == 0) {
+      return i;
+    }
+  }
+  for (i = 0; i < num_bases; i++) {
+    size_t blen = strlen(bases[i]);
+    if (blen == (size_t)(slash - root) &&
+        strncmp(bases[i], root, blen) == 0) {
+      images = top_realloc(images, (num_images + 1) * sizeof(*images));
+      memset(&images[num_images], 0, sizeof(*images));
+      images[num_images].path = strdup(root);
+      if (images[num_images].path == NULL) {
+        fprintf(stderr,"Failed to allocate memory. Aborting.\n");
+        exit(ERR_EXIT_CODE);
+      }
+      return num_images++;
+    }
+  }
+  return -1;
+}
+
+static int read_root_image(pid_t pid) {
+  char link[64];
+  char root[4096];
+  snprintf(link, sizeof(link), "/proc/%d/root", (int)pid);
+  ssize_t len = readlink(link, root, sizeof(root) - 1);
+  if (len <= 0) {
+    return -1;
+  }
+  root[len] = 0;
+  return image_for_root(root);
+}
+
+// Reads start time, cpu time and rss from /proc/<pid>/stat. Returns
+// non-zero if the process is gone.
+static int read_stat(pid_t pid, unsigned long long* starttime,
+                     unsigned long long* cpu_ticks, long* rss_pages) {
+  char path[64];
+  char buf[1024];
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+  FILE* f = fopen(path, "r");
+  if (f == NULL) {
+    return -1;
+  }
+  size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+  fclose(f);
+  buf[len] = 0;
+  // the command name may contain anything, so skip past its last ')'.
+  char* p = strrchr(buf, ')');
+  if (p == NULL) {
+    return -1;
+  }
+  unsigned long long utime, stime;
+  int n = sscanf(p + 2,
+                 "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                 "%llu %llu %*d %*d %*d %*d %*d %*d %llu %*u %ld",
+                 &utime, &stime, starttime, rss_pages);
+  if (n != 4) {
+    return -1;
+  }
+  *cpu_ticks = utime + stime;
+  return 0;
+}
+
+static void read_io(pid_t pid, unsigned long long* read_bytes,
+                    unsigned long long* write_bytes) {
+  char path[64];
+  char key[64];
+  unsigned long long value;
+  snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+  FILE* f = fopen(path, "r");
+  if (f == NULL) {
+    return;
+  }
+  while (fscanf(f, "%63s %llu", key, &value) == 2) {
+    if (strcmp(key, "read_bytes:") == 0) {
+      *read_bytes = value;
+    } else if (strcmp(key, "write_bytes:") == 0) {
+      *write_bytes = value;
+    }
+  }
+  fclose(f);
+}
+
+static unsigned long read_cgroup_hash(pid_t pid) {
+  char path[64];
+  char buf[4096];
+  unsigned long hash = 5381;
+  snprintf(path, sizeof(path), "/proc/%d/cgroup", (int)pid);
+  FILE* f = fopen(path, "r");
+  if (f == NULL) {
+    return 0;
+  }
+  size_t len = fread(buf, 1, sizeof(buf), f);
+  size_t i;
+  fclose(f);
+  for (i = 0; i < len; i++) {
+    hash = hash * 33 + (unsigned char)buf[i];
+  }
+  return hash;
+}
+
+static void add_cgroup(struct top_image* image, unsigned long hash) {
+  int i;
+  for (i = 0; i < image->cgroups; i++) {
+    if (image->cgroup_hashes[i] == hash) {
+      return;
+    }
+  }
+  image->cgroup_hashes =
+    top_realloc(image->cgroup_hashes, (image->cgroups + 1) * sizeof(hash));
+  image->cgroup_hashes[image->cgroups++] = hash;
+}
+
+static void read_shm_usage(struct top_image* image) {
+  struct statfs fs;
+  char* path = top_realloc(NULL, strlen(image->path) + strlen("/dev/shm") + 1);
+  sprintf(path, "%s/dev/shm", image->path);
+  if (statfs(path, &fs) == 0 && fs.f_type == TMPFS_MAGIC) {
+    image->shm_bytes =
+      (unsigned long long)(fs.f_blocks - fs.f_bfree) * fs.f_bsize;
+  }
+  free(path);
+}
+
+// Takes a new sample into 'cur', diffing it against 'prev', and
+// updates the per-image totals.
+static void take_sample(const struct top_sample* prev, struct top_sample* cur) {
+  int i;
+  int pi = 0;
+  double elapsed;
+  struct dirent* ent;
+
+  for (i = 0; i < num_images; i++) {
+    images[i].processes = 0;
+    images[i].cpu_percent = 0;
+    images[i].rss_bytes = 0;
+    images[i].shm_bytes = 0;
+    images[i].read_rate = 0;
+    images[i].write_rate = 0;
+    images[i].cgroups = 0;
+  }
+
+  cur->count = 0;
+  cur->uptime = read_uptime();
+  elapsed = cur->uptime - prev->uptime;
+
+  DIR* proc = opendir("/proc");
+  if (proc == NULL) {
+    fprintf(stderr,"Failed to open /proc. Aborting.\n");
+    exit(ERR_EXIT_CODE);
+  }
+  while ((ent = readdir(proc)) != NULL) {
+    if (ent->d_name[0] < '0' || ent->d_name[0] > '9') {
+      continue;
+    }
+    pid_t pid = atoi(ent->d_name);
+    int image = read_root_image(pid);
+    if (image < 0) {
+      continue;
+    }
+
+    struct top_process p;
+    long rss_pages = 0;
+    memset(&p, 0, sizeof(p));
+    p.pid = pid;
+    p.image = image;
+    if (read_stat(pid, &p.starttime, &p.cpu_ticks, &rss_pages) != 0) {
+      continue;
+    }
+    read_io(pid, &p.read_bytes, &p.write_bytes);
+
+    // find this process in the previous sample; both are sorted by pid.
+    while (pi < prev->count && prev->procs[pi].pid < pid) {
+      pi++;
+    }
+    const struct top_process* old = NULL;
+    if (pi < prev->count && prev->procs[pi].pid == pid &&
+        prev->procs[pi].starttime == p.starttime) {
+      old = &prev->procs[pi];
+      p.cgroup_hash = old->cgroup_hash;
+    } else {
+      p.cgroup_hash = read_cgroup_hash(pid);
+    }
+
+    struct top_image* img = &images[image];
+    img->processes++;
+    img->rss_bytes += (unsigned long long)rss_pages * page_size;
+    add_cgroup(img, p.cgroup_hash);
+    if (elapsed > 0 && prev->uptime > 0) {
+      if (old != NULL && old->image == image) {
+        img->cpu_percent +=
+          100.0 * (p.cpu_ticks - old->cpu_ticks) / clock_ticks / elapsed;
+        img->read_rate += (p.read_bytes - old->read_bytes) / elapsed;
+        img->write_rate += (p.write_bytes - old->write_bytes) / elapsed;
+      } else if (p.starttime >= prev->uptime * clock_ticks) {
+        // started since the last sample, so all of it is new.
+        img->cpu_percent += 100.0 * p.cpu_ticks / clock_ticks / elapsed;
+        img->read_rate += p.read_bytes / elapsed;
+        img->write_rate += p.write_bytes / elapsed;
+      }
+    }
+
+    if (cur->count == cur->capacity) {
+      cur->capacity = cur->capacity ? cur->capacity * 2 : 256;
+      cur->procs = top_realloc(cur->procs,
+                               cur->capacity * sizeof(struct top_process));
+    }
+    cur->procs[cur->count++] = p;
+  }
+  closedir(proc);
+
+  for (i = 0; i < num_images; i++) {
+    if (images[i].processes > 0) {
+      read_shm_usage(&images[i]);
+    }
+  }
+}
+
+static void print_table() {
+  int i;
+  // clear the screen and move to the top left corner.
+  printf("\033[H\033[2J");
+  printf("%-40s %6s %7s %10s %10s %10s %10s %7s\n", "IMAGE", "PROCS",
+         "CPU%", "RSS(MiB)", "SHM(MiB)", "READ(K/s)", "WRITE(K/s)",
+         "CGROUPS");
+  for (i = 0; i < num_images; i++) {
+    struct top_image* img = &images[i];
+    if (img->processes == 0) {
+      continue;
+    }
+    printf("%-40s %6d %7.1f %10.1f %10.1f %10.1f %10.1f %7d\n", img->path,
+           img->processes, img->cpu_percent, img->rss_bytes / 1048576.0,
+           img->shm_bytes / 1048576.0, img->read_rate / 1024,
+           img->write_rate / 1024, img->cgroups);
+  }
+  fflush(stdout);
+}
+
+static void print_json() {
+  int i;
+  int first = 1;
+  // image paths are whitelisted, so they never need escaping.
+  printf("{\"timestamp\":%ld,\"interval\":%d,\"images\":[",
+         (long)time(NULL), TOP_SNAPSHOT_SECONDS);
+  for (i = 0; i < num_images; i++) {
+    struct top_image* img = &images[i];
+    if (img->processes == 0) {
+      continue;
+    }
+    printf("%s{\"image\":\"%s\",\"processes\":%d,\"cpu_percent\":%.1f,"
+           "\"rss_bytes\":%llu,\"shm_bytes\":%llu,"
+           "\"read_bytes_per_sec\":%.0f,\"write_bytes_per_sec\":%.0f,"
+           "\"cgroups\":%d}",
+           first ? "" : ",", img->path, img->processes, img->cpu_percent,
+           img->rss_bytes, img->shm_bytes, img->read_rate, img->write_rate,
+           img->cgroups);
+    first = 0;
+  }
+  printf("]}\n");
+}
+
+int top_run(FILE* config, int json) {
+  struct top_sample samples[2];
+  int cur = 0;
+  memset(samples, 0, sizeof(samples));
+  num_bases = config_list_bases(config, &bases);
+  clock_ticks = sysconf(_SC_CLK_TCK);
+  page_size = sysconf(_SC_PAGESIZE);
+
+  // the first sample is only a baseline for the rates.
+  take_sample(&samples[1], &samples[0]);
+  while (1) {
+    sleep(json ? TOP_SNAPSHOT_SECONDS : TOP_REFRESH_SECONDS);
+    take_sample(&samples[cur], &samples[1 - cur]);
+    cur = 1 - cur;
+    if (json) {
+      print_json();
+      return 0;
+    }
+    print_table();
+  }
+}
+
+#else
+
+int top_run(FILE* config, int json) {
+  fprintf(stderr,"--top is only supported on Linux. Aborting.\n");
+  return ERR_EXIT_CODE;
+}
+
+#endif // __linux__
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
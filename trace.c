@@ -0,0 +1,171 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#include "userchroot.h"
+#include "trace.h"
+
+/*
+ * Chrome trace-event output, loadable in Perfetto or chrome://tracing.
+ *
+ * Many launches append to the same file concurrently, so every event
+ * is formatted in memory and written with a single write() on a file
+ * opened with O_APPEND, which keeps records from interleaving. The
+ * file is a JSON array that is never closed, which both viewers
+ * accept. The opening bracket is written by whoever creates the file:
+ * a temporary file holding just the bracket is hard linked into
+ * place, so no launch can ever append to a file that doesn't start
+ * with it.
+ *
+ * Timestamps come from CLOCK_MONOTONIC, so launches on the same host
+ * line up with each other.
+ *
+ * Everything that ends up in an event is either a number or a
+ * whitelisted path, so nothing needs escaping.
+ */
+
+// room for an image path of up to PATH_MAX; an event that still
+// doesn't fit is dropped rather than cut, which would break the JSON.
+#define TRACE_RECORD_MAX (PATH_MAX + 1024)
+
+static int trace_fd = -1;
+static pid_t trace_pid;
+
+long long trace_timestamp(const struct timespec* ts) {
+  return (long long)ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+long long trace_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return trace_timestamp(&now);
+}
+
+static void create_trace_file(const char* path) {
+  int tmpfd;
+  mode_t mask;
+  char* tmpname = malloc(strlen(path) + 8);
+  if (tmpname == NULL) {
+    fprintf(stderr,"Failed to allocate memory. Aborting.\n");
+    exit(ERR_EXIT_CODE);
+  }
+  sprintf(tmpname, "%s.XXXXXX", path);
+  tmpfd = mkstemp(tmpname);
+  if (tmpfd < 0) {
+    fprintf(stderr,"Failed to create trace file %s: %s. Aborting.\n",
+            path, strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  // mkstemp always creates the file private, let others append too.
+  mask = umask(0);
+  umask(mask);
+  if (fchmod(tmpfd, 0666 & ~mask) != 0 ||
+      write(tmpfd, "[\n", 2) != 2) {
+    fprintf(stderr,"Failed to initialize trace file %s. Aborting.\n", path);
+    exit(ERR_EXIT_CODE);
+  }
+  close(tmpfd);
+  // if someone else won the race, their file is as good as ours.
+  if (link(tmpname, path) != 0 && errno != EEXIST) {
+    fprintf(stderr,"Failed to create trace file %s: %s. Aborting.\n",
+            path, strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  unlink(tmpname);
+  free(tmpname);
+}
+
+void trace_write(const char* record) {
+  if (trace_fd < 0) {
+    return;
+  }
+  // a short or failed write only loses this event, never the job.
+  if (write(trace_fd, record, strlen(record)) < 0) {
+    fprintf(stderr,"Failed to write trace event: %s.\n", strerror(errno));
+  }
+}
+
+// Writes a record formatted into a TRACE_RECORD_MAX buffer, unless
+// snprintf had to cut it.
+static void trace_write_checked(const char* record, int len) {
+  if (len < 0 || len >= TRACE_RECORD_MAX) {
+    fprintf(stderr,"Trace event too long, not written.\n");
+    return;
+  }
+  trace_write(record);
+}
+
+void trace_open(const char* path, const char* image) {
+  char record[TRACE_RECORD_MAX];
+  trace_fd = open(path, O_WRONLY | O_APPEND);
+  if (trace_fd < 0 && errno == ENOENT) {
+    create_trace_file(path);
+    trace_fd = open(path, O_WRONLY | O_APPEND);
+  }
+  if (trace_fd < 0) {
+    fprintf(stderr,"Failed to open trace file %s: %s. Aborting.\n",
+            path, strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  if (fcntl(trace_fd, F_SETFD, FD_CLOEXEC) != 0) {
+    fprintf(stderr,"Failed to set close-on-exec on trace file. Aborting.\n");
+    exit(ERR_EXIT_CODE);
+  }
+  trace_pid = getpid();
+  int len = snprintf(record, sizeof(record),
+           "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+           "\"args\":{\"name\":\"userchroot %s\"}},\n",
+           (int)trace_pid, image);
+  trace_write_checked(record, len);
+}
+
+void trace_complete(const char* name, pid_t tid, long long start,
+                    long long end, const char* args) {
+  char record[TRACE_RECORD_MAX];
+  if (trace_fd < 0) {
+    return;
+  }
+  int len = snprintf(record, sizeof(record),
+           "{\"name\":\"%s\",\"cat\":\"userchroot\",\"ph\":\"X\","
+           "\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d,"
+           "\"args\":{%s}},\n",
+           name, start, end - start, (int)trace_pid,
+           (int)(tid ? tid : trace_pid), args ? args : "");
+  trace_write_checked(record, len);
+}
+
+void trace_instant(const char* name, const char* args) {
+  char record[TRACE_RECORD_MAX];
+  if (trace_fd < 0) {
+    return;
+  }
+  int len = snprintf(record, sizeof(record),
+           "{\"name\":\"%s\",\"cat\":\"userchroot\",\"ph\":\"i\",\"s\":\"p\","
+           "\"ts\":%lld,\"pid\":%d,\"tid\":%d,\"args\":{%s}},\n",
+           name, trace_now(), (int)trace_pid, (int)trace_pid,
+           args ? args : "");
+  trace_write_checked(record, len);
+}
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
@@ -0,0 +1,29 @@
+#include <sys/types.h>
+#include <time.h>
+
+// the longest command name put in the args of a trace event.
+#define TRACE_COMMAND_MAX 256
+
+void trace_open(const char* path, const char* image);
+void trace_write(const char* record);
+void trace_complete(const char* name, pid_t tid, long long start,
+                    long long end, const char* args);
+void trace_instant(const char* name, const char* args);
+long long trace_timestamp(const struct timespec* ts);
+long long trace_now();
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
@@ -0,0 +1,353 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#endif
+
+#include "userchroot.h"
+#include "tree.h"
+
+/*
+ * Copies a tree between two directories given as file descriptors.
+ * Directories and symbolic links are created while walking the
+ * source, the regular files are then copied by a pool of threads,
+ * with copy_file_range where available so the data doesn't go
+ * through user space, or as reflinks on filesystems that have them.
+ * Anything else, like sockets or devices, is skipped.
+ *
+ * Nothing here needs privileges: it runs as the calling user, after
+ * the privileges were given up. Removal also runs as root, to evict
+ * workspaces, so it never follows a link nor leaves the filesystem.
+ */
+
+#define TREE_BUFFER 65536
+// the deepest a removal descends, with a descriptor open per level.
+#define TREE_DEPTH_MAX 128
+
+#if defined(__linux__) && !defined(FICLONE)
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+struct tree_file {
+  char* path;
+  mode_t mode;
+};
+
+struct tree_copy_state {
+  int src_dir;
+  int dst_dir;
+  struct tree_file* files;
+  int count;
+  int next;
+  int failed;
+  pthread_mutex_t lock;
+};
+
+static void tree_error(const char* what, const char* path) {
+  fprintf(stderr,"Failed to %s %s: %s.\n", what, path, strerror(errno));
+}
+
+static char* join(const char* dir, const char* name) {
+  char* path = malloc(strlen(dir) + strlen(name) + 2);
+  if (path == NULL) {
+    fprintf(stderr,"Failed to allocate memory. Aborting.\n");
+    exit(ERR_EXIT_CODE);
+  }
+  sprintf(path, "%s/%s", dir, name);
+  return path;
+}
+
+// Walks path, creating directories and links under dst_dir and
+// adding the regular files to the state. Returns 0 on success.
+static int tree_walk(struct tree_copy_state* st, const char* path) {
+  struct stat sb;
+  if (fstatat(st->src_dir, path, &sb, AT_SYMLINK_NOFOLLOW) != 0) {
+    tree_error("stat", path);
+    return -1;
+  }
+  if (S_ISREG(sb.st_mode)) {
+    if (st->count % 256 == 0) {
+      st->files = realloc(st->files, (st->count + 256) * sizeof(*st->files));
+      if (st->files == NULL) {
+        fprintf(stderr,"Failed to allocate memory. Aborting.\n");
+        exit(ERR_EXIT_CODE);
+      }
+    }
+    st->files[st->count].path = strdup(path);
+    if (st->files[st->count].path == NULL) {
+      fprintf(stderr,"Failed to allocate memory. Aborting.\n");
+      exit(ERR_EXIT_CODE);
+    }
+    st->files[st->count].mode = sb.st_mode & 07777;
+    st->count++;
+    return 0;
+  }
+  if (S_ISLNK(sb.st_mode)) {
+    char target[4096];
+    ssize_t len = readlinkat(st->src_dir, path, target, sizeof(target) - 1);
+    if (len < 0) {
+      tree_error("read link", path);
+      return -1;
+    }
+    target[len] = 0;
+    unlinkat(st->dst_dir, path, 0);
+    if (symlinkat(target, st->dst_dir, path) != 0) {
+      tree_error("create link", path);
+      return -1;
+    }
+    return 0;
+  }
+  if (!S_ISDIR(sb.st_mode)) {
+    return 0;
+  }
+
+  if (mkdirat(st->dst_dir, path, sb.st_mode & 07777) != 0 &&
+      errno != EEXIST) {
+    tree_error("create directory", path);
+    return -1;
+  }
+  int fd = openat(st->src_dir, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+  DIR* dir = fd < 0 ? NULL : fdopendir(fd);
+  if (dir == NULL) {
+    tree_error("open directory", path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  int rc = 0;
+  struct dirent* de;
+  while (rc == 0 && (de = readdir(dir)) != NULL) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+      continue;
+    }
+    char* child = join(path, de->d_name);
+    rc = tree_walk(st, child);
+    free(child);
+  }
+  closedir(dir);
+  return rc;
+}
+
+static int copy_data(int in, int out) {
+  char buf[TREE_BUFFER];
+  ssize_t n;
+#ifdef __linux__
+  // on btrfs or XFS, the copy shares the blocks of the file until
+  // either is written to.
+  if (ioctl(out, FICLONE, in) == 0) {
+    return 0;
+  }
+  // falls back to read and write where the kernel can't do it, e.g.
+  // across filesystems on older kernels.
+  while ((n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) > 0) {
+  }
+  if (n == 0) {
+    return 0;
+  }
+  if (errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+      errno != EOPNOTSUPP) {
+    return -1;
+  }
+#endif
+  while ((n = read(in, buf, sizeof(buf))) > 0) {
+    char* p = buf;
+    while (n > 0) {
+      ssize_t w = write(out, p, n);
+      if (w < 0) {
+        return -1;
+      }
+      p += w;
+      n -= w;
+    }
+  }
+  return n < 0 ? -1 : 0;
+}
+
+static void* copy_files(void* arg) {
+  struct tree_copy_state* st = arg;
+  for (;;) {
+    pthread_mutex_lock(&st->lock);
+    int i = st->failed ? st->count : st->next++;
+    pthread_mutex_unlock(&st->lock);
+    if (i >= st->count) {
+      return NULL;
+    }
+    struct tree_file* f = &st->files[i];
+    int rc = -1;
+    int in = openat(st->src_dir, f->path, O_RDONLY | O_NOFOLLOW);
+    int out = openat(st->dst_dir, f->path,
+                     O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, f->mode);
+    if (in >= 0 && out >= 0) {
+      rc = copy_data(in, out);
+    }
+    if (rc != 0) {
+      tree_error("copy", f->path);
+      pthread_mutex_lock(&st->lock);
+      st->failed = 1;
+      pthread_mutex_unlock(&st->lock);
+    }
+    if (in >= 0) {
+      close(in);
+    }
+    if (out >= 0) {
+      close(out);
+    }
+  }
+}
+
+struct tree_remove_state {
+  int top_fd;
+  dev_t dev;
+  int moved;
+};
+
+// The name a directory too deep to remove in place gets in top_fd.
+static void moved_name(char* name, size_t len, int n) {
+  snprintf(name, len, "@removing.%d.%d", (int)getpid(), n);
+}
+
+static int remove_at(struct tree_remove_state* st, int dir_fd,
+                     const char* name, int depth) {
+  struct stat sb;
+  if (fstatat(dir_fd, name, &sb, AT_SYMLINK_NOFOLLOW) != 0) {
+    return -1;
+  }
+  if (!S_ISDIR(sb.st_mode)) {
+    return unlinkat(dir_fd, name, 0);
+  }
+  if (sb.st_dev != st->dev) {
+    return -1;
+  }
+  if (depth == TREE_DEPTH_MAX) {
+    // removed from the top later, so that however deep the tree, no
+    // more than TREE_DEPTH_MAX descriptors are ever open.
+    char moved[64];
+    moved_name(moved, sizeof(moved), st->moved++);
+    return renameat(dir_fd, name, st->top_fd, moved);
+  }
+  int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+                  O_CLOEXEC);
+  DIR* dir = fd < 0 ? NULL : fdopendir(fd);
+  if (dir == NULL) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  int rc = 0;
+  struct dirent* de;
+  while ((de = readdir(dir)) != NULL) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+      continue;
+    }
+    if (remove_at(st, fd, de->d_name, depth + 1) != 0) {
+      rc = -1;
+    }
+  }
+  closedir(dir);
+  if (rc == 0) {
+    rc = unlinkat(dir_fd, name, AT_REMOVEDIR);
+  }
+  return rc;
+}
+
+// Removes 'name' in dir_fd and everything below it, never following
+// links nor crossing into another filesystem. Directories deeper than
+// TREE_DEPTH_MAX are first moved to dir_fd, under a name with a '@'.
+// Returns 0 on success.
+int tree_remove(int dir_fd, const char* name, dev_t dev) {
+  struct tree_remove_state st = { dir_fd, dev, 0 };
+  char moved[64];
+  int i;
+  int rc = remove_at(&st, dir_fd, name, 0);
+  for (i = 0; i < st.moved; i++) {
+    moved_name(moved, sizeof(moved), i);
+    if (remove_at(&st, dir_fd, moved, 0) != 0) {
+      rc = -1;
+    }
+  }
+  return rc;
+}
+
+// Copies path, relative to src_dir, to the same path relative to
+// dst_dir, creating the missing parent directories. Existing files
+// are overwritten, existing directories merged. Returns 0 on success;
+// failures are reported on stderr.
+int tree_copy(int src_dir, int dst_dir, const char* path, int threads) {
+  struct tree_copy_state st;
+  int i;
+  memset(&st, 0, sizeof(st));
+  st.src_dir = src_dir;
+  st.dst_dir = dst_dir;
+  pthread_mutex_init(&st.lock, NULL);
+
+  char* parent = strdup(path);
+  char* slash = parent;
+  while (parent != NULL && (slash = strchr(slash, '/')) != NULL) {
+    *slash = 0;
+    if (mkdirat(dst_dir, parent, 0755) != 0 && errno != EEXIST) {
+      tree_error("create directory", parent);
+      free(parent);
+      return -1;
+    }
+    *slash++ = '/';
+  }
+  free(parent);
+
+  int rc = tree_walk(&st, path);
+  if (rc == 0) {
+    pthread_t* pool = malloc(threads * sizeof(pthread_t));
+    int started = 0;
+    if (threads > st.count) {
+      threads = st.count;
+    }
+    for (i = 0; pool != NULL && i < threads; i++) {
+      if (pthread_create(&pool[i], NULL, copy_files, &st) != 0) {
+        break;
+      }
+      started++;
+    }
+    // whatever is left is done by this thread.
+    copy_files(&st);
+    for (i = 0; i < started; i++) {
+      pthread_join(pool[i], NULL);
+    }
+    free(pool);
+    rc = st.failed ? -1 : 0;
+  }
+  for (i = 0; i < st.count; i++) {
+    free(st.files[i].path);
+  }
+  free(st.files);
+  pthread_mutex_destroy(&st.lock);
+  return rc;
+}
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
@@ -0,0 +1,79 @@
+#!/bin/bash -e
+#
+# Holds the host-wide jobserver used by "userchroot --jobserver": a
+# FIFO owned by root, filled with one token per job slot. A FIFO loses
+# its contents once nobody has it open, so this keeps it open for as
+# long as it runs; run it as root from the init system.
+#
+# usage: userchroot-jobserver.sh [FIFO [SLOTS]]
+#
+# FIFO defaults to /run/userchroot-jobserver, which is where userchroot
+# looks unless it was built with another JOBSERVER_FIFO. SLOTS defaults
+# to the number of CPUs. Every make also runs one job without a token,
+# so each build started adds one to what runs at once.
+#
+# A job killed while it holds tokens never returns them. Every
+# JOBSERVER_TOPUP_INTERVAL seconds (60 by default), if no other process
+# has the FIFO open, and so no token can be held, the FIFO is drained
+# and filled with SLOTS tokens again.
+
+FIFO=${1:-/run/userchroot-jobserver}
+SLOTS=${2:-$(nproc)}
+INTERVAL=${JOBSERVER_TOPUP_INTERVAL:-60}
+
+if [ "$(id -u)" != 0 ]; then
+  echo "userchroot-jobserver.sh must run as root." >&2
+  exit 1
+fi
+
+rm -f "$FIFO"
+mkfifo -m 600 "$FIFO"
+# as /proc shows it in the descriptors of the processes using it.
+FIFO=$(readlink -f "$FIFO")
+exec 3<> "$FIFO"
+
+tokens() {
+  head -c "$1" /dev/zero | tr '\0' + >&3
+}
+
+# Whether a process other than this one has the FIFO open; run with
+# the descriptor closed, so that its own children don't count.
+in_use() {
+  find /proc/[0-9]*/fd -lname "$FIFO" 2> /dev/null |
+    grep -qv "^/proc/$$/"
+}
+
+tokens "$SLOTS"
+# the tokens stay in the FIFO for as long as this holds it open.
+trap 'kill $sleeper 2> /dev/null; exit 0' TERM INT
+while :; do
+  sleep "$INTERVAL" 3>&- &
+  sleeper=$!
+  wait $sleeper
+  if ! in_use 3>&-; then
+    held=$(dd if="$FIFO" iflag=nonblock bs=65536 count=1 2> /dev/null |
+           wc -c)
+    # someone may have opened it meanwhile, and taken a token.
+    if in_use 3>&-; then
+      tokens "$held"
+    else
+      tokens "$SLOTS"
+    fi
+  fi
+done
+
+# ----------------------------------------------------------------------------
+# Copyright 2015 Bloomberg Finance L.P.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+# ----------------------------- END-OF-FILE ----------------------------------
@@ -6,8 +6,29 @@
 #include <pwd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <limits.h>
 #include "userchroot.h"
 #include "fundamental_devices.h"
+#include "supervise.h"
+#include "config.h"
+#include "top.h"
+#include "trace.h"
+#include "record.h"
+#include "worker.h"
+#include "pipeline.h"
+#include "output.h"
+#include "namespaces.h"
+#include "cpus.h"
+#include "publish.h"
+#include "passfd.h"
+#include "pressure.h"
+#include "golden.h"
+#include "ephemeral.h"
+#include "jobserver.h"
+#include "cgroup.h"
+#include "workspace.h"
+#include "shm_size.h"
 
 /*
  * The userchroot utility will call chroot for one specific directory
@@ -54,10 +75,14 @@ static const char CFG[] = EXPANDED(CONFIGFILE);
 #endif
 static const char VERSION[] = EXPANDED(VERSION_STRING);
 
-#define USAGESTR "usage: userchroot path <--install-devices|--uninstall-devices|command ...>\n"
+#define USAGESTR "usage: userchroot [--supervise] [--match-cpus] [--jobserver] [--pass-dir=PATH:FD]... [--max-pressure=memory:PCT,io:PCT [--pressure-wait=SECONDS]] [--trace-file=FILE] [--record=FILE] [--output-tmpfs=DIR[:SIZE] [--keep=PATH]...] [--workspace=NAME:DIR] path <--install-devices|--uninstall-devices|command ...>\n" \
+                 "       userchroot path <--publish staging|--collect-generations|--install-golden|--uninstall-golden>\n" \
+                 "       userchroot --pipeline[=DELIMITER] [--pipefail] [--match-cpus] [--jobserver] [--pass-dir=PATH:FD]... [--max-pressure=memory:PCT,io:PCT [--pressure-wait=SECONDS]] [--trace-file=FILE] path command ... '|' command ...\n" \
+                 "       userchroot --worker[=proto|json] [--recycle-after=N] [--match-cpus] [--jobserver] [--pass-dir=PATH:FD]... [--max-pressure=memory:PCT,io:PCT [--pressure-wait=SECONDS]] [--trace-file=FILE] path command ...\n" \
+                 "       userchroot <--top|--top-json>\n"
 #define USAGE() fprintf(stderr,USAGESTR);exit(ERR_EXIT_CODE);
 
-static void whitelist_char_check(const char* str, int allow_slashes) {
+int whitelisted_path(const char* str, int allow_slashes) {
   // whitelist the characters on paths...
   int len = strlen(str);
   int i;
@@ -76,13 +101,20 @@ static void whitelist_char_check(const char* str, int allow_slashes) {
     } else if (allow_slashes && c == '/') {
       continue;
     } else {
-      fprintf(stderr,"Path %s contains non-whitelisted characters. Aborting.\n", str);
-      exit(ERR_EXIT_CODE);
+      return 0;
     }
   }
+  return 1;
+}
+
+static void whitelist_char_check(const char* str, int allow_slashes) {
+  if (!whitelisted_path(str, allow_slashes)) {
+    fprintf(stderr,"Path %s contains non-whitelisted characters. Aborting.\n", str);
+    exit(ERR_EXIT_CODE);
+  }
 }
 
-static void check_base_path(const char* path) {
+void check_base_path(const char* path) {
   int rc; // generic return code checking
   // let's make sure the entire path up to the the given path is owned
   // and only writable by root
@@ -209,6 +241,9 @@ static void portable_clearenv() {
 }
 
 int main(int argc, char* argv[], char* envp[]) {
+  long long started = trace_now();
+  struct timespec arrival;
+  clock_gettime(CLOCK_REALTIME, &arrival);
   portable_clearenv();
   int rc; // generic return code checking
 
@@ -229,6 +264,136 @@ int main(int argc, char* argv[], char* envp[]) {
     exit(ERR_EXIT_CODE);
   }
 
+  // options for the launch come before the path, so that everything
+  // after the path is still the command, untouched.
+  int supervise = 0;
+  int top = 0;
+  int top_json = 0;
+  const char* trace_path = NULL;
+  const char* record_path = NULL;
+  int worker = 0;
+  int worker_framing = WORKER_PROTO;
+  int recycle_after = 0;
+  const char* pipeline = NULL;
+  int pipefail = 0;
+  int match_cpus = 0;
+  int jobserver = 0;
+  int pass_dirs = 0;
+  struct pressure_limits pressure_limits;
+  pressure_init(&pressure_limits);
+  char* output_dir = NULL;
+  const char* output_size = NULL;
+  int output_fd = -1;
+  char* workspace_name = NULL;
+  char* workspace_dir = NULL;
+  int workspace_target = -1;
+  char** keep = calloc(argc, sizeof(char*));
+  int nkeep = 0;
+  if (keep == NULL) {
+    fprintf(stderr,"Failed to allocate memory. Aborting.\n");
+    exit(ERR_EXIT_CODE);
+  }
+  while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+    if (strcmp(argv[1], "--supervise") == 0) {
+      supervise = 1;
+    } else if (strcmp(argv[1], "--top") == 0) {
+      top = 1;
+    } else if (strcmp(argv[1], "--top-json") == 0) {
+      top = 1;
+      top_json = 1;
+    } else if (strncmp(argv[1], "--trace-file=", 13) == 0) {
+      trace_path = argv[1] + 13;
+    } else if (strncmp(argv[1], "--record=", 9) == 0) {
+      record_path = argv[1] + 9;
+    } else if (strcmp(argv[1], "--worker") == 0 ||
+               strcmp(argv[1], "--worker=proto") == 0) {
+      worker = 1;
+    } else if (strcmp(argv[1], "--worker=json") == 0) {
+      worker = 1;
+      worker_framing = WORKER_JSON;
+    } else if (strncmp(argv[1], "--recycle-after=", 16) == 0) {
+      char* end;
+      errno = 0;
+      long n = strtol(argv[1] + 16, &end, 10);
+      if (end == argv[1] + 16 || *end != 0 || errno != 0 || n < 1 ||
+          n > INT_MAX) {
+        USAGE();
+      }
+      recycle_after = (int)n;
+    } else if (strcmp(argv[1], "--pipeline") == 0) {
+      pipeline = "|";
+    } else if (strncmp(argv[1], "--pipeline=", 11) == 0 && argv[1][11]) {
+      pipeline = argv[1] + 11;
+    } else if (strcmp(argv[1], "--pipefail") == 0) {
+      pipefail = 1;
+    } else if (strcmp(argv[1], "--match-cpus") == 0) {
+      match_cpus = 1;
+    } else if (strcmp(argv[1], "--jobserver") == 0) {
+      jobserver = 1;
+    } else if (strncmp(argv[1], "--pass-dir=", 11) == 0) {
+      if (passfd_parse(argv[1] + 11) != 0) {
+        fprintf(stderr,"Invalid directory to pass %s. Aborting.\n",
+                argv[1] + 11);
+        exit(ERR_EXIT_CODE);
+      }
+      pass_dirs = 1;
+    } else if (strncmp(argv[1], "--max-pressure=", 15) == 0) {
+      if (pressure_parse(argv[1] + 15, &pressure_limits) != 0) {
+        USAGE();
+      }
+    } else if (strncmp(argv[1], "--pressure-wait=", 16) == 0) {
+      char* end;
+      double seconds = strtod(argv[1] + 16, &end);
+      // the comparison is false for NaN too.
+      if (end == argv[1] + 16 || *end != 0 || !(seconds >= 0)) {
+        USAGE();
+      }
+      pressure_limits.max_wait = seconds;
+    } else if (strncmp(argv[1], "--output-tmpfs=", 15) == 0) {
+      output_dir = argv[1] + 15;
+      char* colon = strchr(output_dir, ':');
+      if (colon != NULL) {
+        *colon = 0;
+        output_size = colon + 1;
+      }
+    } else if (strncmp(argv[1], "--workspace=", 12) == 0) {
+      workspace_name = argv[1] + 12;
+      workspace_dir = strchr(workspace_name, ':');
+      if (workspace_dir == NULL) {
+        USAGE();
+      }
+      *workspace_dir++ = 0;
+      if (workspace_name[0] == 0 || workspace_name[0] == '.' ||
+          !whitelisted_path(workspace_name, 0)) {
+        fprintf(stderr,"Invalid workspace name %s. Aborting.\n",
+                workspace_name);
+        exit(ERR_EXIT_CODE);
+      }
+    } else if (strncmp(argv[1], "--keep=", 7) == 0) {
+      if (!output_valid_keep(argv[1] + 7)) {
+        fprintf(stderr,"Invalid path to keep %s. Aborting.\n", argv[1] + 7);
+        exit(ERR_EXIT_CODE);
+      }
+      keep[nkeep++] = argv[1] + 7;
+    } else {
+      USAGE();
+    }
+    argc--; argv++;
+  }
+  // a worker runs for as long as the build does and a pipeline is
+  // many commands, there is no single command to supervise or record.
+  if ((worker || pipeline != NULL) && (supervise || record_path != NULL)) {
+    USAGE();
+  }
+  if ((worker && pipeline != NULL) || (pipefail && pipeline == NULL)) {
+    USAGE();
+  }
+  if (((output_dir != NULL || workspace_name != NULL) &&
+       (worker || pipeline != NULL)) ||
+      (nkeep > 0 && output_dir == NULL)) {
+    USAGE();
+  }
+
   // we open the config file first to avoid time-of-check-time-of-use
   // race conditions. The file is sent to check_config_file to make
   // sure we actually opened the same file that we are stat-ing.
@@ -239,6 +404,10 @@ int main(int argc, char* argv[], char* envp[]) {
   }
   check_config_file(config);
 
+  if (top) {
+    exit(top_run(config, top_json));
+  }
+
   // let's get the path
   char* path;
   if (argc < 3) {
@@ -350,35 +519,8 @@ int main(int argc, char* argv[], char* envp[]) {
   }
 
   // Now we look for this exact string in the configuration file.
-  // we're going to use fgets, which will return the next line or up
-  // to the buffer limit, that means that if a line is bigger then the
-  // buffer, it will go another pass.
-  //
-  // we're going to set the buffer to the same as our desired line,
-  // since we don't care of anything bigger than that.
-  char *rline = malloc(linelen);
-  if (rline == NULL) {
-    fprintf(stderr,"Failed to allocate memory. Aborting.\n");
-    exit(ERR_EXIT_CODE);
-  }
-
-  int found = 0;
-  while (feof(config) == 0 &&
-         fgets(rline, linelen, config) != NULL) {
-    int ignore = 0;
-    while (strchr(rline, '\n') == NULL) {
-      // we want to ignore lines bigger than linelen...
-      // so we will continue to consume until we find a line break.
-      ignore = 1;
-      if (feof(config) || fgets(rline, linelen, config) == NULL) {
-        break;
-      }
-    }
-    if (!ignore && strncmp(line, rline, linelen) == 0) {
-      found = 1;
-      break;
-    }
-  }
+  char* options;
+  int found = config_has_entry(config, line, linelen, &options);
   if (fclose(config)) {
     fprintf(stderr,"Failed to close configuration file. Aborting.\n");
     exit(ERR_EXIT_CODE);
@@ -387,6 +529,8 @@ int main(int argc, char* argv[], char* envp[]) {
     fprintf(stderr,"Permission Denied. Aborting.\n");
     exit(ERR_EXIT_CODE);
   }
+  struct image_options image_options;
+  config_parse_options(options, &image_options);
 
   // If we got to this point it means we're clear to go.
   int path_len = strlen(base_path)+strlen(relative_path)+2;
@@ -400,6 +544,45 @@ int main(int argc, char* argv[], char* envp[]) {
     fprintf(stderr,"Failed to assemble path. Aborting.\n");
     exit(ERR_EXIT_CODE);
   }
+  long long validated = trace_now();
+
+  if ((output_dir != NULL || workspace_name != NULL || match_cpus ||
+       image_options.ephemeral) && argv[2][0] != '-') {
+    namespaces_private_mounts();
+  }
+  if (trace_path != NULL || record_path != NULL ||
+      ((output_dir != NULL || workspace_name != NULL || pass_dirs) &&
+       argv[2][0] != '-')) {
+    // the trace and record files, the output and workspace directories
+    // and the directories to pass belong to the caller, so they are
+    // opened with the caller's own permissions.
+    if (seteuid(target_user) != 0) {
+      fprintf(stderr,"Failed to switch to the calling user. Aborting.\n");
+      exit(ERR_EXIT_CODE);
+    }
+    if (trace_path != NULL) {
+      trace_open(trace_path, final_path);
+    }
+    if (record_path != NULL) {
+      record_open(record_path);
+    }
+    if (output_dir != NULL && argv[2][0] != '-') {
+      output_fd = output_open(final_path, output_dir, target_user,
+                              "output directory");
+    }
+    if (workspace_name != NULL && argv[2][0] != '-') {
+      workspace_target = output_open(final_path, workspace_dir, target_user,
+                                     "workspace directory");
+    }
+    if (pass_dirs && argv[2][0] != '-') {
+      passfd_open();
+    }
+    if (seteuid(0) != 0) {
+      fprintf(stderr,"Failed to regain privileges. Aborting.\n");
+      exit(ERR_EXIT_CODE);
+    }
+    trace_complete("validate", 0, started, validated, NULL);
+  }
 
   // lame but efficient argument parsing
   if (argc >= 3 &&
@@ -414,9 +597,44 @@ int main(int argc, char* argv[], char* envp[]) {
 
     if (strncmp("--install-devices",argv[2],17) == 0) {
       rc = create_fundamental_devices(final_path);
+      trace_complete("install-devices", 0, validated, trace_now(), NULL);
       exit(rc);
     } else if (strncmp("--uninstall-devices",argv[2],19) == 0) {
       rc = unlink_fundamental_devices(final_path);
+      trace_complete("uninstall-devices", 0, validated, trace_now(), NULL);
+      exit(rc);
+    } else if (strcmp("--publish",argv[2]) == 0 && argc == 4) {
+      whitelist_char_check(argv[3], 1);
+      const char* staging = publish_check_staging(base_path, relative_path,
+                                                  argv[3],
+                                                  statbase_path.st_uid);
+      rc = publish_image(base_path, relative_path, staging,
+                         statbase_path.st_uid);
+      trace_complete("publish", 0, validated, trace_now(), NULL);
+      exit(rc);
+    } else if (strcmp("--collect-generations",argv[2]) == 0) {
+      rc = collect_generations(base_path, relative_path,
+                               statbase_path.st_uid);
+      trace_complete("collect-generations", 0, validated, trace_now(), NULL);
+      exit(rc);
+    } else if (strcmp("--install-golden",argv[2]) == 0) {
+      if (image_options.golden == NULL) {
+        fprintf(stderr,"No golden images are configured for %s. Aborting.\n",
+                base_path);
+        exit(ERR_EXIT_CODE);
+      }
+      rc = golden_install(base_path, relative_path, image_options.golden,
+                          statbase_path.st_uid, pwent->pw_gid);
+      trace_complete("install-golden", 0, validated, trace_now(), NULL);
+      exit(rc);
+    } else if (strcmp("--uninstall-golden",argv[2]) == 0) {
+      if (image_options.golden == NULL) {
+        fprintf(stderr,"No golden images are configured for %s. Aborting.\n",
+                base_path);
+        exit(ERR_EXIT_CODE);
+      }
+      rc = golden_uninstall(base_path, relative_path, image_options.golden);
+      trace_complete("uninstall-golden", 0, validated, trace_now(), NULL);
       exit(rc);
     } else {
       USAGE();
@@ -424,14 +642,62 @@ int main(int argc, char* argv[], char* envp[]) {
     }
   } else {
 
+    // the command gets the jobserver, the record keeps what the
+    // caller asked for.
+    char** job_envp = envp;
+    if (jobserver) {
+      jobserver_open();
+      job_envp = jobserver_environment(envp);
+    }
+
+    double waited = pressure_wait(&pressure_limits);
+    // keeps the tree of the image from being collected as an old
+    // generation until the job has it as its root, or, for an
+    // ephemeral image, until userchroot is done waiting for the job.
+    int image_fd = publish_hold(final_path);
+    cgroup_enter(base_path, &image_options);
+    // before the job's own mounts, one of which could be on /dev/shm.
+    shm_size_grow(final_path);
+
+    if (output_dir != NULL) {
+      output_mount(output_fd, output_size, target_user, getgid());
+    }
+    if (workspace_name != NULL) {
+      if (image_options.workspaces == NULL) {
+        fprintf(stderr,"No workspaces are configured for %s. Aborting.\n",
+                base_path);
+        exit(ERR_EXIT_CODE);
+      }
+      long long restore = trace_now();
+      workspace_enter(&image_options, final_path, workspace_name,
+                      workspace_target, target_user);
+      trace_complete("workspace-restore", 0, restore, trace_now(), NULL);
+    }
+    // the job's root, unless the image is ephemeral, is the tree that
+    // publish_hold locked, where it locked one.
+    char* root_path = final_path;
+#ifdef __linux__
+    char image_proc[64];
+    snprintf(image_proc, sizeof(image_proc), "/proc/self/fd/%d", image_fd);
+    root_path = image_proc;
+#endif
+    if (image_options.ephemeral) {
+      root_path = ephemeral_mount(final_path, image_fd,
+                                  image_options.ephemeral_size);
+    }
+    namespaces_enter(image_options.namespaces);
+    if (match_cpus) {
+      cpus_match(root_path);
+    }
+
     // move to the chroot path before doing the chroot.
-    rc = chdir(final_path);
+    rc = chdir(root_path);
     if (rc != 0) {
       fprintf(stderr,"Failed to chdir to the chroot directory. Aborting.\n");
       exit(ERR_EXIT_CODE);
     }
     // Now the actual chroot call.
-    rc = chroot(final_path);
+    rc = chroot(root_path);
     if (rc != 0) {
       fprintf(stderr,"Failed to chroot. Aborting.\n");
       exit(ERR_EXIT_CODE);
@@ -468,7 +734,67 @@ int main(int argc, char* argv[], char* envp[]) {
     // we skip the first two arguments from argv and do a execve.
     argv++;argv++;
     whitelist_char_check(argv[0], 1);
-    execve(argv[0],argv,envp);
+    trace_complete("chroot", 0, validated, trace_now(), NULL);
+    if (worker) {
+      exit(worker_run(argv, job_envp, worker_framing, recycle_after));
+    }
+    if (pipeline != NULL) {
+      trace_instant("pipeline", NULL);
+      exit(pipeline_run(argv, job_envp, pipeline, pipefail));
+    }
+    // recording needs to know how long the command ran, the results
+    // of an output tmpfs are written back and a workspace is saved
+    // after it exits, and an ephemeral image is held by us until then,
+    // so all of them imply supervision.
+    if (supervise || record_path != NULL || output_dir != NULL ||
+        workspace_name != NULL || image_options.ephemeral) {
+      struct job_report report;
+      char trace_args[512];
+      supervise_command(argv, job_envp, &report);
+      report.waited_seconds = waited;
+      if (supervise) {
+        supervise_print_report(argv[0], &report);
+      }
+      record_launch(&arrival, final_path, argv, envp, report.real_seconds,
+                    supervise_exit_code(report.status));
+      // the command is shortened so that the numbers after it always
+      // fit; a cut in the middle of the arguments would break the JSON.
+      snprintf(trace_args, sizeof(trace_args),
+               "\"command\":\"%.*s\",\"exit_code\":%d,"
+               "\"user_ms\":%ld,\"sys_ms\":%ld,\"max_rss_kb\":%ld,"
+               "\"major_faults\":%ld,\"minor_faults\":%ld",
+               TRACE_COMMAND_MAX, argv[0],
+               supervise_exit_code(report.status),
+               (long)report.usage.ru_utime.tv_sec * 1000 +
+               (long)report.usage.ru_utime.tv_usec / 1000,
+               (long)report.usage.ru_stime.tv_sec * 1000 +
+               (long)report.usage.ru_stime.tv_usec / 1000,
+               report.usage.ru_maxrss, report.usage.ru_majflt,
+               report.usage.ru_minflt);
+      trace_complete("run", report.pid, trace_timestamp(&report.start),
+                     trace_now(), trace_args);
+      int code = supervise_exit_code(report.status);
+      if (output_dir != NULL && code == 0) {
+        long long write_back = trace_now();
+        if (output_write_back(output_dir, output_fd, keep, nkeep) != 0) {
+          fprintf(stderr,"Failed to write back the results. Aborting.\n");
+          code = ERR_EXIT_CODE;
+        }
+        trace_complete("write-back", 0, write_back, trace_now(), NULL);
+      }
+      if (workspace_name != NULL && code == 0) {
+        long long save = trace_now();
+        if (workspace_save() != 0) {
+          fprintf(stderr,"Failed to save the workspace. Aborting.\n");
+          code = ERR_EXIT_CODE;
+        }
+        trace_complete("workspace-save", 0, save, trace_now(), NULL);
+      }
+      exit(code);
+    }
+    trace_instant("exec", NULL);
+    passfd_install();
+    execve(argv[0],argv,job_envp);
     // if we are here, it means something went wrong.
     fprintf(stderr,"Failed to exec %s: %s\n", argv[0], strerror(errno));
     exit(ERR_EXIT_CODE);
@@ -1 +1,7 @@
 #define ERR_EXIT_CODE 125
+// the launch was deferred because of memory or io pressure, as
+// EX_TEMPFAIL in sysexits.h.
+#define DEFERRED_EXIT_CODE 75
+
+int whitelisted_path(const char* str, int allow_slashes);
+void check_base_path(const char* path);
@@ -0,0 +1,283 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#include "userchroot.h"
+#include "worker.h"
+#include "trace.h"
+#include "passfd.h"
+
+/*
+ * Persistent worker mode. Build systems like Bazel keep compilers
+ * running across actions, sending them one request after the other on
+ * stdin and reading the responses on stdout. In this mode userchroot
+ * is that long-lived process: it starts the command inside the image
+ * and relays each request from the build system to it, and each
+ * response back, so the command starts once instead of once per
+ * action.
+ *
+ * Messages are relayed as they are, only their framing is looked at:
+ * either a protocol buffer preceded by its size as a varint, or a
+ * line of JSON. Requests are handled one at a time.
+ *
+ * If the worker dies before answering, it is started again and the
+ * request sent once more; a request that kills two workers in a row
+ * ends the whole process, which the build system handles as a crashed
+ * worker. With recycle_after set, the worker is also replaced after
+ * answering that many requests, to bound whatever it accumulates.
+ *
+ * By the time we get here the chroot has happened and the privileges
+ * were already given up.
+ */
+
+#define WORKER_BUFFER 65536
+
+// how long a worker has to exit on its own once its stdin is closed,
+// in milliseconds, before it gets SIGTERM.
+#ifndef WORKER_GRACE_MS
+#define WORKER_GRACE_MS 2000
+#endif
+#define WORKER_POLL_MS 10
+
+struct reader {
+  int fd;
+  char buf[WORKER_BUFFER];
+  size_t start;
+  size_t end;
+};
+
+struct message {
+  char* data;
+  size_t len;
+  size_t cap;
+};
+
+struct worker {
+  pid_t pid;
+  int to;               // the worker's stdin
+  struct reader from;   // the worker's stdout
+};
+
+// Returns the next byte from the reader, or -1 at the end of the
+// stream or on error.
+static int reader_byte(struct reader* r) {
+  if (r->start == r->end) {
+    ssize_t n;
+    do {
+      n = read(r->fd, r->buf, sizeof(r->buf));
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+      return -1;
+    }
+    r->start = 0;
+    r->end = n;
+  }
+  return (unsigned char)r->buf[r->start++];
+}
+
+static void message_append(struct message* m, char c) {
+  if (m->len == m->cap) {
+    m->cap = m->cap ? m->cap * 2 : WORKER_BUFFER;
+    m->data = realloc(m->data, m->cap);
+    if (m->data == NULL) {
+      fprintf(stderr,"Failed to allocate memory. Aborting.\n");
+      exit(ERR_EXIT_CODE);
+    }
+  }
+  m->data[m->len++] = c;
+}
+
+// Reads a whole message, framing included, into m. Returns 1 on
+// success, 0 if the stream ended cleanly before a new message and -1
+// if it ended in the middle of one.
+static int read_message(struct reader* r, int framing, struct message* m) {
+  int c;
+  m->len = 0;
+  if (framing == WORKER_JSON) {
+    while ((c = reader_byte(r)) >= 0) {
+      message_append(m, c);
+      if (c == '\n') {
+        return 1;
+      }
+    }
+    return m->len == 0 ? 0 : -1;
+  }
+
+  unsigned long long size = 0;
+  int shift = 0;
+  do {
+    c = reader_byte(r);
+    if (c < 0) {
+      return m->len == 0 ? 0 : -1;
+    }
+    if (shift > 56) {
+      fprintf(stderr,"Invalid message size in worker protocol. Aborting.\n");
+      exit(ERR_EXIT_CODE);
+    }
+    message_append(m, c);
+    size |= (unsigned long long)(c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+  while (size-- > 0) {
+    if ((c = reader_byte(r)) < 0) {
+      return -1;
+    }
+    message_append(m, c);
+  }
+  return 1;
+}
+
+static int write_message(int fd, const struct message* m) {
+  size_t done = 0;
+  while (done < m->len) {
+    ssize_t n = write(fd, m->data + done, m->len - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+static void worker_start(struct worker* w, char* argv[], char* envp[]) {
+  int in[2];
+  int out[2];
+  if (pipe(in) != 0 || pipe(out) != 0) {
+    fprintf(stderr,"Failed to create pipes: %s. Aborting.\n", strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  w->pid = fork();
+  if (w->pid < 0) {
+    fprintf(stderr,"Failed to fork: %s. Aborting.\n", strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  if (w->pid == 0) {
+    if (dup2(in[0], 0) < 0 || dup2(out[1], 1) < 0) {
+      _exit(ERR_EXIT_CODE);
+    }
+    close(in[0]); close(in[1]);
+    close(out[0]); close(out[1]);
+    signal(SIGPIPE, SIG_DFL);
+    passfd_install();
+    execve(argv[0],argv,envp);
+    fprintf(stderr,"Failed to exec %s: %s\n", argv[0], strerror(errno));
+    _exit(ERR_EXIT_CODE);
+  }
+  close(in[0]);
+  close(out[1]);
+  fcntl(in[1], F_SETFD, FD_CLOEXEC);
+  fcntl(out[0], F_SETFD, FD_CLOEXEC);
+  w->to = in[1];
+  w->from.fd = out[0];
+  w->from.start = w->from.end = 0;
+  trace_instant("worker-start", NULL);
+}
+
+// Closing its stdin is how a worker is told to go away, and it gets
+// WORKER_GRACE_MS to flush and exit; the signal is for those that
+// don't listen.
+static int worker_stop(struct worker* w) {
+  struct timespec poll = { 0, WORKER_POLL_MS * 1000000L };
+  int status = 0;
+  int waited = 0;
+  pid_t rc;
+  close(w->to);
+  close(w->from.fd);
+  while ((rc = waitpid(w->pid, &status, WNOHANG)) == 0 &&
+         waited < WORKER_GRACE_MS) {
+    nanosleep(&poll, NULL);
+    waited += WORKER_POLL_MS;
+  }
+  if (rc == 0 || (rc < 0 && errno == EINTR)) {
+    kill(w->pid, SIGTERM);
+    while (waitpid(w->pid, &status, 0) < 0 && errno == EINTR) {
+    }
+  }
+  w->pid = -1;
+  return status;
+}
+
+int worker_run(char* argv[], char* envp[], int framing, int recycle_after) {
+  struct reader caller = { 0 };
+  struct message request = { NULL, 0, 0 };
+  struct message response = { NULL, 0, 0 };
+  struct worker w = { .pid = -1, .to = -1, .from = { .fd = -1 } };
+  int served = 0;
+  int rc;
+
+  // a dead worker shows up as a failed write instead of killing us.
+  signal(SIGPIPE, SIG_IGN);
+
+  while ((rc = read_message(&caller, framing, &request)) == 1) {
+    int attempt;
+    for (attempt = 0; attempt < 2; attempt++) {
+      if (w.pid < 0) {
+        worker_start(&w, argv, envp);
+        served = 0;
+      }
+      if (write_message(w.to, &request) == 0 &&
+          read_message(&w.from, framing, &response) == 1) {
+        break;
+      }
+      int status = worker_stop(&w);
+      if (WIFSIGNALED(status)) {
+        fprintf(stderr,"userchroot: worker %s killed by signal %d.\n",
+                argv[0], WTERMSIG(status));
+      } else {
+        fprintf(stderr,"userchroot: worker %s exited with status %d.\n",
+                argv[0], WEXITSTATUS(status));
+      }
+    }
+    if (attempt == 2) {
+      fprintf(stderr,"Worker %s failed twice on the same request. Aborting.\n",
+              argv[0]);
+      exit(ERR_EXIT_CODE);
+    }
+    if (write_message(1, &response) != 0) {
+      fprintf(stderr,"Failed to write worker response: %s. Aborting.\n",
+              strerror(errno));
+      exit(ERR_EXIT_CODE);
+    }
+    if (recycle_after > 0 && ++served >= recycle_after) {
+      worker_stop(&w);
+      trace_instant("worker-recycle", NULL);
+    }
+  }
+  if (rc < 0) {
+    fprintf(stderr,"Truncated request from the build system. Aborting.\n");
+    exit(ERR_EXIT_CODE);
+  }
+
+  if (w.pid > 0) {
+    worker_stop(&w);
+  }
+  free(request.data);
+  free(response.data);
+  return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
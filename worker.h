@@ -0,0 +1,21 @@
+// Framing of the messages exchanged with a persistent worker.
+#define WORKER_PROTO 0  // protocol buffers, each preceded by its varint size
+#define WORKER_JSON  1  // one JSON object per line
+
+int worker_run(char* argv[], char* envp[], int framing, int recycle_after);
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------
@@ -0,0 +1,566 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/mount.h>
+#endif
+
+#include "userchroot.h"
+#include "config.h"
+#include "tree.h"
+#include "workspace.h"
+
+/*
+ * Persistent workspaces, so that a CI job can build incrementally on
+ * top of what the previous job on the host built, instead of from
+ * scratch. A workspace is a directory kept outside the image, in a
+ * store owned by root, for one user, image and workspace name, and
+ * mounted on a directory of the image for the length of the job:
+ *
+ *   STORE/<uid>@<image, with '/' as '@'>@<name>/   owned by the user
+ *     work/        what the job sees
+ *     snapshot/    the state after the last successful job
+ *     saved        there if work/ is the same as snapshot/
+ *   STORE/.meta/<uid>@<image>@<name>                owned by root
+ *
+ * After a successful job, work/ is copied to a new snapshot, which
+ * replaces the previous one. A job that fails leaves work/ in whatever
+ * state it got, so the next one starts over from the snapshot; either
+ * way, a job only ever starts from the result of a successful one.
+ * Copies are reflinks where the filesystem of the store has them.
+ *
+ * With a budget, the workspaces used the longest ago are evicted at
+ * launch until the store fits. What a workspace uses, work/ included,
+ * and when it was last used can't come from anything its user can
+ * change: each launch measures its workspace as root, before the job,
+ * and records both in .meta, as the content and the modification time
+ * of a file there. That file is also locked for as long as the job
+ * runs, which is what keeps the workspace from being used twice or
+ * evicted while in use; its user can't open it to hold the lock. A
+ * workspace that can't be measured, being nested deeper than
+ * WORKSPACE_DEPTH_MAX, is evicted.
+ *
+ * '@' isn't a whitelisted character, so the name of a workspace can't
+ * be mistaken for another's. Everything in it is done with the user's
+ * permissions, only creating it in the store and evicting it, which
+ * its user has no way to prevent, need root.
+ */
+
+#define WORKSPACE_THREADS_MAX 8
+#define WORKSPACE_META ".meta"
+// the deepest a workspace is measured, with a descriptor open per level.
+#define WORKSPACE_DEPTH_MAX 128
+
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+
+static int workspace_fd = -1;
+static int workspace_lock = -1;
+static dev_t workspace_dev;
+
+struct workspace_entry {
+  char* name;
+  struct timespec used;
+  unsigned long long size;
+  int unmeasured;
+};
+
+static void as_owner(uid_t owner) {
+  if (seteuid(owner) != 0) {
+    fprintf(stderr,"Failed to switch to the owner. Aborting.\n");
+    exit(ERR_EXIT_CODE);
+  }
+}
+
+static void as_root() {
+  if (seteuid(0) != 0) {
+    fprintf(stderr,"Failed to regain privileges. Aborting.\n");
+    exit(ERR_EXIT_CODE);
+  }
+}
+
+static int copy_threads() {
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads < 1) {
+    return 1;
+  }
+  return threads > WORKSPACE_THREADS_MAX ? WORKSPACE_THREADS_MAX : threads;
+}
+
+// Opens the store, which must be root's like the path leading to it.
+static int open_store(const char* store) {
+  struct stat sb;
+  if (store[0] != '/' || !whitelisted_path(store, 1)) {
+    fprintf(stderr,"Invalid workspace store %s. Aborting.\n", store);
+    exit(ERR_EXIT_CODE);
+  }
+  check_base_path(store);
+  int fd = open(store, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0 || fstat(fd, &sb) != 0) {
+    fprintf(stderr,"Failed to open workspace store %s: %s. Aborting.\n",
+            store, strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  if (sb.st_uid != 0 || (sb.st_mode & 00022)) {
+    fprintf(stderr,"Workspace store %s should be owned and only writable "
+            "by root. Aborting.\n", store);
+    exit(ERR_EXIT_CODE);
+  }
+  return fd;
+}
+
+// Adds the disk usage of 'name' in dir_fd and everything below it, on
+// one filesystem, to 'usage'. Blocks shared by reflinks count once per
+// file. Returns -1 if a directory couldn't be opened, or is deeper
+// than WORKSPACE_DEPTH_MAX, and 'usage' is short of it.
+static int disk_usage(int dir_fd, const char* name, dev_t dev, int depth,
+                      unsigned long long* usage) {
+  struct stat sb;
+  if (fstatat(dir_fd, name, &sb, AT_SYMLINK_NOFOLLOW) != 0 ||
+      sb.st_dev != dev) {
+    return 0;
+  }
+  *usage += (unsigned long long)sb.st_blocks * 512;
+  if (!S_ISDIR(sb.st_mode)) {
+    return 0;
+  }
+  if (depth == WORKSPACE_DEPTH_MAX) {
+    return -1;
+  }
+  int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+                  O_CLOEXEC);
+  DIR* dir = fd < 0 ? NULL : fdopendir(fd);
+  if (dir == NULL) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  int rc = 0;
+  struct dirent* de;
+  while ((de = readdir(dir)) != NULL) {
+    if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0 &&
+        disk_usage(fd, de->d_name, dev, depth + 1, usage) != 0) {
+      rc = -1;
+    }
+  }
+  closedir(dir);
+  return rc;
+}
+
+// Opens the metadata of the store, creating it the first time.
+static int open_meta(int store_fd, const char* store) {
+  struct stat sb;
+  if (mkdirat(store_fd, WORKSPACE_META, 0700) != 0 && errno != EEXIST) {
+    fprintf(stderr,"Failed to create %s/%s: %s. Aborting.\n", store,
+            WORKSPACE_META, strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  int fd = openat(store_fd, WORKSPACE_META, O_RDONLY | O_DIRECTORY |
+                  O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0 || fstat(fd, &sb) != 0 || sb.st_uid != 0 ||
+      (sb.st_mode & 00077)) {
+    fprintf(stderr,"%s/%s should be owned and only accessible by root. "
+            "Aborting.\n", store, WORKSPACE_META);
+    exit(ERR_EXIT_CODE);
+  }
+  return fd;
+}
+
+// Locks the record of the workspace 'key' in .meta for as long as the
+// workspace is in use, or returns -1 if it already is. An evicted
+// record is unlinked while still locked, so a record found unlinked
+// once locked is opened again.
+static int lock_meta(int meta_fd, const char* key) {
+  for (;;) {
+    struct stat sb;
+    int fd = openat(meta_fd, key, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+                    0600);
+    if (fd < 0) {
+      fprintf(stderr,"Failed to lock workspace %s: %s. Aborting.\n", key,
+              strerror(errno));
+      exit(ERR_EXIT_CODE);
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+      close(fd);
+      return -1;
+    }
+    if (fstat(fd, &sb) == 0 && sb.st_nlink > 0) {
+      return fd;
+    }
+    close(fd);
+  }
+}
+
+// Records the size of the workspace 'key', and that it was used at
+// 'used', or now if NULL.
+static void write_meta(int meta_fd, const char* key, unsigned long long size,
+                       const struct timespec* used) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%llu\n", size);
+  int fd = openat(meta_fd, key, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW |
+                  O_CLOEXEC, 0600);
+  if (fd < 0 || write(fd, buf, strlen(buf)) != (ssize_t)strlen(buf)) {
+    fprintf(stderr,"userchroot: failed to record the size of workspace "
+            "%s.\n", key);
+  } else if (used != NULL) {
+    struct timespec times[2] = { *used, *used };
+    futimens(fd, times);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+// Reads the size and last use of the workspace 'key'. Returns -1 if
+// they were never recorded.
+static int read_meta(int meta_fd, const char* key, unsigned long long* size,
+                     struct timespec* used) {
+  struct stat sb;
+  char buf[32];
+  int fd = openat(meta_fd, key, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  int rc = n > 0 && fstat(fd, &sb) == 0 ? 0 : -1;
+  close(fd);
+  if (rc == 0) {
+    buf[n] = 0;
+    *size = strtoull(buf, NULL, 10);
+    *used = sb.st_mtim;
+  }
+  return rc;
+}
+
+static int least_recently_used(const void* a, const void* b) {
+  const struct workspace_entry* x = a;
+  const struct workspace_entry* y = b;
+  if (x->used.tv_sec != y->used.tv_sec) {
+    return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+  }
+  return x->used.tv_nsec < y->used.tv_nsec ? -1 :
+         x->used.tv_nsec > y->used.tv_nsec;
+}
+
+// Evicts the workspaces of the store used the longest ago, other than
+// 'keep' and the ones in use, until the rest fit in 'budget'. Must run
+// as root.
+static void evict(int store_fd, int meta_fd, const char* store,
+                  const char* keep, unsigned long long budget, dev_t dev) {
+  struct workspace_entry* entries = NULL;
+  unsigned long long total = 0;
+  int count = 0;
+  int i;
+  int list_fd = dup(store_fd);
+  DIR* dir = list_fd < 0 ? NULL : fdopendir(list_fd);
+  if (dir == NULL) {
+    fprintf(stderr,"Failed to list %s. Aborting.\n", store);
+    exit(ERR_EXIT_CODE);
+  }
+  struct dirent* de;
+  while ((de = readdir(dir)) != NULL) {
+    struct stat sb;
+    if (de->d_name[0] == '.') {
+      continue;
+    }
+    int fd = openat(store_fd, de->d_name, O_RDONLY | O_DIRECTORY |
+                    O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+      continue;
+    }
+    if (fstat(fd, &sb) == 0) {
+      if (count % 64 == 0) {
+        entries = realloc(entries, (count + 64) * sizeof(*entries));
+      }
+      if (entries == NULL || (entries[count].name = strdup(de->d_name)) ==
+          NULL) {
+        fprintf(stderr,"Failed to allocate memory. Aborting.\n");
+        exit(ERR_EXIT_CODE);
+      }
+      entries[count].unmeasured = 0;
+      if (read_meta(meta_fd, de->d_name, &entries[count].size,
+                    &entries[count].used) != 0) {
+        // never measured: measured now, and the first to go.
+        entries[count].size = 0;
+        entries[count].unmeasured =
+          disk_usage(store_fd, de->d_name, dev, 0, &entries[count].size);
+        entries[count].used.tv_sec = 0;
+        entries[count].used.tv_nsec = 0;
+        write_meta(meta_fd, de->d_name, entries[count].size,
+                   &entries[count].used);
+      }
+      total += entries[count].size;
+      count++;
+    }
+    close(fd);
+  }
+  closedir(dir);
+
+  qsort(entries, count, sizeof(*entries), least_recently_used);
+  for (i = 0; i < count; i++) {
+    if ((total <= budget && !entries[i].unmeasured) ||
+        strcmp(entries[i].name, keep) == 0) {
+      continue;
+    }
+    int fd = lock_meta(meta_fd, entries[i].name);
+    if (fd < 0) {
+      continue;
+    }
+    // as root: nothing the owner does in the workspace, like taking
+    // away their own permissions, keeps it in the store.
+    if (tree_remove(store_fd, entries[i].name, dev) == 0) {
+      unlinkat(meta_fd, entries[i].name, 0);
+      total -= entries[i].size;
+    } else {
+      fprintf(stderr,"userchroot: failed to evict workspace %s/%s: %s.\n",
+              store, entries[i].name, strerror(errno));
+    }
+    close(fd);
+  }
+  for (i = 0; i < count; i++) {
+    free(entries[i].name);
+  }
+  free(entries);
+}
+
+// Makes work/ what the last successful job left, unless it already is.
+// Runs as the owner.
+static void restore(const char* key) {
+  struct stat sb;
+  if (unlinkat(workspace_fd, "saved", 0) == 0) {
+    return;
+  }
+  if (fstatat(workspace_fd, "work", &sb, AT_SYMLINK_NOFOLLOW) == 0 &&
+      tree_remove(workspace_fd, "work", workspace_dev) != 0) {
+    fprintf(stderr,"Failed to clear workspace %s: %s. Aborting.\n", key,
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  if (mkdirat(workspace_fd, "work", 0755) != 0) {
+    fprintf(stderr,"Failed to create workspace %s: %s. Aborting.\n", key,
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  int snapshot_fd = openat(workspace_fd, "snapshot", O_RDONLY |
+                           O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (snapshot_fd < 0) {
+    return;
+  }
+  int work_fd = openat(workspace_fd, "work", O_RDONLY | O_DIRECTORY |
+                       O_NOFOLLOW | O_CLOEXEC);
+  if (work_fd < 0 || tree_copy(snapshot_fd, work_fd, ".",
+                               copy_threads()) != 0) {
+    fprintf(stderr,"Failed to restore workspace %s. Aborting.\n", key);
+    exit(ERR_EXIT_CODE);
+  }
+  close(work_fd);
+  close(snapshot_fd);
+}
+
+// Opens the workspace 'key' of 'owner' in the store, creating it the
+// first time.
+static int open_workspace(int store_fd, const char* store, const char* key,
+                          uid_t owner) {
+  struct stat sb;
+  if (mkdirat(store_fd, key, 0700) == 0) {
+    if (fchownat(store_fd, key, owner, -1, AT_SYMLINK_NOFOLLOW) != 0) {
+      fprintf(stderr,"Failed to give workspace %s to its owner. "
+              "Aborting.\n", key);
+      exit(ERR_EXIT_CODE);
+    }
+  } else if (errno != EEXIST) {
+    fprintf(stderr,"Failed to create workspace %s/%s: %s. Aborting.\n",
+            store, key, strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  int fd = openat(store_fd, key, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+                  O_CLOEXEC);
+  if (fd < 0 || fstat(fd, &sb) != 0 || sb.st_uid != owner ||
+      sb.st_dev != workspace_dev) {
+    fprintf(stderr,"Failed to open workspace %s/%s. Aborting.\n", store,
+            key);
+    exit(ERR_EXIT_CODE);
+  }
+  return fd;
+}
+
+// Restores the workspace 'name' of 'owner' for 'image' from the store
+// of the base, and mounts it on the directory target_fd, opened with
+// output_open. Must run as root, in a private mount namespace.
+void workspace_enter(const struct image_options* opts, const char* image,
+                     const char* name, int target_fd, uid_t owner) {
+#ifdef __linux__
+  struct stat sb;
+  char key[NAME_MAX + 1];
+  char source[64];
+  char target[64];
+  char* p;
+  int store_fd = open_store(opts->workspaces);
+  if (fstat(store_fd, &sb) != 0) {
+    fprintf(stderr,"Failed to stat %s. Aborting.\n", opts->workspaces);
+    exit(ERR_EXIT_CODE);
+  }
+  workspace_dev = sb.st_dev;
+  if (snprintf(key, sizeof(key), "%d%s@%s", (int)owner, image, name) >=
+      (int)sizeof(key)) {
+    fprintf(stderr,"Workspace name %s is too long for %s. Aborting.\n",
+            name, image);
+    exit(ERR_EXIT_CODE);
+  }
+  for (p = key; *p; p++) {
+    if (*p == '/') {
+      *p = '@';
+    }
+  }
+  // held until the job is done and saved.
+  int meta_fd = open_meta(store_fd, opts->workspaces);
+  workspace_lock = lock_meta(meta_fd, key);
+  if (workspace_lock < 0) {
+    fprintf(stderr,"Workspace %s is in use by another job. Aborting.\n",
+            name);
+    exit(ERR_EXIT_CODE);
+  }
+  workspace_fd = open_workspace(store_fd, opts->workspaces, key, owner);
+  // what the last job left, before the owner gets to it again.
+  unsigned long long size = 0;
+  if (disk_usage(store_fd, key, workspace_dev, 0, &size) != 0) {
+    fprintf(stderr,"userchroot: workspace %s can't be measured, starting "
+            "it over.\n", name);
+    close(workspace_fd);
+    tree_remove(store_fd, key, workspace_dev);
+    workspace_fd = open_workspace(store_fd, opts->workspaces, key, owner);
+    size = 0;
+    disk_usage(store_fd, key, workspace_dev, 0, &size);
+  }
+  write_meta(meta_fd, key, size, NULL);
+  if (opts->workspace_budget > 0) {
+    evict(store_fd, meta_fd, opts->workspaces, key, opts->workspace_budget,
+          workspace_dev);
+  }
+  close(meta_fd);
+  close(store_fd);
+
+  as_owner(owner);
+  restore(key);
+  int work_fd = openat(workspace_fd, "work", O_PATH | O_DIRECTORY |
+                       O_NOFOLLOW | O_CLOEXEC);
+  as_root();
+  if (work_fd < 0) {
+    fprintf(stderr,"Failed to open workspace %s: %s. Aborting.\n", key,
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  snprintf(source, sizeof(source), "/proc/self/fd/%d", work_fd);
+  snprintf(target, sizeof(target), "/proc/self/fd/%d", target_fd);
+  if (mount(source, target, NULL, MS_BIND, NULL) != 0) {
+    fprintf(stderr,"Failed to mount workspace %s: %s. Aborting.\n", name,
+            strerror(errno));
+    exit(ERR_EXIT_CODE);
+  }
+  close(work_fd);
+#else
+  fprintf(stderr,"Workspaces are only supported on Linux. Aborting.\n");
+  exit(ERR_EXIT_CODE);
+#endif
+}
+
+// Makes a snapshot of work/ after a successful job, replacing the
+// previous one. Runs as the owner, after the chroot. Returns 0 on
+// success; failures are reported on stderr and leave the previous
+// snapshot in place.
+int workspace_save() {
+  struct stat sb;
+  if (fstatat(workspace_fd, "snapshot.new", &sb, AT_SYMLINK_NOFOLLOW) == 0) {
+    tree_remove(workspace_fd, "snapshot.new", workspace_dev);
+  }
+  if (mkdirat(workspace_fd, "snapshot.new", 0755) != 0) {
+    fprintf(stderr,"Failed to create a snapshot: %s.\n", strerror(errno));
+    return -1;
+  }
+  int work_fd = openat(workspace_fd, "work", O_RDONLY | O_DIRECTORY |
+                       O_NOFOLLOW | O_CLOEXEC);
+  int new_fd = openat(workspace_fd, "snapshot.new", O_RDONLY |
+                      O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  int rc = -1;
+  if (work_fd >= 0 && new_fd >= 0) {
+    rc = tree_copy(work_fd, new_fd, ".", copy_threads());
+  }
+  if (work_fd >= 0) {
+    close(work_fd);
+  }
+  if (new_fd >= 0) {
+    close(new_fd);
+  }
+  if (rc != 0) {
+    return -1;
+  }
+
+#ifdef SYS_renameat2
+  rc = syscall(SYS_renameat2, workspace_fd, "snapshot.new", workspace_fd,
+               "snapshot", RENAME_EXCHANGE);
+#else
+  rc = -1;
+  errno = ENOENT;
+#endif
+  if (rc != 0) {
+    // the first snapshot, or no way to exchange the two.
+    if (errno != ENOENT && errno != ENOSYS && errno != EINVAL) {
+      fprintf(stderr,"Failed to replace the snapshot: %s.\n",
+              strerror(errno));
+      return -1;
+    }
+    if (fstatat(workspace_fd, "snapshot", &sb, AT_SYMLINK_NOFOLLOW) == 0) {
+      tree_remove(workspace_fd, "snapshot", workspace_dev);
+    }
+    if (renameat(workspace_fd, "snapshot.new", workspace_fd,
+                 "snapshot") != 0) {
+      fprintf(stderr,"Failed to replace the snapshot: %s.\n",
+              strerror(errno));
+      return -1;
+    }
+  } else {
+    tree_remove(workspace_fd, "snapshot.new", workspace_dev);
+  }
+
+  int fd = openat(workspace_fd, "saved", O_WRONLY | O_CREAT | O_NOFOLLOW |
+              O_CLOEXEC, 0644);
+  if (fd < 0) {
+    fprintf(stderr,"Failed to mark the workspace as saved: %s.\n",
+            strerror(errno));
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Copyright 2015 Bloomberg Finance L.P.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------- END-OF-FILE ----------------------------------